@@ -0,0 +1,191 @@
+// Collector benchmark. mqtteer.c is built in this translation unit to reach
+// its collectors, run them on the tree given by MQTTEER_ROOT and publish
+// their values to the broker given by MQTTEER_HOST and MQTTEER_PORT,
+// reporting the wall time, system calls and heap allocations of a cycle.
+// See bench/run.py.
+
+#define main mqtteer_main
+#include "../mqtteer.c"
+#undef main
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define BENCH_CYCLES 100
+#define BENCH_CONNECT_TIMEOUT 5
+#define TRACEPOINT_ID "/events/raw_syscalls/sys_enter/id"
+
+// every allocation of the process goes through these, the glibc ones do the
+// actual work
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long bench_allocs;
+
+void *malloc(size_t size) {
+  bench_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  bench_allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  bench_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+// System calls are counted by the raw_syscalls:sys_enter tracepoint, which
+// needs perf_event_paranoid <= -1 or CAP_PERFMON.
+static int bench_syscalls_fd = -1;
+
+static void bench_syscalls_open(void) {
+  static const char *tracefs[] = {"/sys/kernel/tracing",
+                                  "/sys/kernel/debug/tracing"};
+  char path[64];
+  long long id = -1;
+
+  for (unsigned i = 0; i < 2 && id < 0; i++) {
+    sprintf(path, "%s" TRACEPOINT_ID, tracefs[i]);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+      continue;
+    if (fscanf(file, "%lld", &id) != 1)
+      id = -1;
+    fclose(file);
+  }
+
+  struct perf_event_attr attr = {
+      .type = PERF_TYPE_TRACEPOINT,
+      .size = sizeof(attr),
+      .config = (unsigned long long)id,
+  };
+  if (id >= 0)
+    bench_syscalls_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                                     PERF_FLAG_FD_CLOEXEC);
+  if (bench_syscalls_fd < 0)
+    fprintf(stderr, "system calls are not counted: %s\n",
+            id < 0 ? "no raw_syscalls tracepoint" : strerror(errno));
+}
+
+static long long bench_syscalls(void) {
+  long long count;
+
+  if (bench_syscalls_fd < 0 ||
+      read(bench_syscalls_fd, &count, sizeof(count)) != sizeof(count))
+    return -1;
+  return count;
+}
+
+struct bench_sample {
+  struct timespec start;
+  long long syscalls;
+  unsigned long allocs;
+};
+
+static void bench_start(struct bench_sample *sample) {
+  sample->syscalls = bench_syscalls();
+  sample->allocs = bench_allocs;
+  clock_gettime(CLOCK_MONOTONIC, &sample->start);
+}
+
+static void bench_report(const char *name, const struct bench_sample *sample,
+                         unsigned cycles) {
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unsigned long allocs = bench_allocs - sample->allocs;
+  long long syscalls = bench_syscalls();
+  double wall = (double)(end.tv_sec - sample->start.tv_sec) * 1e6 +
+                (double)(end.tv_nsec - sample->start.tv_nsec) / 1e3;
+
+  printf("%-12s %12.1f", name, wall / cycles);
+  // reading the counter is a system call itself
+  if (syscalls >= 0 && sample->syscalls >= 0)
+    printf(" %10.1f", (double)(syscalls - sample->syscalls - 1) / cycles);
+  else
+    printf(" %10s", "-");
+  printf(" %10.1f\n", (double)allocs / cycles);
+}
+
+static void bench_flush(void) {
+  while (mosquitto_want_write(mosq))
+    mqtteer_check_mosquitto(mosquitto_loop_write(mosq, 1));
+}
+
+static void bench_publish(mqtteer_reports *reports) {
+  for (unsigned i = 0; i < reports->ngroups; i++) {
+    if (!reports->groups[i].active || reports->groups[i].nslots == 0)
+      continue;
+    mqtteer_reports_update_published(reports, i, true);
+    mqtteer_send_metrics(reports, i);
+  }
+}
+
+int main(void) {
+  static mqtteer_reports reports;
+  struct bench_sample sample;
+
+  unsigned cycles = mqtteer_getenv_interval("MQTTEER_BENCH_CYCLES",
+                                            BENCH_CYCLES);
+  mqtteer_init_mosquitto();
+  if (getenv("MQTTEER_ROOT") != NULL)
+    mqtteer_root = getenv("MQTTEER_ROOT");
+  mqtteer_sample_init();
+  mqtteer_init_collectors(&reports);
+
+  // blocking is fine here, there is nothing else to do
+  int ret = mosquitto_connect(mosq, mqtteer_broker_host, mqtteer_broker_port,
+                              MOSQ_KEEPALIVE);
+  if (ret != MOSQ_ERR_SUCCESS) {
+    fprintf(stderr, "failed to connect to %s: %s\n", mqtteer_broker_host,
+            mosquitto_strerror(ret));
+    exit(EXIT_FAILURE);
+  }
+  time_t deadline = time(NULL) + BENCH_CONNECT_TIMEOUT;
+  while (!mqtteer_connected && time(NULL) < deadline)
+    mqtteer_check_mosquitto(mosquitto_loop(mosq, 100, 1));
+  if (!mqtteer_connected) {
+    fprintf(stderr, "could not connect to the broker\n");
+    exit(EXIT_FAILURE);
+  }
+  mqtteer_announce_topics(&reports);
+  bench_flush();
+
+  bench_syscalls_open();
+  printf("%u slots in %u groups, per cycle of %u:\n", reports.nb,
+         reports.ngroups, cycles);
+  printf("%-12s %12s %10s %10s\n", "", "wall us", "syscalls", "allocs");
+
+  for (unsigned i = 0; i < NCOLLECTORS; i++) {
+    bench_start(&sample);
+    for (unsigned cycle = 0; cycle < cycles; cycle++)
+      mqtteer_collect(&reports, i);
+    bench_report(mqtteer_collectors[i].name, &sample, cycles);
+  }
+
+  // nothing is sent while disconnected and the spool is not enabled, this
+  // only leaves building the payloads
+  mqtteer_connected = false;
+  bench_start(&sample);
+  for (unsigned cycle = 0; cycle < cycles; cycle++)
+    bench_publish(&reports);
+  bench_report("serialize", &sample, cycles);
+  mqtteer_connected = true;
+
+  bench_start(&sample);
+  for (unsigned cycle = 0; cycle < cycles; cycle++) {
+    bench_publish(&reports);
+    bench_flush();
+  }
+  bench_report("publish", &sample, cycles);
+
+  mosquitto_disconnect(mosq);
+  exit(EXIT_SUCCESS);
+}
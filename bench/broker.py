@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Stand-in MQTT broker for benchmarks.
+
+  broker.py [port]
+
+It accepts any client, acknowledges CONNECT, SUBSCRIBE, PINGREQ and QoS 1
+and 2 PUBLISH packets and drops every message, so that publishing can be
+measured without a real broker. It prints the port it listens on.
+"""
+
+import socket
+import socketserver
+import sys
+import threading
+
+CONNECT = 1
+PUBLISH = 3
+PUBREL = 6
+SUBSCRIBE = 8
+PINGREQ = 12
+DISCONNECT = 14
+
+
+class Handler(socketserver.BaseRequestHandler):
+    def recv_exact(self, length):
+        data = b""
+        while len(data) < length:
+            chunk = self.request.recv(length - len(data))
+            if not chunk:
+                raise EOFError
+            data += chunk
+        return data
+
+    def packet(self):
+        header = self.recv_exact(1)[0]
+        length, shift = 0, 0
+        while True:
+            byte = self.recv_exact(1)[0]
+            length |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        return header, self.recv_exact(length)
+
+    def handle(self):
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        try:
+            while True:
+                header, body = self.packet()
+                kind, flags = header >> 4, header & 0x0F
+                if kind == CONNECT:
+                    # MQTT 5 CONNACK carries an empty property list
+                    version = body[6] if len(body) > 6 else 4
+                    self.request.sendall(b"\x20\x03\x00\x00\x00"
+                                         if version == 5 else
+                                         b"\x20\x02\x00\x00")
+                elif kind == PUBLISH and flags & 0x06:
+                    topic_len = int.from_bytes(body[:2], "big")
+                    mid = body[2 + topic_len:4 + topic_len]
+                    # PUBACK or PUBREC
+                    kind = 0x40 if flags & 0x06 == 0x02 else 0x50
+                    self.request.sendall(bytes([kind, 2]) + mid)
+                elif kind == PUBREL:
+                    self.request.sendall(b"\x70\x02" + body[:2])
+                elif kind == SUBSCRIBE:
+                    self.request.sendall(b"\x90\x03" + body[:2] + b"\x00")
+                elif kind == PINGREQ:
+                    self.request.sendall(b"\xd0\x00")
+                elif kind == DISCONNECT:
+                    return
+        except (EOFError, ConnectionError):
+            return
+
+
+class Broker(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def start(port=0):
+    broker = Broker(("127.0.0.1", port), Handler)
+    threading.Thread(target=broker.serve_forever, daemon=True).start()
+    return broker
+
+
+def main():
+    broker = start(int(sys.argv[1]) if len(sys.argv) > 1 else 0)
+    print(broker.server_address[1], flush=True)
+    threading.Event().wait()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Fixture trees of the /proc and /sys files mqtteer reads.
+
+  fixtures.py generate <laptop|server> <dest>
+  fixtures.py record <dest> [cgroup glob...]
+
+Generated trees are deterministic stand-ins for a small laptop and a
+256-core server with hundreds of hwmon chips, disks, interfaces and cgroups.
+Recorded trees are copies of the files of this host, to be used with
+MQTTEER_ROOT=<dest>.
+"""
+
+import glob
+import os
+import random
+import shutil
+import sys
+
+PROFILES = {
+    "laptop": {
+        "cpus": 8,
+        "memory_kb": 16 * 1024 * 1024,
+        "hwmon": [("acpitz", 1), ("coretemp", 9), ("nvme", 3),
+                  ("iwlwifi_1", 1), ("BAT0", 0)],
+        "batteries": 1,
+        "interfaces": ["lo", "wlp0s20f3", "docker0"],
+        "disks": [("nvme0n1", 3)],
+        "cgroups": ["user.slice/user-1000.slice/user@1000.service/app.slice/"
+                    "app-%d.scope" % i for i in range(20)],
+    },
+    "server": {
+        "cpus": 256,
+        "memory_kb": 1024 * 1024 * 1024,
+        "hwmon": [("coretemp", 33)] * 8 + [("nvme", 3)] * 24 +
+                 [("mlx5", 1)] * 8 + [("drivetemp", 1)] * 160,
+        "batteries": 0,
+        "interfaces": ["lo"] + ["eno%d" % i for i in range(4)] +
+                      ["veth%08x" % i for i in range(60)],
+        "disks": [("nvme%dn1" % i, 2) for i in range(24)] +
+                 [("sd%s" % chr(ord("a") + i), 1) for i in range(8)],
+        "cgroups": ["system.slice/unit-%03d.service" % i for i in range(300)],
+    },
+}
+
+
+def write(root, path, content):
+    path = os.path.join(root, path.lstrip("/"))
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "w") as f:
+        f.write(content)
+
+
+def psi(rng, full=True):
+    lines = []
+    for kind in ["some", "full"] if full else ["some"]:
+        lines.append("%s avg10=%.2f avg60=%.2f avg300=%.2f total=%d\n" %
+                     (kind, rng.random() * 5, rng.random() * 3,
+                      rng.random(), rng.randrange(1 << 40)))
+    return "".join(lines)
+
+
+def generate(name, root):
+    profile = PROFILES[name]
+    rng = random.Random(name)
+    ncpus = profile["cpus"]
+
+    stat = []
+    cores = [[rng.randrange(1 << 32) for _ in range(10)]
+             for _ in range(ncpus)]
+    total = [sum(core[i] for core in cores) for i in range(10)]
+    stat.append("cpu  " + " ".join(map(str, total)) + "\n")
+    for i, core in enumerate(cores):
+        stat.append("cpu%d " % i + " ".join(map(str, core)) + "\n")
+    stat.append("intr " + " ".join(["123456"] * 512) + "\n")
+    stat.append("ctxt 987654321\nbtime 1700000000\nprocesses 123456\n"
+                "procs_running 3\nprocs_blocked 0\n")
+    write(root, "/proc/stat", "".join(stat))
+    write(root, "/sys/devices/system/cpu/possible", "0-%d\n" % (ncpus - 1))
+
+    write(root, "/proc/loadavg", "%.2f %.2f %.2f 3/1234 56789\n" %
+          (ncpus / 10, ncpus / 12, ncpus / 14))
+    write(root, "/proc/uptime", "123456.78 %d.00\n" % (123456 * ncpus))
+    memory = profile["memory_kb"]
+    write(root, "/proc/meminfo",
+          "MemTotal:       %d kB\nMemFree:        %d kB\n"
+          "MemAvailable:   %d kB\nBuffers:        1024 kB\n"
+          "Cached:         %d kB\nSwapTotal:      0 kB\nSwapFree:       0 kB\n"
+          % (memory, memory // 4, memory // 2, memory // 8))
+    for kind in ["cpu", "memory", "io"]:
+        write(root, "/proc/pressure/" + kind, psi(rng))
+
+    for i, (chip, ntemps) in enumerate(profile["hwmon"]):
+        hwmon = "/sys/class/hwmon/hwmon%d/" % i
+        write(root, hwmon + "name", chip + "\n")
+        for t in range(1, ntemps + 1):
+            write(root, hwmon + "temp%d_input" % t,
+                  "%d\n" % rng.randrange(30000, 80000))
+            if chip == "coretemp":
+                label = "Package id 0" if t == 1 else "Core %d" % (t - 2)
+                write(root, hwmon + "temp%d_label" % t, label + "\n")
+
+    for i in range(profile["batteries"]):
+        write(root, "/sys/class/power_supply/BAT%d/capacity" % i, "87\n")
+    write(root, "/sys/class/power_supply/AC/online", "1\n")
+
+    netdev = ["Inter-|   Receive                                            "
+              "    |  Transmit\n",
+              " face |bytes    packets errs drop fifo frame compressed "
+              "multicast|bytes    packets errs drop fifo colls carrier "
+              "compressed\n"]
+    for iface in profile["interfaces"]:
+        counters = [rng.randrange(1 << 40) for _ in range(16)]
+        netdev.append("%6s: " % iface + " ".join(map(str, counters)) + "\n")
+    write(root, "/proc/net/dev", "".join(netdev))
+
+    diskstats = []
+    minor = 0
+    for disk, nparts in profile["disks"]:
+        names = [disk] + [(disk + "p%d" if disk[-1].isdigit() else disk + "%d")
+                          % p for p in range(1, nparts + 1)]
+        for j, dev in enumerate(names):
+            fields = [rng.randrange(1 << 32) for _ in range(17)]
+            diskstats.append("%4d %7d %s " % (259, minor, dev) +
+                             " ".join(map(str, fields)) + "\n")
+            minor += 1
+            if j > 0:
+                write(root, "/sys/class/block/%s/partition" % dev, "%d\n" % j)
+    write(root, "/proc/diskstats", "".join(diskstats))
+
+    for cgroup in profile["cgroups"]:
+        base = "/sys/fs/cgroup/" + cgroup + "/"
+        write(root, base + "cpu.stat",
+              "usage_usec %d\nuser_usec %d\nsystem_usec %d\n"
+              "nr_periods 0\nnr_throttled 0\nthrottled_usec 0\n" %
+              tuple(rng.randrange(1 << 36) for _ in range(3)))
+        write(root, base + "memory.current", "%d\n" % rng.randrange(1 << 30))
+        write(root, base + "memory.stat",
+              "anon %d\nfile %d\nkernel 1048576\nsock 0\nshmem 0\n" %
+              (rng.randrange(1 << 29), rng.randrange(1 << 29)))
+        write(root, base + "io.stat",
+              "259:0 rbytes=%d wbytes=%d rios=%d wios=%d dbytes=0 dios=0\n" %
+              tuple(rng.randrange(1 << 32) for _ in range(4)))
+        for kind in ["cpu", "memory", "io"]:
+            write(root, base + kind + ".pressure", psi(rng))
+
+
+RECORDED = [
+    "/proc/stat", "/proc/loadavg", "/proc/uptime", "/proc/meminfo",
+    "/proc/diskstats", "/proc/net/dev", "/proc/pressure/*",
+    "/sys/devices/system/cpu/possible", "/sys/class/hwmon/*/name",
+    "/sys/class/hwmon/*/temp*_input", "/sys/class/hwmon/*/temp*_label",
+    "/sys/class/power_supply/*/capacity", "/sys/class/block/*/partition",
+]
+
+CGROUP_FILES = ["cpu.stat", "memory.current", "memory.stat", "io.stat",
+                "cpu.pressure", "memory.pressure", "io.pressure"]
+
+
+def record(root, cgroups):
+    patterns = RECORDED + ["/sys/fs/cgroup/%s/%s" % (cgroup, name)
+                           for cgroup in cgroups for name in CGROUP_FILES]
+    for pattern in patterns:
+        for path in glob.glob(pattern):
+            try:
+                with open(path) as f:
+                    content = f.read()
+            except OSError:
+                continue
+            write(root, path, content)
+
+
+def main():
+    if len(sys.argv) >= 4 and sys.argv[1] == "generate" and \
+            sys.argv[2] in PROFILES:
+        shutil.rmtree(sys.argv[3], ignore_errors=True)
+        generate(sys.argv[2], sys.argv[3])
+    elif len(sys.argv) >= 3 and sys.argv[1] == "record":
+        record(sys.argv[2], sys.argv[3:])
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == "__main__":
+    main()
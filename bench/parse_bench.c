@@ -0,0 +1,227 @@
+// Parser microbenchmark: time per parse of the buffers the collectors read,
+// for parse.c and for the equivalent strtoull/strtod loops. The buffers are
+// built here so that the results only depend on the code.
+
+#include <string.h>
+
+#include "../mqtteer.h"
+
+#define BENCH_TARGET_NS 200000000.0
+#define BENCH_CPUS 256
+#define BENCH_DISKS 64
+
+static char stat_buf[(BENCH_CPUS + 1) * 256];
+static char psi_buf[256];
+static char meminfo_buf[2048];
+static char diskstats_buf[BENCH_DISKS * 256];
+static size_t stat_len, psi_len, meminfo_len, diskstats_len;
+
+// keeps the results alive
+static volatile unsigned long long bench_sink;
+
+static void bench_buffers(void) {
+  int len;
+
+  len = sprintf(stat_buf, "cpu  ");
+  for (unsigned i = 0; i < 10; i++)
+    len += sprintf(stat_buf + len, " %u", 123456789u * (i + 1));
+  for (unsigned cpu = 0; cpu < BENCH_CPUS; cpu++) {
+    len += sprintf(stat_buf + len, "\ncpu%u", cpu);
+    for (unsigned i = 0; i < 10; i++)
+      len += sprintf(stat_buf + len, " %u", 4567u * (cpu + 1) * (i + 1));
+  }
+  len += sprintf(stat_buf + len, "\nctxt 987654321\n");
+  stat_len = (size_t)len;
+
+  psi_len = (size_t)sprintf(
+      psi_buf, "some avg10=1.23 avg60=0.87 avg300=0.41 total=123456789\n"
+               "full avg10=0.52 avg60=0.33 avg300=0.12 total=45678901\n");
+
+  len = 0;
+  static const char *MEMINFO_KEYS[] = {
+      "MemTotal",     "MemFree",        "MemAvailable", "Buffers",
+      "Cached",       "SwapCached",     "Active",       "Inactive",
+      "Active(anon)", "Inactive(anon)", "Active(file)", "Inactive(file)",
+      "Unevictable",  "Mlocked",        "SwapTotal",    "SwapFree",
+      "Dirty",        "Writeback",      "AnonPages",    "Mapped",
+      "Shmem",
+  };
+  for (unsigned i = 0; i < sizeof(MEMINFO_KEYS) / sizeof(MEMINFO_KEYS[0]);
+       i++)
+    len += sprintf(meminfo_buf + len, "%s:%*u kB\n", MEMINFO_KEYS[i],
+                   (int)(24 - strlen(MEMINFO_KEYS[i])), 16384000u / (i + 1));
+  meminfo_len = (size_t)len;
+
+  len = 0;
+  for (unsigned disk = 0; disk < BENCH_DISKS; disk++) {
+    len += sprintf(diskstats_buf + len, " 259 %7u nvme%un1", disk, disk);
+    for (unsigned i = 0; i < 17; i++)
+      len += sprintf(diskstats_buf + len, " %u", 98765u * (disk + 1) + i);
+    diskstats_buf[len++] = '\n';
+  }
+  diskstats_len = (size_t)len;
+}
+
+static void stat_parser(void) {
+  struct mqtteer_parser parser;
+  unsigned long long value, sum = 0;
+
+  mqtteer_parser_init(&parser, stat_buf, stat_len);
+  while (mqtteer_parse_literal(&parser, "cpu") == 0) {
+    if (mqtteer_parse_char(&parser, ' ') < 0)
+      mqtteer_parse_ull(&parser, &value);
+    while (mqtteer_parse_ull(&parser, &value) == 0)
+      sum += value;
+    mqtteer_parse_next_line(&parser);
+  }
+  bench_sink = sum;
+}
+
+static void stat_libc(void) {
+  unsigned long long sum = 0;
+
+  for (const char *pos = stat_buf; strncmp(pos, "cpu", 3) == 0;) {
+    char *endptr;
+    pos += 3;
+    if (*pos != ' ')
+      strtoull(pos, (char **)&pos, 10);
+    for (;;) {
+      unsigned long long value = strtoull(pos, &endptr, 10);
+      if (endptr == pos)
+        break;
+      sum += value;
+      pos = endptr;
+    }
+    pos = strchr(pos, '\n');
+    if (pos == NULL)
+      break;
+    pos++;
+  }
+  bench_sink = sum;
+}
+
+static void psi_parser(void) {
+  struct mqtteer_psi psi;
+
+  mqtteer_psi_parse(psi_buf, psi_len, &psi);
+  bench_sink = (unsigned long long)psi.some.total;
+}
+
+static void psi_libc(void) {
+  double sum = 0;
+
+  for (const char *pos = strchr(psi_buf, '='); pos != NULL;
+       pos = strchr(pos, '='))
+    sum += strtod(pos + 1, (char **)&pos);
+  bench_sink = (unsigned long long)sum;
+}
+
+static void meminfo_parser(void) {
+  unsigned long long total = 0, available = 0;
+
+  mqtteer_parse_keyed_ull(meminfo_buf, meminfo_len, "MemTotal", &total);
+  mqtteer_parse_keyed_ull(meminfo_buf, meminfo_len, "MemAvailable",
+                          &available);
+  bench_sink = total - available;
+}
+
+static void meminfo_libc(void) {
+  unsigned long long values[2] = {0};
+  static const char *KEYS[] = {"MemTotal:", "MemAvailable:"};
+
+  for (unsigned i = 0; i < 2; i++) {
+    const char *line = strstr(meminfo_buf, KEYS[i]);
+    if (line != NULL)
+      values[i] = strtoull(line + strlen(KEYS[i]), NULL, 10);
+  }
+  bench_sink = values[0] - values[1];
+}
+
+static void diskstats_parser(void) {
+  struct mqtteer_parser parser;
+  unsigned long long value, sum = 0;
+  const char *name;
+  size_t len;
+
+  mqtteer_parser_init(&parser, diskstats_buf, diskstats_len);
+  for (; !mqtteer_parser_eof(&parser); mqtteer_parse_next_line(&parser)) {
+    mqtteer_parse_ull(&parser, &value);
+    mqtteer_parse_ull(&parser, &value);
+    mqtteer_parse_word(&parser, &name, &len);
+    while (mqtteer_parse_ull(&parser, &value) == 0)
+      sum += value;
+  }
+  bench_sink = sum;
+}
+
+static void diskstats_libc(void) {
+  unsigned long long sum = 0;
+  char name[32];
+  int end;
+
+  for (const char *line = diskstats_buf; *line != '\0';) {
+    unsigned major, minor;
+    if (sscanf(line, "%u %u %31s%n", &major, &minor, name, &end) != 3)
+      break;
+    const char *pos = line + end;
+    char *endptr;
+    for (;;) {
+      unsigned long long value = strtoull(pos, &endptr, 10);
+      if (endptr == pos)
+        break;
+      sum += value;
+      pos = endptr;
+    }
+    line = strchr(pos, '\n');
+    if (line == NULL)
+      break;
+    line++;
+  }
+  bench_sink = sum;
+}
+
+static double bench_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+// run long enough for the clock resolution not to matter
+static double bench_ns(void (*fn)(void)) {
+  unsigned long iterations = 1;
+  double elapsed;
+
+  for (;;) {
+    double start = bench_now();
+    for (unsigned long i = 0; i < iterations; i++)
+      fn();
+    elapsed = bench_now() - start;
+    if (elapsed >= BENCH_TARGET_NS / 10)
+      break;
+    iterations *= 10;
+  }
+
+  return elapsed / (double)iterations;
+}
+
+int main(void) {
+  static const struct {
+    const char *name;
+    void (*parser)(void);
+    void (*libc)(void);
+  } BENCHES[] = {
+      {"stat", stat_parser, stat_libc},
+      {"psi", psi_parser, psi_libc},
+      {"meminfo", meminfo_parser, meminfo_libc},
+      {"diskstats", diskstats_parser, diskstats_libc},
+  };
+
+  bench_buffers();
+  printf("%-12s %12s %12s\n", "ns per file", "parse.c", "libc");
+  for (unsigned i = 0; i < sizeof(BENCHES) / sizeof(BENCHES[0]); i++)
+    printf("%-12s %12.1f %12.1f\n", BENCHES[i].name,
+           bench_ns(BENCHES[i].parser), bench_ns(BENCHES[i].libc));
+
+  return EXIT_SUCCESS;
+}
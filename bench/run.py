@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Run mqtteer-bench on fixture trees against the stand-in broker.
+
+  run.py <mqtteer-bench> [fixture dir...]
+
+Without fixture directories, the laptop and server profiles of fixtures.py
+are generated in a temporary directory.
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import broker  # noqa: E402
+import fixtures  # noqa: E402
+
+
+def run(bench, root, port):
+    cgroups = os.path.join(root, "sys/fs/cgroup")
+    specs = sorted({os.path.relpath(os.path.dirname(path), cgroups) + "/*"
+                    for path, _, files in os.walk(cgroups)
+                    if "cpu.stat" in files})
+    env = dict(os.environ,
+               MQTTEER_ROOT=root,
+               MQTTEER_HOST="127.0.0.1",
+               MQTTEER_PORT=str(port),
+               MQTTEER_USERNAME="bench",
+               MQTTEER_PASSWORD="bench",
+               MQTTEER_DEVICE_NAME="bench",
+               MQTTEER_CPU_PER_CORE="1",
+               MQTTEER_DISKS_PARTITIONS="1",
+               MQTTEER_CGROUPS=",".join(specs))
+    env.pop("MQTTEER_SPOOL", None)
+    print("== %s" % root, flush=True)
+    return subprocess.run([bench], env=env).returncode
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+
+    server = broker.start()
+    port = server.server_address[1]
+    with tempfile.TemporaryDirectory() as tmp:
+        roots = sys.argv[2:]
+        if not roots:
+            for profile in ["laptop", "server"]:
+                root = os.path.join(tmp, profile)
+                fixtures.generate(profile, root)
+                roots.append(root)
+
+        status = 0
+        for root in roots:
+            status |= run(sys.argv[1], os.path.abspath(root), port)
+    sys.exit(status)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,603 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+
+#include "mqtteer.h"
+
+// cgroup v2 collector. The cgroups to report are configured with
+// MQTTEER_CGROUPS, a comma separated list of paths relative to the cgroup
+// root whose last component may be a glob (e.g. "system.slice/*.service").
+// The parent directories are watched with inotify so that matching cgroups
+// are picked up or dropped as they come and go.
+
+#define CGROUP_ROOT "/sys/fs/cgroup/"
+#define CGROUP_BUF_SIZE 4096
+#define CGROUP_WATCH_MASK                                                      \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+enum mqtteer_cgroup_file {
+  CGROUP_CPU_STAT,
+  CGROUP_MEMORY_CURRENT,
+  CGROUP_MEMORY_STAT,
+  CGROUP_IO_STAT,
+  CGROUP_CPU_PRESSURE,
+  CGROUP_MEMORY_PRESSURE,
+  CGROUP_IO_PRESSURE,
+  NCGROUP_FILES,
+};
+
+static const char *CGROUP_FILE_NAMES[NCGROUP_FILES] = {
+    "cpu.stat",     "memory.current",  "memory.stat", "io.stat",
+    "cpu.pressure", "memory.pressure", "io.pressure",
+};
+
+enum mqtteer_cgroup_metric {
+  CGROUP_CPU_USAGE,
+  CGROUP_CPU_USER,
+  CGROUP_CPU_SYSTEM,
+  CGROUP_CPU_THROTTLED,
+  CGROUP_MEMORY,
+  CGROUP_MEMORY_ANON,
+  CGROUP_MEMORY_FILE,
+  CGROUP_IO_READ,
+  CGROUP_IO_WRITE,
+  CGROUP_IO_READ_OPS,
+  CGROUP_IO_WRITE_OPS,
+  CGROUP_PSI_CPU_SOME,
+  CGROUP_PSI_CPU_FULL,
+  CGROUP_PSI_MEMORY_SOME,
+  CGROUP_PSI_MEMORY_FULL,
+  CGROUP_PSI_IO_SOME,
+  CGROUP_PSI_IO_FULL,
+  NCGROUP_METRICS,
+};
+
+static const struct {
+  const char *name;
+  enum mqtteer_cgroup_file file;
+  const char *device_class;
+  const char *unit;
+  double deadband_abs;
+  double deadband_rel;
+} CGROUP_METRICS[NCGROUP_METRICS] = {
+    {"cpu_usage", CGROUP_CPU_STAT, "power_factor", "%", 1, 0},
+    {"cpu_user", CGROUP_CPU_STAT, "power_factor", "%", 1, 0},
+    {"cpu_system", CGROUP_CPU_STAT, "power_factor", "%", 1, 0},
+    {"cpu_throttled", CGROUP_CPU_STAT, "power_factor", "%", 1, 0},
+    {"memory", CGROUP_MEMORY_CURRENT, "data_size", "kB", 0, 0.01},
+    {"memory_anon", CGROUP_MEMORY_STAT, "data_size", "kB", 0, 0.01},
+    {"memory_file", CGROUP_MEMORY_STAT, "data_size", "kB", 0, 0.01},
+    {"io_read", CGROUP_IO_STAT, "data_rate", "B/s", 1024, 0.05},
+    {"io_write", CGROUP_IO_STAT, "data_rate", "B/s", 1024, 0.05},
+    {"io_read_ops", CGROUP_IO_STAT, NULL, "ops/s", 1, 0.05},
+    {"io_write_ops", CGROUP_IO_STAT, NULL, "ops/s", 1, 0.05},
+    {"psi_cpu_some_avg10", CGROUP_CPU_PRESSURE, "power_factor", "%", 0.5, 0},
+    {"psi_cpu_full_avg10", CGROUP_CPU_PRESSURE, "power_factor", "%", 0.5, 0},
+    {"psi_memory_some_avg10", CGROUP_MEMORY_PRESSURE, "power_factor", "%",
+     0.5, 0},
+    {"psi_memory_full_avg10", CGROUP_MEMORY_PRESSURE, "power_factor", "%",
+     0.5, 0},
+    {"psi_io_some_avg10", CGROUP_IO_PRESSURE, "power_factor", "%", 0.5, 0},
+    {"psi_io_full_avg10", CGROUP_IO_PRESSURE, "power_factor", "%", 0.5, 0},
+};
+
+// counters of cpu.stat and io.stat, rates are computed from two samples
+enum mqtteer_cgroup_counter {
+  CGROUP_USAGE_USEC,
+  CGROUP_USER_USEC,
+  CGROUP_SYSTEM_USEC,
+  CGROUP_THROTTLED_USEC,
+  CGROUP_RBYTES,
+  CGROUP_WBYTES,
+  CGROUP_RIOS,
+  CGROUP_WIOS,
+  NCGROUP_COUNTERS,
+};
+
+static const char *CPU_STAT_KEYS[] = {"usage_usec", "user_usec", "system_usec",
+                                      "throttled_usec"};
+
+struct mqtteer_cgroup {
+  // relative to CGROUP_ROOT, also the name of its Home Assistant device
+  char *path;
+  unsigned group;
+  // slots of the metrics whose file exists, the controller may be disabled
+  unsigned slots[NCGROUP_METRICS];
+  bool has_slot[NCGROUP_METRICS];
+  struct mqtteer_file files[NCGROUP_FILES];
+  unsigned long long counters[NCGROUP_COUNTERS];
+  // the counter was read along with the others of its file, a rate needs it
+  // in two samples in a row
+  bool has_counter[NCGROUP_COUNTERS];
+  // when cpu.stat and io.stat were last read, each keeps its own as one may
+  // fail to be read while the other is not
+  struct timespec sampled_at[NCGROUP_FILES];
+  bool sampled[NCGROUP_FILES];
+};
+
+struct mqtteer_cgroup_watch {
+  // directory relative to CGROUP_ROOT and the glob its cgroups must match
+  char *dir;
+  char *pattern;
+  int wd;
+};
+
+static struct mqtteer_cgroup **mqtteer_cgroups;
+static unsigned mqtteer_ncgroups;
+static struct mqtteer_cgroup_watch *mqtteer_cgroup_watches;
+static unsigned mqtteer_ncgroup_watches;
+static int mqtteer_cgroup_inotify = -1;
+
+int mqtteer_cgroup_inotify_fd(void) { return mqtteer_cgroup_inotify; }
+
+static struct mqtteer_cgroup *mqtteer_cgroup_find(const char *path,
+                                                  unsigned *index) {
+  for (unsigned i = 0; i < mqtteer_ncgroups; i++) {
+    if (strcmp(mqtteer_cgroups[i]->path, path) == 0) {
+      if (index != NULL)
+        *index = i;
+      return mqtteer_cgroups[i];
+    }
+  }
+  return NULL;
+}
+
+static void mqtteer_cgroup_add(mqtteer_reports *reports, const char *path) {
+  if (mqtteer_cgroup_find(path, NULL) != NULL)
+    return;
+
+  struct mqtteer_cgroup *cgroup = mmalloc(sizeof(struct mqtteer_cgroup));
+  memset(cgroup, 0, sizeof(struct mqtteer_cgroup));
+  cgroup->path = strdup(path);
+  if (cgroup->path == NULL) {
+    perror("strdup failed");
+    exit(-1);
+  }
+
+  bool opened = false;
+  for (unsigned i = 0; i < NCGROUP_FILES; i++) {
+    char file_path[strlen(CGROUP_ROOT) + strlen(path) +
+                   strlen(CGROUP_FILE_NAMES[i]) + 2];
+    sprintf(file_path, CGROUP_ROOT "%s/%s", path, CGROUP_FILE_NAMES[i]);
+
+    // a missing file is a disabled controller, it will not come back
+    if (mqtteer_file_open(&cgroup->files[i], file_path) < 0)
+      mqtteer_file_close(&cgroup->files[i]);
+    else
+      opened = true;
+  }
+
+  if (!opened) {
+    fprintf(stderr, "no statistics found for cgroup %s\n", path);
+    free(cgroup->path);
+    free(cgroup);
+    return;
+  }
+
+  char name[strlen("cgroup_") + strlen(path) + 1];
+  sprintf(name, "cgroup_%s", path);
+  mqtteer_sanitize_name(name);
+
+  unsigned collector_group = reports->group;
+  cgroup->group = mqtteer_group_add(reports, name);
+  reports->group = cgroup->group;
+
+  for (unsigned i = 0; i < NCGROUP_METRICS; i++) {
+    if (cgroup->files[CGROUP_METRICS[i].file].path == NULL)
+      continue;
+
+    char metric_name[strlen(name) + strlen(CGROUP_METRICS[i].name) + 2];
+    sprintf(metric_name, "%s_%s", name, CGROUP_METRICS[i].name);
+
+    cgroup->slots[i] = mqtteer_report_add(
+        reports, metric_name, MQTTEER_TYPE_DOUBLE,
+        CGROUP_METRICS[i].device_class, CGROUP_METRICS[i].unit);
+    cgroup->has_slot[i] = true;
+    mqtteer_report_set_device(reports, cgroup->slots[i], cgroup->path);
+    mqtteer_report_set_deadband(reports, cgroup->slots[i],
+                                CGROUP_METRICS[i].deadband_abs,
+                                CGROUP_METRICS[i].deadband_rel);
+  }
+  reports->group = collector_group;
+
+  mqtteer_cgroups = rrealloc(mqtteer_cgroups, (mqtteer_ncgroups + 1) *
+                                                  sizeof(*mqtteer_cgroups));
+  mqtteer_cgroups[mqtteer_ncgroups++] = cgroup;
+
+  if (mqtteer_debug)
+    printf("watching cgroup %s\n", path);
+}
+
+static void mqtteer_cgroup_remove(mqtteer_reports *reports, unsigned index) {
+  struct mqtteer_cgroup *cgroup = mqtteer_cgroups[index];
+
+  if (mqtteer_debug)
+    printf("cgroup %s is gone\n", cgroup->path);
+
+  // the group references the path, it goes first
+  mqtteer_group_remove(reports, cgroup->group);
+  for (unsigned i = 0; i < NCGROUP_FILES; i++) {
+    if (cgroup->files[i].path != NULL)
+      mqtteer_file_close(&cgroup->files[i]);
+  }
+  free(cgroup->path);
+  free(cgroup);
+
+  mqtteer_cgroups[index] = mqtteer_cgroups[--mqtteer_ncgroups];
+}
+
+static void mqtteer_cgroup_watch_scan(mqtteer_reports *reports,
+                                      struct mqtteer_cgroup_watch *watch) {
+  char dir_path[strlen(mqtteer_root) + strlen(CGROUP_ROOT) +
+                strlen(watch->dir) + 1];
+  struct dirent *entry;
+
+  sprintf(dir_path, "%s" CGROUP_ROOT "%s", mqtteer_root, watch->dir);
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    fprintf(stderr, "could not open %s: %s\n", dir_path, strerror(errno));
+    return;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_type != DT_DIR || entry->d_name[0] == '.' ||
+        fnmatch(watch->pattern, entry->d_name, 0) != 0)
+      continue;
+
+    char path[strlen(watch->dir) + strlen(entry->d_name) + 1];
+    sprintf(path, "%s%s", watch->dir, entry->d_name);
+    mqtteer_cgroup_add(reports, path);
+  }
+
+  cclosedir(dir);
+}
+
+static void mqtteer_cgroup_watch_add(const char *spec) {
+  // the root cgroup has no statistics files
+  while (*spec == '/')
+    spec++;
+  if (*spec == '\0')
+    return;
+
+  const char *pattern = strrchr(spec, '/');
+  pattern = pattern == NULL ? spec : pattern + 1;
+  if (*pattern == '\0') {
+    fprintf(stderr, "invalid cgroup %s\n", spec);
+    exit(EXIT_FAILURE);
+  }
+
+  // keep the trailing slash so that paths are built by concatenation
+  size_t dir_len = (size_t)(pattern - spec);
+  char *dir = mmalloc(dir_len + 1);
+  memcpy(dir, spec, dir_len);
+  dir[dir_len] = '\0';
+
+  char dir_path[strlen(mqtteer_root) + strlen(CGROUP_ROOT) + dir_len + 1];
+  sprintf(dir_path, "%s" CGROUP_ROOT "%s", mqtteer_root, dir);
+
+  // directories watched twice share their watch descriptor
+  int wd = inotify_add_watch(mqtteer_cgroup_inotify, dir_path,
+                             CGROUP_WATCH_MASK);
+  if (wd < 0) {
+    fprintf(stderr, "could not watch %s: %s\n", dir_path, strerror(errno));
+    free(dir);
+    return;
+  }
+
+  mqtteer_cgroup_watches =
+      rrealloc(mqtteer_cgroup_watches, (mqtteer_ncgroup_watches + 1) *
+                                           sizeof(*mqtteer_cgroup_watches));
+  struct mqtteer_cgroup_watch *watch =
+      &mqtteer_cgroup_watches[mqtteer_ncgroup_watches++];
+  watch->dir = dir;
+  watch->pattern = strdup(pattern);
+  if (watch->pattern == NULL) {
+    perror("strdup failed");
+    exit(-1);
+  }
+  watch->wd = wd;
+}
+
+// every cgroup keeps up to seven files open
+static void mqtteer_raise_nofile_limit(void) {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+      limit.rlim_cur == limit.rlim_max)
+    return;
+
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+    perror("failed to raise the open files limit");
+}
+
+void mqtteer_cgroup_init(mqtteer_reports *reports) {
+  char *cgroups_var = getenv("MQTTEER_CGROUPS");
+  char *saveptr;
+
+  if (cgroups_var == NULL)
+    return;
+
+  mqtteer_raise_nofile_limit();
+
+  mqtteer_cgroup_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (mqtteer_cgroup_inotify < 0) {
+    perror("inotify_init1 failed");
+    exit(EXIT_FAILURE);
+  }
+
+  char cgroups[strlen(cgroups_var) + 1];
+  strcpy(cgroups, cgroups_var);
+
+  for (char *spec = strtok_r(cgroups, ",", &saveptr); spec != NULL;
+       spec = strtok_r(NULL, ",", &saveptr))
+    mqtteer_cgroup_watch_add(spec);
+
+  for (unsigned i = 0; i < mqtteer_ncgroup_watches; i++)
+    mqtteer_cgroup_watch_scan(reports, &mqtteer_cgroup_watches[i]);
+}
+
+static void mqtteer_cgroup_watch_event(mqtteer_reports *reports,
+                                       const struct inotify_event *event) {
+  for (unsigned i = 0; i < mqtteer_ncgroup_watches; i++) {
+    struct mqtteer_cgroup_watch *watch = &mqtteer_cgroup_watches[i];
+    if (watch->wd != event->wd ||
+        fnmatch(watch->pattern, event->name, 0) != 0)
+      continue;
+
+    char path[strlen(watch->dir) + strlen(event->name) + 1];
+    sprintf(path, "%s%s", watch->dir, event->name);
+
+    unsigned index;
+    if (event->mask & (IN_CREATE | IN_MOVED_TO))
+      mqtteer_cgroup_add(reports, path);
+    else if (mqtteer_cgroup_find(path, &index) != NULL)
+      mqtteer_cgroup_remove(reports, index);
+  }
+}
+
+void mqtteer_cgroup_handle_inotify(mqtteer_reports *reports) {
+  char buf[CGROUP_BUF_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(mqtteer_cgroup_inotify, buf, sizeof(buf))) > 0) {
+    for (char *pos = buf; pos < buf + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)pos;
+      pos += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // events were lost, look at the directories again
+        fprintf(stderr, "inotify queue overflow, rescanning cgroups\n");
+        for (unsigned i = 0; i < mqtteer_ncgroup_watches; i++)
+          mqtteer_cgroup_watch_scan(reports, &mqtteer_cgroup_watches[i]);
+      } else if ((event->mask & IN_ISDIR) && event->len > 0) {
+        mqtteer_cgroup_watch_event(reports, event);
+      }
+    }
+  }
+
+  if (len < 0 && errno != EAGAIN) {
+    perror("failed to read inotify events");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// io.stat has a line of "key=value" pairs per device, they are summed up
+static void mqtteer_cgroup_io_stat_sum(const char *buf, size_t len,
+                                       unsigned long long *counters) {
+  static const char *IO_STAT_KEYS[] = {"rbytes", "wbytes", "rios", "wios"};
+  struct mqtteer_parser parser;
+
+  for (unsigned i = CGROUP_RBYTES; i <= CGROUP_WIOS; i++)
+    counters[i] = 0;
+
+  mqtteer_parser_init(&parser, buf, len);
+  while (!mqtteer_parser_eof(&parser)) {
+    unsigned long long value;
+    const char *key;
+    size_t key_len;
+
+    if (mqtteer_parse_word(&parser, &key, &key_len) < 0) {
+      // the ':' of the device numbers, a newline or a stray '='
+      parser.pos++;
+      continue;
+    }
+    if (mqtteer_parse_char(&parser, '=') < 0 ||
+        mqtteer_parse_ull(&parser, &value) < 0)
+      continue;
+
+    for (unsigned i = 0; i < 4; i++) {
+      if (strlen(IO_STAT_KEYS[i]) == key_len &&
+          memcmp(key, IO_STAT_KEYS[i], key_len) == 0) {
+        counters[CGROUP_RBYTES + i] += value;
+        break;
+      }
+    }
+  }
+}
+
+static void mqtteer_cgroup_set(mqtteer_reports *reports,
+                               struct mqtteer_cgroup *cgroup,
+                               enum mqtteer_cgroup_metric metric,
+                               double value) {
+  if (cgroup->has_slot[metric])
+    mqtteer_report_set_dbl(reports, cgroup->slots[metric], value);
+}
+
+static void mqtteer_cgroup_set_rate(mqtteer_reports *reports,
+                                    struct mqtteer_cgroup *cgroup,
+                                    enum mqtteer_cgroup_metric metric,
+                                    const unsigned long long *counters,
+                                    const bool *parsed,
+                                    enum mqtteer_cgroup_counter counter,
+                                    double scale) {
+  if (!parsed[counter] || !cgroup->has_counter[counter])
+    return;
+  // a counter going backwards means the cgroup was created again
+  if (counters[counter] < cgroup->counters[counter])
+    return;
+
+  mqtteer_cgroup_set(reports, cgroup, metric,
+                     (double)(counters[counter] - cgroup->counters[counter]) *
+                         scale);
+}
+
+// seconds since file was last read, 0 when it never was
+static double mqtteer_cgroup_elapsed(const struct mqtteer_cgroup *cgroup,
+                                     enum mqtteer_cgroup_file file,
+                                     const struct timespec *now) {
+  const struct timespec *then = &cgroup->sampled_at[file];
+
+  if (!cgroup->sampled[file])
+    return 0;
+  return (double)(now->tv_sec - then->tv_sec) +
+         (double)(now->tv_nsec - then->tv_nsec) / 1e9;
+}
+
+// io.stat has a line per device, the buffer grows until a file fits with room
+// to spare rather than being cut, anywhere, by a short read
+static char *mqtteer_cgroup_buf;
+static size_t mqtteer_cgroup_buf_size;
+
+static ssize_t mqtteer_cgroup_read(struct mqtteer_file *file) {
+  ssize_t count;
+
+  if (mqtteer_cgroup_buf == NULL) {
+    mqtteer_cgroup_buf_size = CGROUP_BUF_SIZE;
+    mqtteer_cgroup_buf = mmalloc(mqtteer_cgroup_buf_size);
+  }
+
+  while ((count = mqtteer_file_read(file, mqtteer_cgroup_buf,
+                                    mqtteer_cgroup_buf_size)) ==
+         (ssize_t)mqtteer_cgroup_buf_size - 1) {
+    mqtteer_cgroup_buf_size *= 2;
+    mqtteer_cgroup_buf =
+        rrealloc(mqtteer_cgroup_buf, mqtteer_cgroup_buf_size);
+  }
+
+  return count;
+}
+
+// Returns -1 when the cgroup went away.
+static int mqtteer_cgroup_collect(mqtteer_reports *reports,
+                                  struct mqtteer_cgroup *cgroup) {
+  unsigned long long counters[NCGROUP_COUNTERS] = {0};
+  unsigned long long value;
+  struct timespec now;
+  bool read[NCGROUP_FILES] = {false};
+  bool parsed[NCGROUP_COUNTERS] = {false};
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  for (unsigned i = 0; i < NCGROUP_METRICS; i++) {
+    if (cgroup->has_slot[i])
+      mqtteer_report_unset(reports, cgroup->slots[i]);
+  }
+
+  for (unsigned i = 0; i < NCGROUP_FILES; i++) {
+    struct mqtteer_file *file = &cgroup->files[i];
+    if (file->path == NULL)
+      continue;
+
+    ssize_t count = mqtteer_cgroup_read(file);
+    if (count < 0) {
+      if (errno == ENODEV || errno == ENOENT)
+        return -1;
+      fprintf(stderr, "failed to read %s: %s\n", file->path, strerror(errno));
+      continue;
+    }
+    read[i] = true;
+    const char *buf = mqtteer_cgroup_buf;
+    size_t len = (size_t)count;
+
+    switch (i) {
+    case CGROUP_CPU_STAT:
+      // throttled_usec is only there when the cpu controller is enabled
+      for (unsigned j = CGROUP_USAGE_USEC; j <= CGROUP_THROTTLED_USEC; j++)
+        parsed[j] = mqtteer_parse_keyed_ull(buf, len, CPU_STAT_KEYS[j],
+                                            &counters[j]) == 0;
+      break;
+    case CGROUP_MEMORY_CURRENT: {
+      struct mqtteer_parser parser;
+      mqtteer_parser_init(&parser, buf, len);
+      if (mqtteer_parse_ull(&parser, &value) == 0)
+        mqtteer_cgroup_set(reports, cgroup, CGROUP_MEMORY,
+                           (double)value / 1024);
+      break;
+    }
+    case CGROUP_MEMORY_STAT:
+      if (mqtteer_parse_keyed_ull(buf, len, "anon", &value) == 0)
+        mqtteer_cgroup_set(reports, cgroup, CGROUP_MEMORY_ANON,
+                           (double)value / 1024);
+      if (mqtteer_parse_keyed_ull(buf, len, "file", &value) == 0)
+        mqtteer_cgroup_set(reports, cgroup, CGROUP_MEMORY_FILE,
+                           (double)value / 1024);
+      break;
+    case CGROUP_IO_STAT:
+      mqtteer_cgroup_io_stat_sum(buf, len, counters);
+      for (unsigned j = CGROUP_RBYTES; j <= CGROUP_WIOS; j++)
+        parsed[j] = true;
+      break;
+    default: {
+      struct mqtteer_psi psi = {0};
+      unsigned some = CGROUP_PSI_CPU_SOME + 2 * (i - CGROUP_CPU_PRESSURE);
+      if (mqtteer_psi_parse(buf, len, &psi) < 0)
+        break;
+      mqtteer_cgroup_set(reports, cgroup, some, psi.some.avg10);
+      mqtteer_cgroup_set(reports, cgroup, some + 1, psi.full.avg10);
+    }
+    }
+  }
+
+  // counters are in microseconds, rates in percent of one CPU and per second
+  double elapsed = mqtteer_cgroup_elapsed(cgroup, CGROUP_CPU_STAT, &now);
+  if (read[CGROUP_CPU_STAT] && elapsed > 0) {
+    double scale = 100 / (elapsed * 1e6);
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_CPU_USAGE, counters,
+                            parsed, CGROUP_USAGE_USEC, scale);
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_CPU_USER, counters,
+                            parsed, CGROUP_USER_USEC, scale);
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_CPU_SYSTEM, counters,
+                            parsed, CGROUP_SYSTEM_USEC, scale);
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_CPU_THROTTLED, counters,
+                            parsed, CGROUP_THROTTLED_USEC, scale);
+  }
+  elapsed = mqtteer_cgroup_elapsed(cgroup, CGROUP_IO_STAT, &now);
+  if (read[CGROUP_IO_STAT] && elapsed > 0) {
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_IO_READ, counters,
+                            parsed, CGROUP_RBYTES, 1 / elapsed);
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_IO_WRITE, counters,
+                            parsed, CGROUP_WBYTES, 1 / elapsed);
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_IO_READ_OPS, counters,
+                            parsed, CGROUP_RIOS, 1 / elapsed);
+    mqtteer_cgroup_set_rate(reports, cgroup, CGROUP_IO_WRITE_OPS, counters,
+                            parsed, CGROUP_WIOS, 1 / elapsed);
+  }
+
+  // a file that could not be read keeps its previous sample
+  for (unsigned i = 0; i < NCGROUP_COUNTERS; i++) {
+    if (!read[i < CGROUP_RBYTES ? CGROUP_CPU_STAT : CGROUP_IO_STAT])
+      continue;
+    cgroup->has_counter[i] = parsed[i];
+    cgroup->counters[i] = counters[i];
+  }
+  for (unsigned i = 0; i < NCGROUP_FILES; i++) {
+    if (read[i]) {
+      cgroup->sampled_at[i] = now;
+      cgroup->sampled[i] = true;
+    }
+  }
+
+  return 0;
+}
+
+void mqtteer_cgroup_reports(mqtteer_reports *reports) {
+  // removing a cgroup moves the last one in its place
+  for (unsigned i = mqtteer_ncgroups; i > 0; i--) {
+    if (mqtteer_cgroup_collect(reports, mqtteer_cgroups[i - 1]) < 0)
+      mqtteer_cgroup_remove(reports, i - 1);
+  }
+}
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "mqtteer.h"
+
+// Configuration file given by MQTTEER_CONFIG, one directive per line:
+//   disable <collector>[,<collector>...]
+//   include <glob>[,<glob>...]
+//   exclude <glob>[,<glob>...]
+//   interval <collector> <seconds>
+// Blank lines and lines starting with '#' are ignored. When there are include
+// directives only the metrics matching one of them are reported, excludes
+// apply after them. It is read once at startup: collectors and slots are
+// resolved against it when they are set up, never while collecting.
+
+#define CONFIG_LINE_SIZE 1024
+
+struct mqtteer_config_collector {
+  char *name;
+  // 0 when only disabled
+  unsigned interval;
+  bool disabled;
+  // matched the name of a collector
+  bool used;
+};
+
+static struct mqtteer_config_collector *mqtteer_config_collectors;
+static unsigned mqtteer_config_ncollectors;
+// comma separated lists of globs, NULL when there is none
+static char *mqtteer_config_include;
+static char *mqtteer_config_exclude;
+
+static void mqtteer_config_fail(const char *path, unsigned lineno,
+                                const char *msg) {
+  fprintf(stderr, "%s:%u: %s\n", path, lineno, msg);
+  exit(EXIT_FAILURE);
+}
+
+static struct mqtteer_config_collector *
+mqtteer_config_collector(const char *name) {
+  for (unsigned i = 0; i < mqtteer_config_ncollectors; i++) {
+    if (strcmp(mqtteer_config_collectors[i].name, name) == 0)
+      return &mqtteer_config_collectors[i];
+  }
+
+  size_t new_size = (mqtteer_config_ncollectors + 1) *
+                    sizeof(struct mqtteer_config_collector);
+  mqtteer_config_collectors = rrealloc(mqtteer_config_collectors, new_size);
+  struct mqtteer_config_collector *collector =
+      &mqtteer_config_collectors[mqtteer_config_ncollectors++];
+  collector->name = strdup(name);
+  if (collector->name == NULL) {
+    perror("strdup failed");
+    exit(-1);
+  }
+  collector->interval = 0;
+  collector->disabled = false;
+  collector->used = false;
+  return collector;
+}
+
+// append globs to a comma separated list
+static void mqtteer_config_append(char **list, const char *globs) {
+  size_t len = *list == NULL ? 0 : strlen(*list) + 1;
+
+  *list = rrealloc(*list, len + strlen(globs) + 1);
+  if (len > 0)
+    (*list)[len - 1] = ',';
+  strcpy(*list + len, globs);
+}
+
+static void mqtteer_config_line(const char *path, unsigned lineno,
+                                char *line) {
+  char *saveptr;
+
+  char *directive = strtok_r(line, " \t\n", &saveptr);
+  if (directive == NULL || directive[0] == '#')
+    return;
+
+  char *arg = strtok_r(NULL, " \t\n", &saveptr);
+  if (arg == NULL)
+    mqtteer_config_fail(path, lineno, "missing argument");
+  char *value = strtok_r(NULL, " \t\n", &saveptr);
+  bool interval = strcmp(directive, "interval") == 0;
+  if ((value != NULL) != interval ||
+      (value != NULL && strtok_r(NULL, " \t\n", &saveptr) != NULL))
+    mqtteer_config_fail(path, lineno, "wrong number of arguments");
+
+  if (strcmp(directive, "include") == 0) {
+    mqtteer_config_append(&mqtteer_config_include, arg);
+  } else if (strcmp(directive, "exclude") == 0) {
+    mqtteer_config_append(&mqtteer_config_exclude, arg);
+  } else if (strcmp(directive, "disable") == 0) {
+    char *collector_saveptr;
+    for (char *name = strtok_r(arg, ",", &collector_saveptr); name != NULL;
+         name = strtok_r(NULL, ",", &collector_saveptr))
+      mqtteer_config_collector(name)->disabled = true;
+  } else if (interval) {
+    char *endptr;
+    long seconds = strtol(value, &endptr, 10);
+    if (value == endptr || *endptr != '\0' || seconds <= 0 ||
+        seconds > INT_MAX)
+      mqtteer_config_fail(path, lineno, "invalid interval");
+    mqtteer_config_collector(arg)->interval = (unsigned)seconds;
+  } else {
+    mqtteer_config_fail(path, lineno, "unknown directive");
+  }
+}
+
+void mqtteer_config_load(void) {
+  char *path = getenv("MQTTEER_CONFIG");
+  char line[CONFIG_LINE_SIZE];
+  unsigned lineno = 0;
+
+  if (path == NULL)
+    return;
+
+  FILE *file = fopen(path, "re");
+  if (file == NULL) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    lineno++;
+    if (strchr(line, '\n') == NULL && !feof(file))
+      mqtteer_config_fail(path, lineno, "line too long");
+    mqtteer_config_line(path, lineno, line);
+  }
+
+  if (ferror(file)) {
+    fprintf(stderr, "failed to read %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  fclose(file);
+}
+
+// whether the metric is reported, names are checked once when their slot is
+// registered
+bool mqtteer_config_selected(const char *name) {
+  if (mqtteer_config_include != NULL &&
+      !mqtteer_glob_list_match(mqtteer_config_include, name))
+    return false;
+
+  return mqtteer_config_exclude == NULL ||
+         !mqtteer_glob_list_match(mqtteer_config_exclude, name);
+}
+
+bool mqtteer_config_enabled(const char *collector) {
+  for (unsigned i = 0; i < mqtteer_config_ncollectors; i++) {
+    if (strcmp(mqtteer_config_collectors[i].name, collector) == 0) {
+      mqtteer_config_collectors[i].used = true;
+      return !mqtteer_config_collectors[i].disabled;
+    }
+  }
+
+  return true;
+}
+
+unsigned mqtteer_config_interval(const char *collector, unsigned interval) {
+  for (unsigned i = 0; i < mqtteer_config_ncollectors; i++) {
+    if (strcmp(mqtteer_config_collectors[i].name, collector) == 0 &&
+        mqtteer_config_collectors[i].interval != 0)
+      return mqtteer_config_collectors[i].interval;
+  }
+
+  return interval;
+}
+
+// once every collector was looked up, a name that matched none is a typo
+void mqtteer_config_check(void) {
+  for (unsigned i = 0; i < mqtteer_config_ncollectors; i++) {
+    if (!mqtteer_config_collectors[i].used) {
+      fprintf(stderr, "unknown collector in MQTTEER_CONFIG: %s\n",
+              mqtteer_config_collectors[i].name);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "mqtteer.h"
+
+// CPU utilisation from /proc/stat, computed from the difference between two
+// samples. The aggregate is always reported, every core is reported as well
+// when MQTTEER_CPU_PER_CORE is defined.
+
+#define PROC_STAT "/proc/stat"
+#define CPU_POSSIBLE "/sys/devices/system/cpu/possible"
+// longest possible cpu line, /proc/stat has a lot more after them
+#define PROC_STAT_LINE_SIZE 256
+
+enum mqtteer_cpu_field {
+  CPU_USER,
+  CPU_NICE,
+  CPU_SYSTEM,
+  CPU_IDLE,
+  CPU_IOWAIT,
+  CPU_IRQ,
+  CPU_SOFTIRQ,
+  CPU_STEAL,
+  // guest time is already accounted in user time, it is not read
+  NCPU_FIELDS,
+};
+
+enum mqtteer_cpu_metric {
+  CPU_METRIC_USAGE,
+  CPU_METRIC_USER,
+  CPU_METRIC_SYSTEM,
+  CPU_METRIC_IOWAIT,
+  CPU_METRIC_STEAL,
+  NCPU_METRICS,
+};
+
+static const char *CPU_METRIC_NAMES[NCPU_METRICS] = {
+    "usage", "user", "system", "iowait", "steal",
+};
+
+// Counters are stored as a structure of arrays: the counters of a field are
+// contiguous, row 0 being the aggregate and row n + 1 core n, so that the
+// delta computation is a plain loop over arrays the compiler can vectorize.
+static unsigned mqtteer_cpu_nrows;
+static unsigned long long *mqtteer_cpu_counters, *mqtteer_cpu_prev_counters;
+static unsigned long long *mqtteer_cpu_deltas;
+static unsigned long long *mqtteer_cpu_totals;
+// rows found in the current and previous samples, cores can go offline
+static bool *mqtteer_cpu_seen, *mqtteer_cpu_prev_seen;
+static bool mqtteer_cpu_sampled;
+
+// slots of row r are at r * NCPU_METRICS, only row 0 without per core values
+static unsigned *mqtteer_cpu_slots;
+static unsigned mqtteer_cpu_nslots_rows;
+
+static struct mqtteer_file mqtteer_proc_stat;
+static char *mqtteer_cpu_buf;
+static size_t mqtteer_cpu_buf_size;
+
+// CPUs the kernel may bring online, "0-<last>" on most hosts
+static long mqtteer_cpu_possible(void) {
+  struct mqtteer_file possible;
+  char buf[PROC_STAT_LINE_SIZE];
+  struct mqtteer_parser parser;
+  unsigned long long last;
+  ssize_t count = -1;
+  long ncpus = -1;
+
+  if (mqtteer_file_open(&possible, CPU_POSSIBLE) >= 0)
+    count = mqtteer_file_read(&possible, buf, sizeof(buf));
+  if (count > 0) {
+    // the last number of the last range
+    mqtteer_parser_init(&parser, buf, (size_t)count);
+    while (mqtteer_parse_ull(&parser, &last) == 0) {
+      ncpus = last < INT_MAX ? (long)last + 1 : -1;
+      if (mqtteer_parse_char(&parser, '-') < 0 &&
+          mqtteer_parse_char(&parser, ',') < 0)
+        break;
+    }
+  }
+  mqtteer_file_close(&possible);
+
+  return ncpus;
+}
+
+void mqtteer_cpu_init(mqtteer_reports *reports) {
+  long ncpus = mqtteer_cpu_possible();
+  if (ncpus < 1)
+    ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (ncpus < 1)
+    ncpus = 1;
+
+  mqtteer_cpu_nrows = (unsigned)ncpus + 1;
+  size_t counters_size =
+      NCPU_FIELDS * mqtteer_cpu_nrows * sizeof(unsigned long long);
+  mqtteer_cpu_counters = mmalloc(counters_size);
+  mqtteer_cpu_prev_counters = mmalloc(counters_size);
+  mqtteer_cpu_deltas = mmalloc(counters_size);
+  mqtteer_cpu_totals =
+      mmalloc(mqtteer_cpu_nrows * sizeof(unsigned long long));
+  mqtteer_cpu_seen = mmalloc(mqtteer_cpu_nrows * sizeof(bool));
+  mqtteer_cpu_prev_seen = mmalloc(mqtteer_cpu_nrows * sizeof(bool));
+  memset(mqtteer_cpu_prev_counters, 0, counters_size);
+  memset(mqtteer_cpu_prev_seen, 0, mqtteer_cpu_nrows * sizeof(bool));
+
+  mqtteer_cpu_buf_size = (mqtteer_cpu_nrows + 1) * PROC_STAT_LINE_SIZE;
+  mqtteer_cpu_buf = mmalloc(mqtteer_cpu_buf_size);
+
+  if (mqtteer_file_open(&mqtteer_proc_stat, PROC_STAT) < 0)
+    perror("failed to open " PROC_STAT);
+
+  mqtteer_cpu_nslots_rows =
+      getenv("MQTTEER_CPU_PER_CORE") != NULL ? mqtteer_cpu_nrows : 1;
+  mqtteer_cpu_slots =
+      mmalloc(mqtteer_cpu_nslots_rows * NCPU_METRICS * sizeof(unsigned));
+
+  // "cpu" for the aggregate, "cpu<n>" for the cores
+  char name[strlen("cpu4294967295_iowait") + 1];
+  for (unsigned row = 0; row < mqtteer_cpu_nslots_rows; row++) {
+    for (unsigned metric = 0; metric < NCPU_METRICS; metric++) {
+      if (row == 0)
+        sprintf(name, "cpu_%s", CPU_METRIC_NAMES[metric]);
+      else
+        sprintf(name, "cpu%u_%s", row - 1, CPU_METRIC_NAMES[metric]);
+
+      unsigned slot = mqtteer_report_add(reports, name, MQTTEER_TYPE_DOUBLE,
+                                         "power_factor", "%");
+      mqtteer_report_set_deadband(reports, slot, 1, 0);
+      mqtteer_cpu_slots[row * NCPU_METRICS + metric] = slot;
+    }
+  }
+}
+
+// fill the counters from the cpu lines, which come first in /proc/stat
+static int mqtteer_cpu_parse(const char *buf, size_t len) {
+  const unsigned nrows = mqtteer_cpu_nrows;
+  struct mqtteer_parser parser;
+
+  memset(mqtteer_cpu_seen, 0, nrows * sizeof(bool));
+
+  mqtteer_parser_init(&parser, buf, len);
+  while (mqtteer_parse_literal(&parser, "cpu") == 0) {
+    unsigned long long cpu;
+    unsigned row = 0;
+
+    if (mqtteer_parse_char(&parser, ' ') < 0) {
+      if (mqtteer_parse_ull(&parser, &cpu) < 0)
+        break;
+      // a core that was not there at startup
+      row = cpu < nrows - 1 ? (unsigned)cpu + 1 : 0;
+    }
+
+    if (row != 0 || !mqtteer_cpu_seen[0]) {
+      unsigned long long *counter = &mqtteer_cpu_counters[row];
+      // older kernels have fewer fields
+      for (unsigned field = 0; field < NCPU_FIELDS; field++)
+        if (mqtteer_parse_ull(&parser, &counter[field * nrows]) < 0)
+          counter[field * nrows] = 0;
+      mqtteer_cpu_seen[row] = true;
+    }
+
+    mqtteer_parse_next_line(&parser);
+  }
+
+  if (!mqtteer_cpu_seen[0]) {
+    fprintf(stderr, "failed to parse " PROC_STAT "\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void mqtteer_cpu_compute_deltas(void) {
+  const unsigned n = NCPU_FIELDS * mqtteer_cpu_nrows;
+  const unsigned long long *restrict cur = mqtteer_cpu_counters;
+  const unsigned long long *restrict prev = mqtteer_cpu_prev_counters;
+  unsigned long long *restrict deltas = mqtteer_cpu_deltas;
+  unsigned long long *restrict totals = mqtteer_cpu_totals;
+
+  // counters of a core going offline and back may start over
+  for (unsigned i = 0; i < n; i++)
+    deltas[i] = cur[i] >= prev[i] ? cur[i] - prev[i] : 0;
+
+  memset(totals, 0, mqtteer_cpu_nrows * sizeof(unsigned long long));
+  for (unsigned field = 0; field < NCPU_FIELDS; field++) {
+    const unsigned long long *restrict row_deltas =
+        &deltas[field * mqtteer_cpu_nrows];
+    for (unsigned row = 0; row < mqtteer_cpu_nrows; row++)
+      totals[row] += row_deltas[row];
+  }
+}
+
+static void mqtteer_cpu_set_row(mqtteer_reports *reports, unsigned row) {
+  const unsigned nrows = mqtteer_cpu_nrows;
+  const unsigned long long *deltas = mqtteer_cpu_deltas;
+  const unsigned *slots = &mqtteer_cpu_slots[row * NCPU_METRICS];
+
+  if (!mqtteer_cpu_seen[row] || !mqtteer_cpu_prev_seen[row] ||
+      mqtteer_cpu_totals[row] == 0) {
+    for (unsigned metric = 0; metric < NCPU_METRICS; metric++)
+      mqtteer_report_unset(reports, slots[metric]);
+    return;
+  }
+
+  double scale = 100.0 / (double)mqtteer_cpu_totals[row];
+  unsigned long long idle =
+      deltas[CPU_IDLE * nrows + row] + deltas[CPU_IOWAIT * nrows + row];
+
+  mqtteer_report_set_dbl(
+      reports, slots[CPU_METRIC_USAGE],
+      (double)(mqtteer_cpu_totals[row] - idle) * scale);
+  mqtteer_report_set_dbl(
+      reports, slots[CPU_METRIC_USER],
+      (double)(deltas[CPU_USER * nrows + row] +
+               deltas[CPU_NICE * nrows + row]) *
+          scale);
+  mqtteer_report_set_dbl(
+      reports, slots[CPU_METRIC_SYSTEM],
+      (double)(deltas[CPU_SYSTEM * nrows + row] +
+               deltas[CPU_IRQ * nrows + row] +
+               deltas[CPU_SOFTIRQ * nrows + row]) *
+          scale);
+  mqtteer_report_set_dbl(reports, slots[CPU_METRIC_IOWAIT],
+                         (double)deltas[CPU_IOWAIT * nrows + row] * scale);
+  mqtteer_report_set_dbl(reports, slots[CPU_METRIC_STEAL],
+                         (double)deltas[CPU_STEAL * nrows + row] * scale);
+}
+
+void mqtteer_cpu_reports(mqtteer_reports *reports) {
+  errno = 0;
+  ssize_t count = mqtteer_file_read(&mqtteer_proc_stat, mqtteer_cpu_buf,
+                                    mqtteer_cpu_buf_size);
+  if (count <= 0 || mqtteer_cpu_parse(mqtteer_cpu_buf, (size_t)count) < 0) {
+    if (count < 0)
+      perror("failed to read " PROC_STAT);
+    else
+      fprintf(stderr, "failed to parse " PROC_STAT "\n");
+    for (unsigned i = 0; i < mqtteer_cpu_nslots_rows * NCPU_METRICS; i++)
+      mqtteer_report_unset(reports, mqtteer_cpu_slots[i]);
+    mqtteer_cpu_sampled = false;
+    return;
+  }
+
+  // the first sample has nothing to be compared with
+  if (mqtteer_cpu_sampled) {
+    mqtteer_cpu_compute_deltas();
+    for (unsigned row = 0; row < mqtteer_cpu_nslots_rows; row++)
+      mqtteer_cpu_set_row(reports, row);
+  }
+
+  unsigned long long *counters = mqtteer_cpu_prev_counters;
+  mqtteer_cpu_prev_counters = mqtteer_cpu_counters;
+  mqtteer_cpu_counters = counters;
+  bool *seen = mqtteer_cpu_prev_seen;
+  mqtteer_cpu_prev_seen = mqtteer_cpu_seen;
+  mqtteer_cpu_seen = seen;
+  mqtteer_cpu_sampled = true;
+}
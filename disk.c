@@ -0,0 +1,306 @@
+#include <errno.h>
+#include <string.h>
+
+#include "mqtteer.h"
+
+// Block devices statistics from /proc/diskstats, see
+// Documentation/admin-guide/iostats.rst. Devices are selected with
+// MQTTEER_DISKS and MQTTEER_DISKS_EXCLUDE, comma separated lists of globs,
+// partitions are only reported when MQTTEER_DISKS_PARTITIONS is defined.
+
+#define DISKSTATS "/proc/diskstats"
+#define DISKS_DEFAULT_EXCLUDE "loop*,ram*,zram*"
+#define SYS_BLOCK_DIR "/sys/class/block/"
+#define SECTOR_SIZE 512
+
+// fields of a /proc/diskstats line following the device name
+enum mqtteer_disk_field {
+  DISK_READS,
+  DISK_READS_MERGED,
+  DISK_SECTORS_READ,
+  DISK_READ_MS,
+  DISK_WRITES,
+  DISK_WRITES_MERGED,
+  DISK_SECTORS_WRITTEN,
+  DISK_WRITE_MS,
+  DISK_IOS_IN_PROGRESS,
+  DISK_IO_MS,
+  NDISK_FIELDS,
+};
+
+enum mqtteer_disk_metric {
+  DISK_METRIC_READ,
+  DISK_METRIC_WRITE,
+  DISK_METRIC_READ_OPS,
+  DISK_METRIC_WRITE_OPS,
+  DISK_METRIC_READ_LATENCY,
+  DISK_METRIC_WRITE_LATENCY,
+  DISK_METRIC_UTILISATION,
+  NDISK_METRICS,
+};
+
+static const struct {
+  const char *name;
+  const char *device_class;
+  const char *unit;
+  double deadband_abs;
+  double deadband_rel;
+} DISK_METRICS[NDISK_METRICS] = {
+    {"read", "data_rate", "B/s", 4096, 0.05},
+    {"write", "data_rate", "B/s", 4096, 0.05},
+    {"read_ops", NULL, "ops/s", 1, 0.05},
+    {"write_ops", NULL, "ops/s", 1, 0.05},
+    {"read_latency", "duration", "ms", 0.1, 0.05},
+    {"write_latency", "duration", "ms", 0.1, 0.05},
+    {"utilisation", "power_factor", "%", 1, 0},
+};
+
+struct mqtteer_disk {
+  char *name;
+  // skipped devices are remembered so that they are not checked every cycle
+  bool reported;
+  unsigned group;
+  unsigned slots[NDISK_METRICS];
+  unsigned long long fields[NDISK_FIELDS];
+  bool seen;
+  bool sampled;
+};
+
+static struct mqtteer_disk *mqtteer_disks;
+static unsigned mqtteer_ndisks;
+static char *mqtteer_disks_include;
+static char *mqtteer_disks_exclude;
+static bool mqtteer_disks_partitions;
+static struct mqtteer_file mqtteer_diskstats;
+static char *mqtteer_diskstats_buf;
+static size_t mqtteer_diskstats_buf_size = 4096;
+static struct timespec mqtteer_disks_sampled_at;
+
+void mqtteer_disks_init(mqtteer_reports *reports) {
+  (void)reports;
+
+  mqtteer_disks_include = getenv("MQTTEER_DISKS");
+  mqtteer_disks_exclude = getenv("MQTTEER_DISKS_EXCLUDE");
+  if (mqtteer_disks_exclude == NULL)
+    mqtteer_disks_exclude = DISKS_DEFAULT_EXCLUDE;
+  mqtteer_disks_partitions = getenv("MQTTEER_DISKS_PARTITIONS") != NULL;
+
+  mqtteer_diskstats_buf = mmalloc(mqtteer_diskstats_buf_size);
+  if (mqtteer_file_open(&mqtteer_diskstats, DISKSTATS) < 0)
+    perror("failed to open " DISKSTATS);
+}
+
+static bool mqtteer_disk_is_partition(const char *name) {
+  char path[strlen(mqtteer_root) + strlen(SYS_BLOCK_DIR) + strlen(name) +
+            strlen("/partition") + 1];
+
+  sprintf(path, "%s" SYS_BLOCK_DIR "%s/partition", mqtteer_root, name);
+  return access(path, F_OK) == 0;
+}
+
+static bool mqtteer_disk_selected(const char *name) {
+  if (mqtteer_disks_include != NULL &&
+      !mqtteer_glob_list_match(mqtteer_disks_include, name))
+    return false;
+  if (mqtteer_glob_list_match(mqtteer_disks_exclude, name))
+    return false;
+  return mqtteer_disks_partitions || !mqtteer_disk_is_partition(name);
+}
+
+static struct mqtteer_disk *mqtteer_disk_add(mqtteer_reports *reports,
+                                             const char *name,
+                                             size_t name_len) {
+  mqtteer_disks = rrealloc(mqtteer_disks, (mqtteer_ndisks + 1) *
+                                              sizeof(struct mqtteer_disk));
+  struct mqtteer_disk *disk = &mqtteer_disks[mqtteer_ndisks++];
+
+  memset(disk, 0, sizeof(struct mqtteer_disk));
+  disk->name = strndup(name, name_len);
+  if (disk->name == NULL) {
+    perror("strndup failed");
+    exit(-1);
+  }
+
+  disk->reported = mqtteer_disk_selected(disk->name);
+  if (!disk->reported)
+    return disk;
+
+  char group_name[strlen("disk_") + name_len + 1];
+  sprintf(group_name, "disk_%s", disk->name);
+  mqtteer_sanitize_name(group_name);
+
+  unsigned collector_group = reports->group;
+  disk->group = mqtteer_group_add(reports, group_name);
+  reports->group = disk->group;
+
+  for (unsigned i = 0; i < NDISK_METRICS; i++) {
+    char slot_name[sizeof(group_name) + strlen(DISK_METRICS[i].name) + 1];
+    sprintf(slot_name, "%s_%s", group_name, DISK_METRICS[i].name);
+
+    disk->slots[i] =
+        mqtteer_report_add(reports, slot_name, MQTTEER_TYPE_DOUBLE,
+                           DISK_METRICS[i].device_class, DISK_METRICS[i].unit);
+    mqtteer_report_set_deadband(reports, disk->slots[i],
+                                DISK_METRICS[i].deadband_abs,
+                                DISK_METRICS[i].deadband_rel);
+  }
+  reports->group = collector_group;
+
+  if (mqtteer_debug)
+    printf("reporting block device %s\n", disk->name);
+
+  return disk;
+}
+
+static void mqtteer_disk_remove(mqtteer_reports *reports, unsigned index) {
+  struct mqtteer_disk *disk = &mqtteer_disks[index];
+
+  if (disk->reported) {
+    if (mqtteer_debug)
+      printf("block device %s is gone\n", disk->name);
+    mqtteer_group_remove(reports, disk->group);
+  }
+
+  free(disk->name);
+  mqtteer_disks[index] = mqtteer_disks[--mqtteer_ndisks];
+}
+
+static struct mqtteer_disk *mqtteer_disk_find(const char *name,
+                                              size_t name_len) {
+  for (unsigned i = 0; i < mqtteer_ndisks; i++) {
+    if (strncmp(mqtteer_disks[i].name, name, name_len) == 0 &&
+        mqtteer_disks[i].name[name_len] == '\0')
+      return &mqtteer_disks[i];
+  }
+  return NULL;
+}
+
+static void mqtteer_disk_update(mqtteer_reports *reports,
+                                struct mqtteer_disk *disk,
+                                const unsigned long long *fields,
+                                double elapsed) {
+  unsigned long long delta[NDISK_FIELDS];
+  bool valid = disk->sampled && elapsed > 0;
+
+  // counters only go backwards when the device was replaced
+  for (unsigned i = 0; i < NDISK_FIELDS; i++) {
+    if (i != DISK_IOS_IN_PROGRESS && fields[i] < disk->fields[i])
+      valid = false;
+    delta[i] = fields[i] - disk->fields[i];
+  }
+  memcpy(disk->fields, fields, sizeof(disk->fields));
+  disk->sampled = true;
+
+  if (!valid) {
+    for (unsigned i = 0; i < NDISK_METRICS; i++)
+      mqtteer_report_unset(reports, disk->slots[i]);
+    return;
+  }
+
+  const unsigned *slots = disk->slots;
+  mqtteer_report_set_dbl(
+      reports, slots[DISK_METRIC_READ],
+      (double)(delta[DISK_SECTORS_READ] * SECTOR_SIZE) / elapsed);
+  mqtteer_report_set_dbl(
+      reports, slots[DISK_METRIC_WRITE],
+      (double)(delta[DISK_SECTORS_WRITTEN] * SECTOR_SIZE) / elapsed);
+  mqtteer_report_set_dbl(reports, slots[DISK_METRIC_READ_OPS],
+                         (double)delta[DISK_READS] / elapsed);
+  mqtteer_report_set_dbl(reports, slots[DISK_METRIC_WRITE_OPS],
+                         (double)delta[DISK_WRITES] / elapsed);
+
+  // average time a request spent queued and served during the interval
+  mqtteer_report_set_dbl(
+      reports, slots[DISK_METRIC_READ_LATENCY],
+      delta[DISK_READS] == 0
+          ? 0
+          : (double)delta[DISK_READ_MS] / (double)delta[DISK_READS]);
+  mqtteer_report_set_dbl(
+      reports, slots[DISK_METRIC_WRITE_LATENCY],
+      delta[DISK_WRITES] == 0
+          ? 0
+          : (double)delta[DISK_WRITE_MS] / (double)delta[DISK_WRITES]);
+
+  double utilisation = (double)delta[DISK_IO_MS] / (elapsed * 10);
+  mqtteer_report_set_dbl(reports, slots[DISK_METRIC_UTILISATION],
+                         utilisation > 100 ? 100 : utilisation);
+}
+
+static void mqtteer_disk_line(mqtteer_reports *reports,
+                              struct mqtteer_parser *parser, double elapsed) {
+  unsigned long long fields[NDISK_FIELDS];
+  unsigned long long number;
+  const char *name;
+  size_t name_len;
+
+  // major and minor numbers
+  if (mqtteer_parse_ull(parser, &number) < 0 ||
+      mqtteer_parse_ull(parser, &number) < 0 ||
+      mqtteer_parse_word(parser, &name, &name_len) < 0)
+    return;
+
+  // older kernels have fewer fields
+  for (unsigned i = 0; i < NDISK_FIELDS; i++)
+    if (mqtteer_parse_ull(parser, &fields[i]) < 0)
+      fields[i] = 0;
+
+  struct mqtteer_disk *disk = mqtteer_disk_find(name, name_len);
+  if (disk == NULL)
+    disk = mqtteer_disk_add(reports, name, name_len);
+
+  disk->seen = true;
+  if (disk->reported)
+    mqtteer_disk_update(reports, disk, fields, elapsed);
+}
+
+// read the whole file, the buffer grows with the number of devices
+static ssize_t mqtteer_diskstats_read(void) {
+  ssize_t count;
+
+  while ((count = mqtteer_file_read(&mqtteer_diskstats, mqtteer_diskstats_buf,
+                                    mqtteer_diskstats_buf_size)) >= 0 &&
+         (size_t)count == mqtteer_diskstats_buf_size - 1) {
+    mqtteer_diskstats_buf_size *= 2;
+    mqtteer_diskstats_buf =
+        rrealloc(mqtteer_diskstats_buf, mqtteer_diskstats_buf_size);
+  }
+
+  return count;
+}
+
+void mqtteer_disks_reports(mqtteer_reports *reports) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed =
+      (double)(now.tv_sec - mqtteer_disks_sampled_at.tv_sec) +
+      (double)(now.tv_nsec - mqtteer_disks_sampled_at.tv_nsec) / 1e9;
+  mqtteer_disks_sampled_at = now;
+
+  ssize_t count = mqtteer_diskstats_read();
+  if (count < 0) {
+    perror("failed to read " DISKSTATS);
+    for (unsigned i = 0; i < mqtteer_ndisks; i++) {
+      mqtteer_disks[i].sampled = false;
+      if (!mqtteer_disks[i].reported)
+        continue;
+      for (unsigned j = 0; j < NDISK_METRICS; j++)
+        mqtteer_report_unset(reports, mqtteer_disks[i].slots[j]);
+    }
+    return;
+  }
+
+  for (unsigned i = 0; i < mqtteer_ndisks; i++)
+    mqtteer_disks[i].seen = false;
+
+  struct mqtteer_parser parser;
+  mqtteer_parser_init(&parser, mqtteer_diskstats_buf, (size_t)count);
+  for (; !mqtteer_parser_eof(&parser); mqtteer_parse_next_line(&parser))
+    mqtteer_disk_line(reports, &parser, elapsed);
+
+  // removing a device moves the last one in its place
+  for (unsigned i = mqtteer_ndisks; i > 0; i--) {
+    if (!mqtteer_disks[i - 1].seen)
+      mqtteer_disk_remove(reports, i - 1);
+  }
+}
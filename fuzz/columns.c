@@ -0,0 +1,59 @@
+// libFuzzer target for the parser primitives, the first byte of the input
+// picks the sequence they are called in, see meson_options.txt
+#include <stdint.h>
+
+#include "../mqtteer.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct mqtteer_parser parser;
+  unsigned long long ull;
+  long long ll;
+  double dbl;
+  const char *word;
+  size_t len;
+
+  if (size == 0)
+    return 0;
+
+  unsigned seed = data[0];
+  mqtteer_parser_init(&parser, (const char *)data + 1, size - 1);
+  while (!mqtteer_parser_eof(&parser)) {
+    const char *pos = parser.pos;
+
+    switch (seed++ % 7) {
+    case 0:
+      mqtteer_parse_ull(&parser, &ull);
+      break;
+    case 1:
+      mqtteer_parse_ll(&parser, &ll);
+      break;
+    case 2:
+      mqtteer_parse_dbl(&parser, &dbl);
+      break;
+    case 3:
+      if (mqtteer_parse_word(&parser, &word, &len) == 0 &&
+          (len == 0 || word < (const char *)data + 1 ||
+           word + len > parser.end))
+        __builtin_trap();
+      break;
+    case 4:
+      mqtteer_parse_literal(&parser, "cpu");
+      break;
+    case 5:
+      mqtteer_parse_char(&parser, ':');
+      break;
+    case 6:
+      mqtteer_parse_next_line(&parser);
+      break;
+    }
+
+    // the cursor never moves back nor past the end, next_line always moves
+    // forward so that this ends
+    if (parser.pos < pos || parser.pos > parser.end)
+      __builtin_trap();
+  }
+
+  return 0;
+}
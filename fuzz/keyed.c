@@ -0,0 +1,16 @@
+// libFuzzer target for flat keyed files, see meson_options.txt
+#include <stdint.h>
+
+#include "../mqtteer.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static const char *KEYS[] = {"MemTotal", "MemAvailable", "usage_usec",
+                               "anon", ""};
+  unsigned long long value;
+
+  for (unsigned i = 0; i < sizeof(KEYS) / sizeof(KEYS[0]); i++)
+    mqtteer_parse_keyed_ull((const char *)data, size, KEYS[i], &value);
+  return 0;
+}
@@ -0,0 +1,13 @@
+// libFuzzer target for pressure files, see meson_options.txt
+#include <stdint.h>
+
+#include "../mqtteer.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct mqtteer_psi psi;
+
+  mqtteer_psi_parse((const char *)data, size, &psi);
+  return 0;
+}
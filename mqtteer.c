@@ -1,31 +1,123 @@
 
-#include <cjson/cJSON.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <libproc2/meminfo.h>
-#include <libproc2/misc.h>
-#include <locale.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <math.h>
 #include <mosquitto.h>
+#include <netdb.h>
 #include <sensors/sensors.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "mqtteer.h"
+
 #define MOSQ_KEEPALIVE 90
 #define DISCOVERY_TOPIC_PREFIX "homeassistant"
 #define SENSORS_BUF_SIZE 200
 
 #define RUNNING_ENTITY_NAME "running"
+#define HA_STATUS_TOPIC DISCOVERY_TOPIC_PREFIX "/status"
+#define HA_STATUS_ONLINE "online"
+
+#define REPORT_INTERVAL 60
+// seconds before reconnecting to the broker, doubled after every failed
+// attempt up to the maximum. Every delay is drawn between half and all of it
+// so that a fleet of hosts does not reconnect at once after a broker restart.
+#define RECONNECT_MIN 2
+#define RECONNECT_MAX 300
+// spooled messages replayed per second and the longest delay before starting,
+// so that a fleet of hosts does not replay at once after a broker outage
+#define SPOOL_RATE 10
+#define SPOOL_JITTER_MS 10000
+// seconds between two samples of the metrics selected with MQTTEER_SAMPLE
+#define SAMPLE_INTERVAL 1
+// unchanged values are still published every 15 minutes
+#define MAX_AGE 900
+// seconds a collection read by a worker gets before the values of its
+// collector are reported stale
+#define DEADLINE 5
+// messages handed to mosquitto and not acknowledged yet, state messages wait
+// for room in this window
+#define MAX_INFLIGHT 20
+// most topic aliases used with MQTT v5, whatever the broker allows
+#define MAX_TOPIC_ALIASES 64
 
 static char *mqtteer_device_name;
+static char *mqtteer_state_topic;
+static char *mqtteer_running_discovery_topic;
 static struct mosquitto *mosq;
-static int mqtteer_debug = 0;
+int mqtteer_debug = 0;
+const char *mqtteer_root = "";
+static long mqtteer_max_age = MAX_AGE;
 
-#define NPSI_KINDS 3
-static const char *PRESSURE_KINDS[NPSI_KINDS] = {"cpu", "memory", "io"};
+// entities whose discovery message was sent, sorted by name
+struct mqtteer_announced {
+  char *name;
+  // the message as sent, NULL when sending it or removing the entity failed
+  char *config;
+};
+static struct mqtteer_announced *mqtteer_announced;
+static unsigned mqtteer_nannounced;
+static bool mqtteer_announce_pending = true;
+static unsigned long mqtteer_announced_generation;
+static bool mqtteer_connected = false;
+static unsigned mqtteer_reconnect_delay = RECONNECT_MIN;
+static unsigned mqtteer_spool_rate = SPOOL_RATE;
+static int mqtteer_qos = 0;
+static unsigned mqtteer_max_inflight = MAX_INFLIGHT;
+
+// Message ids in the window and when they were handed to mosquitto, for the
+// publication latency. Unused entries have a zero mid.
+static struct mqtteer_inflight {
+  int mid;
+  struct timespec sent;
+} *mqtteer_inflight;
+// acknowledged before mosquitto_publish returned its id, only acks arriving
+// while it is called can be
+static int mqtteer_early_ack;
+static bool mqtteer_publishing;
+
+// MQTT v5 mode, for constrained links: state topics are replaced by an alias
+// after their first message on a connection, state messages expire once they
+// would have been published again anyway and discovery messages use the
+// abbreviated keys of Home Assistant.
+static bool mqtteer_mqtt5 = false;
+static char *mqtteer_aliases[MAX_TOPIC_ALIASES];
+static unsigned mqtteer_naliases;
+// as allowed by the broker in CONNACK
+static unsigned mqtteer_alias_max;
+
+// counters of mqtteer itself, reported by the self collector
+static struct {
+  unsigned long messages;
+  unsigned long payload_bytes;
+  unsigned long publish_failures;
+  int last_publish_error;
+  unsigned long connects;
+  // messages handed to mosquitto and not acknowledged yet: written to the
+  // socket with QoS 0, PUBACK received with QoS 1
+  unsigned long queued;
+  unsigned long delivered;
+  // state messages replaced by a newer one while waiting for the window
+  unsigned long coalesced;
+  double latency_sum_ms;
+  unsigned long latency_count;
+  double latency_max_ms;
+  // longest collector cycle since the last report
+  double cycle_max_ms;
+} mqtteer_stats;
+
+const char *PRESSURE_KINDS[NPSI_KINDS] = {"cpu", "memory", "io"};
 
 void cleanup(void) {
   if (mosq != NULL)
@@ -34,38 +126,52 @@ void cleanup(void) {
   mosquitto_lib_cleanup();
 }
 
-// mqtteer should fail fast
+static int mqtteer_file_reopen(struct mqtteer_file *file) {
+  // the old descriptor is dead anyway, errors do not matter
+  if (file->fd >= 0)
+    close(file->fd);
 
-static inline void cclose(int fd) {
-  if (close(fd) != 0) {
-    perror("close failed");
-    exit(-1);
-  }
+  file->fd = open(file->path, O_RDONLY | O_CLOEXEC);
+  return file->fd;
 }
 
-static inline void cclosedir(DIR *dir) {
-  if (closedir(dir) != 0) {
-    perror("closedir failed");
-    exit(-1);
-  }
+int mqtteer_file_open(struct mqtteer_file *file, const char *path) {
+  file->path = mmalloc(strlen(mqtteer_root) + strlen(path) + 1);
+  sprintf(file->path, "%s%s", mqtteer_root, path);
+
+  file->fd = -1;
+  return mqtteer_file_reopen(file);
 }
 
-static inline void *mmalloc(size_t len) {
-  void *ptr = malloc(len);
-  if (ptr == NULL) {
-    perror("malloc failed");
-    exit(-1);
-  }
-  return ptr;
+void mqtteer_file_close(struct mqtteer_file *file) {
+  if (file->fd >= 0)
+    cclose(file->fd);
+  free(file->path);
+  file->path = NULL;
+  file->fd = -1;
 }
 
-static inline void *rrealloc(void *ptr, size_t len) {
-  void *out_ptr = realloc(ptr, len);
-  if (out_ptr == NULL) {
-    perror("realloc failed");
-    exit(-1);
+// Read the whole file in buf and NUL terminate it. The file is opened again
+// when its device went away under us (e.g. a driver was reloaded).
+ssize_t mqtteer_file_read(struct mqtteer_file *file, char *buf, size_t len) {
+  ssize_t count = -1;
+
+  errno = 0;
+  if (file->fd >= 0)
+    count = pread(file->fd, buf, len - 1, 0);
+
+  if (file->fd < 0 ||
+      (count < 0 && (errno == ENODEV || errno == ESTALE || errno == EBADF))) {
+    if (mqtteer_file_reopen(file) < 0)
+      return -1;
+    count = pread(file->fd, buf, len - 1, 0);
   }
-  return out_ptr;
+
+  if (count < 0)
+    return -1;
+
+  buf[count] = '\0';
+  return count;
 }
 
 static void mqtteer_ensure_payload_len_conversion(size_t payload_len) {
@@ -76,20 +182,297 @@ static void mqtteer_ensure_payload_len_conversion(size_t payload_len) {
   }
 }
 
-void mqtteer_send(char *topic, char *payload) {
-  size_t payload_len = strlen(payload);
+static bool mqtteer_is_connection_error(int ret) {
+  return ret == MOSQ_ERR_NO_CONN || ret == MOSQ_ERR_CONN_LOST ||
+         ret == MOSQ_ERR_CONN_REFUSED || ret == MOSQ_ERR_ERRNO;
+}
+
+static bool mqtteer_window_full(void) {
+  return mqtteer_stats.queued >= mqtteer_max_inflight;
+}
+
+static void mqtteer_inflight_add(int mid) {
+  for (unsigned i = 0; i < mqtteer_max_inflight; i++) {
+    if (mqtteer_inflight[i].mid == 0) {
+      mqtteer_inflight[i].mid = mid;
+      clock_gettime(CLOCK_MONOTONIC, &mqtteer_inflight[i].sent);
+      return;
+    }
+  }
+  // discovery messages do not wait for the window, their latency is not
+  // tracked when it is full
+}
+
+static void mqtteer_inflight_ack(int mid) {
+  struct timespec now;
+
+  for (unsigned i = 0; i < mqtteer_max_inflight; i++) {
+    if (mqtteer_inflight[i].mid != mid)
+      continue;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double latency_ms =
+        (double)(now.tv_sec - mqtteer_inflight[i].sent.tv_sec) * 1e3 +
+        (double)(now.tv_nsec - mqtteer_inflight[i].sent.tv_nsec) / 1e6;
+    mqtteer_stats.latency_sum_ms += latency_ms;
+    mqtteer_stats.latency_count++;
+    if (latency_ms > mqtteer_stats.latency_max_ms)
+      mqtteer_stats.latency_max_ms = latency_ms;
+    mqtteer_inflight[i].mid = 0;
+    return;
+  }
+  // otherwise a message that was not tracked, e.g. sent while the table was
+  // full or before it was reset
+  if (mqtteer_publishing)
+    mqtteer_early_ack = mid;
+}
+
+// everything in the window was lost along with the connection
+static void mqtteer_inflight_reset(void) {
+  mqtteer_stats.queued = 0;
+  for (unsigned i = 0; i < mqtteer_max_inflight; i++)
+    mqtteer_inflight[i].mid = 0;
+}
+
+// aliases only hold for the connection they were sent on
+static void mqtteer_aliases_reset(unsigned alias_max) {
+  for (unsigned i = 0; i < mqtteer_naliases; i++)
+    free(mqtteer_aliases[i]);
+  mqtteer_naliases = 0;
+  mqtteer_alias_max =
+      alias_max < MAX_TOPIC_ALIASES ? alias_max : MAX_TOPIC_ALIASES;
+}
+
+// Alias of a topic, 0 when there is none. *known tells whether the broker
+// already has it, otherwise it is sent along with the topic. Aliases are
+// handed out to the first topics published, state topics live as long as
+// mqtteer anyway.
+static unsigned mqtteer_alias_get(const char *topic, bool *known) {
+  unsigned i;
+
+  for (i = 0; i < mqtteer_naliases; i++) {
+    if (strcmp(mqtteer_aliases[i], topic) == 0) {
+      *known = true;
+      return i + 1;
+    }
+  }
+  if (i == mqtteer_alias_max)
+    return 0;
+
+  mqtteer_aliases[i] = strdup(topic);
+  if (mqtteer_aliases[i] == NULL) {
+    perror("strdup failed");
+    exit(-1);
+  }
+  mqtteer_naliases++;
+  *known = false;
+  return i + 1;
+}
+
+static int mqtteer_publish_v5(int *mid, const char *topic,
+                              const char *payload, size_t payload_len,
+                              bool retain) {
+  mosquitto_property *props = NULL;
+  bool known = false;
+  unsigned alias = 0;
+
+  // retained discovery messages are sent once, and QoS 1 messages may be
+  // sent again by mosquitto on a new connection where the alias is unknown
+  if (!retain) {
+    mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL,
+                                 (uint32_t)mqtteer_max_age);
+    if (mqtteer_qos == 0)
+      alias = mqtteer_alias_get(topic, &known);
+  }
+  if (alias != 0)
+    mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS,
+                                 (uint16_t)alias);
+
+  int ret = mosquitto_publish_v5(mosq, mid, known ? NULL : topic,
+                                 (int)payload_len, payload, mqtteer_qos,
+                                 retain, props);
+  mosquitto_property_free_all(&props);
+
+  // the broker did not get the alias
+  if (ret != MOSQ_ERR_SUCCESS && alias != 0 && !known)
+    free(mqtteer_aliases[--mqtteer_naliases]);
+  return ret;
+}
+
+// Messages can only be lost because the broker is unreachable or because it
+// does not take them (e.g. too large), they are counted as failures.
+int mqtteer_send(const char *topic, const char *payload, size_t payload_len,
+                 bool retain) {
+  int mid, ret;
+
   mqtteer_ensure_payload_len_conversion(payload_len);
 
-  int ret = mosquitto_publish(mosq, NULL, topic, (int) payload_len, payload, 0, false);
+  if (!mqtteer_connected) {
+    mqtteer_stats.publish_failures++;
+    mqtteer_stats.last_publish_error = MOSQ_ERR_NO_CONN;
+    return MOSQ_ERR_NO_CONN;
+  }
+
+  // mosquitto may write the message, and call mqtteer_on_publish, right away
+  mqtteer_stats.queued++;
+  mqtteer_early_ack = 0;
+  mqtteer_publishing = true;
+  if (mqtteer_mqtt5)
+    ret = mqtteer_publish_v5(&mid, topic, payload, payload_len, retain);
+  else
+    ret = mosquitto_publish(mosq, &mid, topic, (int)payload_len, payload,
+                            mqtteer_qos, retain);
+  mqtteer_publishing = false;
   if (ret != MOSQ_ERR_SUCCESS) {
-    fprintf(stderr, "error %d", ret);
-    exit(EXIT_FAILURE);
+    if (mqtteer_is_connection_error(ret))
+      mqtteer_connected = false;
+    else
+      fprintf(stderr, "failed to publish on %s: %s\n", topic,
+              mosquitto_strerror(ret));
+    mqtteer_stats.queued--;
+    mqtteer_stats.publish_failures++;
+    mqtteer_stats.last_publish_error = ret;
+    return ret;
+  }
+
+  // mids wrap around, 0 is never one
+  if (mid == mqtteer_early_ack)
+    mqtteer_early_ack = 0;
+  else
+    mqtteer_inflight_add(mid);
+  mqtteer_stats.messages++;
+  mqtteer_stats.payload_bytes += payload_len;
+  return MOSQ_ERR_SUCCESS;
+}
+
+void mqtteer_buf_append_json_escaped(struct mqtteer_buf *buf,
+                                     const char *str) {
+  static const char hex[] = "0123456789abcdef";
+  const char *start = str;
+
+  for (; *str != '\0'; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+
+    mqtteer_buf_append(buf, start, (size_t)(str - start));
+    start = str + 1;
+
+    switch (c) {
+    case '"':
+      mqtteer_buf_append_lit(buf, "\\\"");
+      break;
+    case '\\':
+      mqtteer_buf_append_lit(buf, "\\\\");
+      break;
+    case '\n':
+      mqtteer_buf_append_lit(buf, "\\n");
+      break;
+    default: {
+      char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+      mqtteer_buf_append(buf, escaped, sizeof(escaped));
+    }
+    }
   }
+
+  mqtteer_buf_append(buf, start, (size_t)(str - start));
+}
+
+void mqtteer_buf_append_json_str(struct mqtteer_buf *buf, const char *str) {
+  mqtteer_buf_append_lit(buf, "\"");
+  mqtteer_buf_append_json_escaped(buf, str);
+  mqtteer_buf_append_lit(buf, "\"");
+}
+
+void mqtteer_buf_append_ulong(struct mqtteer_buf *buf,
+                              unsigned long long value) {
+  char digits[20];
+  char *pos = digits + sizeof(digits);
+
+  do {
+    *--pos = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  mqtteer_buf_append(buf, pos, (size_t)(digits + sizeof(digits) - pos));
+}
+
+void mqtteer_buf_append_long(struct mqtteer_buf *buf, long value) {
+  if (value < 0) {
+    mqtteer_buf_append_lit(buf, "-");
+    mqtteer_buf_append_ulong(buf, -(unsigned long)value);
+  } else {
+    mqtteer_buf_append_ulong(buf, (unsigned long)value);
+  }
+}
+
+// Doubles are written in fixed point with up to JSON_DBL_DECIMALS decimals,
+// which is more than enough for any metric and avoids going through printf.
+// Values that do not fit the fixed point representation fall back to snprintf.
+#define JSON_DBL_DECIMALS 6
+#define JSON_DBL_SCALE 1000000
+#define JSON_DBL_FIXED_MAX 1e12
+void mqtteer_buf_append_dbl(struct mqtteer_buf *buf, double value) {
+  if (!isfinite(value)) {
+    mqtteer_buf_append_lit(buf, "null");
+    return;
+  }
+
+  if (value >= JSON_DBL_FIXED_MAX || value <= -JSON_DBL_FIXED_MAX) {
+    mqtteer_buf_reserve(buf, 32);
+    buf->len += (size_t)snprintf(buf->data + buf->len, 32, "%.17g", value);
+    return;
+  }
+
+  bool negative = value < 0;
+  unsigned long long scaled =
+      (unsigned long long)((negative ? -value : value) * JSON_DBL_SCALE + 0.5);
+  if (scaled == 0) {
+    mqtteer_buf_append_lit(buf, "0");
+    return;
+  }
+
+  if (negative)
+    mqtteer_buf_append_lit(buf, "-");
+  mqtteer_buf_append_ulong(buf, scaled / JSON_DBL_SCALE);
+
+  unsigned long frac = scaled % JSON_DBL_SCALE;
+  if (frac == 0)
+    return;
+
+  char decimals[JSON_DBL_DECIMALS + 1];
+  decimals[0] = '.';
+  for (int i = JSON_DBL_DECIMALS; i > 0; i--) {
+    decimals[i] = (char)('0' + frac % 10);
+    frac /= 10;
+  }
+
+  size_t len = JSON_DBL_DECIMALS + 1;
+  while (decimals[len - 1] == '0')
+    len--;
+  mqtteer_buf_append(buf, decimals, len);
 }
 
-size_t mqtteer_state_topic_len(void) {
-  return strlen(mqtteer_device_name) +
-         strlen(DISCOVERY_TOPIC_PREFIX "/sensor//state") + 1;
+void mqtteer_buf_append_value(struct mqtteer_buf *buf,
+                              enum mqtteer_valtype value_type,
+                              const union mqtteer_value *value) {
+  switch (value_type) {
+  case MQTTEER_TYPE_DOUBLE:
+    mqtteer_buf_append_dbl(buf, value->dblval);
+    break;
+  case MQTTEER_TYPE_LONG:
+    mqtteer_buf_append_long(buf, value->lval);
+    break;
+  case MQTTEER_TYPE_UNSIGNED_LONG:
+    mqtteer_buf_append_ulong(buf, value->ulval);
+    break;
+  case MQTTEER_TYPE_INT:
+    mqtteer_buf_append_long(buf, value->ival);
+    break;
+  case MQTTEER_TYPE_STR:
+    mqtteer_buf_append_json_str(buf, value->strval);
+    break;
+  }
 }
 
 static void mqtteer_remove_illegal_topic_chars(char *topic, size_t len) {
@@ -100,204 +483,414 @@ static void mqtteer_remove_illegal_topic_chars(char *topic, size_t len) {
   }
 }
 
-void mqtteer_get_state_topic_name(char *state_topic, size_t len) {
-  snprintf(state_topic, len, DISCOVERY_TOPIC_PREFIX "/sensor/%s/state",
-           mqtteer_device_name);
-  mqtteer_remove_illegal_topic_chars(state_topic, len);
-}
-
-size_t mqtteer_discovery_topic_len(char *name) {
-  return strlen(name) + strlen(mqtteer_device_name) +
-         strlen(DISCOVERY_TOPIC_PREFIX "/sensor///config") + 1;
-}
+char *mqtteer_discovery_topic_new(const char *name) {
+  size_t len = strlen(name) + strlen(mqtteer_device_name) +
+               strlen(DISCOVERY_TOPIC_PREFIX "/sensor///config") + 1;
+  char *discovery_topic = mmalloc(len);
 
-void mqtteer_get_discovery_topic_name(char *discovery_topic, char *name,
-                                      size_t len) {
   snprintf(discovery_topic, len, DISCOVERY_TOPIC_PREFIX "/sensor/%s/%s/config",
            mqtteer_device_name, name);
   mqtteer_remove_illegal_topic_chars(discovery_topic, len);
+  return discovery_topic;
 }
 
-size_t mqtteer_unique_id_len(char *name, char *device_name) {
-  return strlen(name) + strlen(device_name) + 2;
+// topics do not change while running, compute them once
+void mqtteer_init_topics(void) {
+  size_t len = strlen(mqtteer_device_name) +
+               strlen(DISCOVERY_TOPIC_PREFIX "/sensor//state") + 1;
+  mqtteer_state_topic = mmalloc(len);
+
+  snprintf(mqtteer_state_topic, len, DISCOVERY_TOPIC_PREFIX "/sensor/%s/state",
+           mqtteer_device_name);
+  mqtteer_remove_illegal_topic_chars(mqtteer_state_topic, len);
+
+  mqtteer_running_discovery_topic =
+      mqtteer_discovery_topic_new(RUNNING_ENTITY_NAME);
 }
 
-void mqtteer_get_unique_id(char *unique_id, char *name, char *device_name) {
-  sprintf(unique_id, "%s_%s", device_name, name);
+// whether name matches one of the globs of a comma separated list
+bool mqtteer_glob_list_match(const char *globs, const char *name) {
+  char list[strlen(globs) + 1];
+  char *saveptr;
+
+  strcpy(list, globs);
+  for (char *glob = strtok_r(list, ",", &saveptr); glob != NULL;
+       glob = strtok_r(NULL, ",", &saveptr)) {
+    if (fnmatch(glob, name, 0) == 0)
+      return true;
+  }
+
+  return false;
 }
 
-union mqtteer_value {
-  double dblval;
-  long lval;
-  unsigned long ulval;
-  int ival;
-  char *strval;
-};
+// entity names only allow [a-zA-Z0-9_-]
+void mqtteer_sanitize_name(char *name) {
+  for (; *name != '\0'; name++) {
+    char c = *name;
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '_' || c == '-'))
+      *name = '_';
+  }
+}
 
-enum mqtteer_valtype {
-  MQTTEER_TYPE_DOUBLE = 1,
-  MQTTEER_TYPE_LONG = 2,
-  MQTTEER_TYPE_UNSIGNED_LONG = 3,
-  MQTTEER_TYPE_INT = 4,
-  MQTTEER_TYPE_STR = 5,
-};
+static char *mqtteer_group_topic_new(const char *name) {
+  size_t len = strlen(mqtteer_device_name) + strlen(name) +
+               strlen(DISCOVERY_TOPIC_PREFIX "/sensor///state") + 1;
+  char *state_topic = mmalloc(len);
 
-typedef struct {
-  char *name;
-  const char *device_class;
-  const char *unit_of_measurement;
-  union mqtteer_value *value;
-  enum mqtteer_valtype value_type;
-} mqtteer_report;
+  snprintf(state_topic, len, DISCOVERY_TOPIC_PREFIX "/sensor/%s/%s/state",
+           mqtteer_device_name, name);
+  mqtteer_remove_illegal_topic_chars(state_topic, len);
+  return state_topic;
+}
 
-typedef struct {
-  mqtteer_report *reports;
-  unsigned int nb;
-} mqtteer_reports;
+// The group belongs to the current collector, slots registered afterwards
+// only go in it once it is made the current group.
+unsigned mqtteer_group_add(mqtteer_reports *reports, const char *name) {
+  unsigned group;
 
-void mqtteer_free_report(mqtteer_report report) {
-  free(report.name);
-  if (report.value_type == MQTTEER_TYPE_STR) {
-    free(report.value->strval);
+  for (group = 0; group < reports->ngroups; group++) {
+    if (!reports->groups[group].active)
+      break;
+  }
+
+  if (group == reports->ngroups) {
+    reports->ngroups++;
+    reports->groups = rrealloc(reports->groups,
+                               reports->ngroups * sizeof(struct mqtteer_group));
+  }
+
+  struct mqtteer_group *g = &reports->groups[group];
+  g->name = strdup(name);
+  if (g->name == NULL) {
+    perror("strdup failed");
+    exit(-1);
   }
-  free(report.value);
+  g->state_topic = mqtteer_group_topic_new(name);
+  g->collector = reports->collector;
+  g->slots = NULL;
+  g->nslots = 0;
+  g->cap = 0;
+  g->last_publish = 0;
+  g->pending = false;
+  g->active = true;
+
+  return group;
 }
 
-void mqtteer_free_reports(mqtteer_reports *reports) {
-  for (unsigned int i = 0; i < reports->nb; i++)
-    mqtteer_free_report(reports->reports[i]);
+// remove a group along with all of its slots
+void mqtteer_group_remove(mqtteer_reports *reports, unsigned group) {
+  struct mqtteer_group *g = &reports->groups[group];
+
+  // sampled slots come first and take their aggregates with them
+  while (g->nslots > 0)
+    mqtteer_report_remove(reports, g->slots[0]);
+  // excluded slots are not in the list of the group
+  for (unsigned i = 0; i < reports->nb; i++) {
+    if (reports->reports[i].active && reports->reports[i].excluded &&
+        reports->reports[i].group == group)
+      mqtteer_report_remove(reports, i);
+  }
 
-  free(reports->reports);
-  free(reports);
+  free(g->name);
+  free(g->state_topic);
+  free(g->slots);
+  g->name = NULL;
+  g->state_topic = NULL;
+  g->slots = NULL;
+  g->cap = 0;
+  g->active = false;
 }
 
-void mqtteer_new_report(mqtteer_reports *reports, char *name,
-                        union mqtteer_value *value,
-                        enum mqtteer_valtype value_type, const char *ha_kind,
-                        const char *unit_of_measurement) {
-  reports->nb++;
-  size_t new_size = sizeof(mqtteer_report) * reports->nb;
-  reports->reports = rrealloc(reports->reports, new_size);
-  mqtteer_report *report = &reports->reports[reports->nb - 1];
+unsigned mqtteer_report_add(mqtteer_reports *reports, const char *name,
+                            enum mqtteer_valtype value_type,
+                            const char *ha_kind,
+                            const char *unit_of_measurement) {
+  struct mqtteer_group *group = &reports->groups[reports->group];
+  unsigned slot = reports->nb;
+
+  // reuse a removed slot if there is one
+  if (reports->nfree > 0) {
+    for (slot = 0; slot < reports->nb; slot++) {
+      if (!reports->reports[slot].active)
+        break;
+    }
+    reports->nfree--;
+  }
+
+  if (slot == reports->nb) {
+    if (reports->nb == reports->cap) {
+      reports->cap = reports->cap == 0 ? 32 : reports->cap * 2;
+      reports->reports =
+          rrealloc(reports->reports, reports->cap * sizeof(mqtteer_report));
+    }
+    reports->nb++;
+  }
+
+  mqtteer_report *report = &reports->reports[slot];
+  // left out of its group, it is never serialized or published
+  report->excluded = !mqtteer_config_selected(name);
+  if (!report->excluded) {
+    if (group->nslots == group->cap) {
+      group->cap = group->cap == 0 ? 8 : group->cap * 2;
+      group->slots = rrealloc(group->slots, group->cap * sizeof(unsigned));
+    }
+    group->slots[group->nslots++] = slot;
+  }
 
   report->name = strdup(name);
-  report->value = value;
-  report->value_type = value_type;
+  if (report->name == NULL) {
+    perror("strdup failed");
+    exit(-1);
+  }
+
+  struct mqtteer_buf key = {0};
+  mqtteer_buf_append_lit(&key, ",");
+  mqtteer_buf_append_json_str(&key, name);
+  mqtteer_buf_append_lit(&key, ":");
+  report->key = key.data;
+  report->key_len = key.len;
+  report->discovery_topic = mqtteer_discovery_topic_new(name);
+  report->group = reports->group;
+  report->device = NULL;
+
   report->device_class = ha_kind;
   report->unit_of_measurement = unit_of_measurement;
+  report->value_type = value_type;
+  report->deadband_abs = 0;
+  report->deadband_rel = 0;
+  report->window = NULL;
+  report->active = true;
+  report->has_value = false;
+  report->published = false;
+  reports->generation++;
+
+  if (!report->excluded && value_type != MQTTEER_TYPE_STR &&
+      mqtteer_sample_selected(name))
+    mqtteer_window_attach(reports, slot);
+
+  return slot;
 }
 
-void mqtteer_new_report_dbl(mqtteer_reports *reports, char *name, double value,
-                            const char *ha_kind,
-                            const char *unit_of_measurement) {
-  union mqtteer_value *val = malloc(sizeof(union mqtteer_value));
-  val->dblval = value;
-  mqtteer_new_report(reports, name, val, MQTTEER_TYPE_DOUBLE, ha_kind,
-                     unit_of_measurement);
-}
+void mqtteer_report_remove(mqtteer_reports *reports, unsigned slot) {
+  if (reports->reports[slot].window != NULL)
+    mqtteer_window_detach(reports, slot);
 
-void mqtteer_new_report_int(mqtteer_reports *reports, char *name, int value,
-                            const char *ha_kind,
-                            const char *unit_of_measurement) {
-  union mqtteer_value *val = malloc(sizeof(union mqtteer_value));
-  val->ival = value;
-  mqtteer_new_report(reports, name, val, MQTTEER_TYPE_INT, ha_kind,
-                     unit_of_measurement);
-}
+  mqtteer_report *report = &reports->reports[slot];
+  struct mqtteer_group *group = &reports->groups[report->group];
+
+  for (unsigned i = 0; i < group->nslots; i++) {
+    if (group->slots[i] == slot) {
+      memmove(&group->slots[i], &group->slots[i + 1],
+              (group->nslots - i - 1) * sizeof(unsigned));
+      group->nslots--;
+      break;
+    }
+  }
 
-void mqtteer_new_report_long(mqtteer_reports *reports, char *name, long value,
-                             const char *ha_kind,
-                             const char *unit_of_measurement) {
-  union mqtteer_value *val = malloc(sizeof(union mqtteer_value));
-  val->lval = value;
-  mqtteer_new_report(reports, name, val, MQTTEER_TYPE_LONG, ha_kind,
-                     unit_of_measurement);
+  free(report->name);
+  free(report->key);
+  free(report->discovery_topic);
+  report->name = NULL;
+  report->active = false;
+  report->has_value = false;
+  reports->nfree++;
+  reports->generation++;
 }
 
-void mqtteer_new_report_ulong(mqtteer_reports *reports, char *name,
-                              unsigned long value, const char *ha_kind,
-                              const char *unit_of_measurement) {
-  union mqtteer_value *val = malloc(sizeof(union mqtteer_value));
-  val->ulval = value;
-  mqtteer_new_report(reports, name, val, MQTTEER_TYPE_UNSIGNED_LONG, ha_kind,
-                     unit_of_measurement);
+static bool mqtteer_dbl_out_of_deadband(double value, double published,
+                                        double deadband_abs,
+                                        double deadband_rel) {
+  double diff = value > published ? value - published : published - value;
+  double abs_published = published < 0 ? -published : published;
+
+  return diff > deadband_abs && diff > deadband_rel * abs_published;
 }
 
-void mqtteer_new_report_str(mqtteer_reports *reports, char *name, char *value,
-                            const char *ha_kind,
-                            const char *unit_of_measurement) {
-  union mqtteer_value *val = malloc(sizeof(union mqtteer_value));
-  val->strval = value;
-  mqtteer_new_report(reports, name, val, MQTTEER_TYPE_STR, ha_kind,
-                     unit_of_measurement);
+static bool mqtteer_report_changed(const mqtteer_report *report) {
+  const union mqtteer_value *value = &report->value;
+  const union mqtteer_value *published = &report->published_value;
+
+  switch (report->value_type) {
+  case MQTTEER_TYPE_DOUBLE:
+    return mqtteer_dbl_out_of_deadband(value->dblval, published->dblval,
+                                       report->deadband_abs,
+                                       report->deadband_rel);
+  case MQTTEER_TYPE_LONG:
+    return mqtteer_dbl_out_of_deadband(
+        (double)value->lval, (double)published->lval, report->deadband_abs,
+        report->deadband_rel);
+  case MQTTEER_TYPE_UNSIGNED_LONG:
+    return mqtteer_dbl_out_of_deadband(
+        (double)value->ulval, (double)published->ulval, report->deadband_abs,
+        report->deadband_rel);
+  case MQTTEER_TYPE_INT:
+    return mqtteer_dbl_out_of_deadband(value->ival, published->ival,
+                                       report->deadband_abs,
+                                       report->deadband_rel);
+  case MQTTEER_TYPE_STR:
+    return strcmp(value->strval, published->strval) != 0;
+  }
+
+  return true;
 }
 
-void mqtteer_send_discovery(char *name, const char *device_class,
-                            const char *unit_of_measurement) {
-  size_t topic_len = mqtteer_state_topic_len();
-  char unique_id[mqtteer_unique_id_len(name, mqtteer_device_name)];
-  mqtteer_get_unique_id(unique_id, name, mqtteer_device_name);
-  char state_topic[topic_len];
-  mqtteer_get_state_topic_name(state_topic, topic_len);
+// Take the values of a group that moved out of their deadband (or all of
+// them when refresh is set) as the values to publish. Returns whether any of
+// them changed.
+bool mqtteer_reports_update_published(mqtteer_reports *reports,
+                                      unsigned group, bool refresh) {
+  struct mqtteer_group *g = &reports->groups[group];
+  bool changed = false;
+
+  for (unsigned i = 0; i < g->nslots; i++) {
+    mqtteer_report *report = &reports->reports[g->slots[i]];
+    if (!report->has_value)
+      continue;
 
-  size_t discovery_topic_len = mqtteer_discovery_topic_len(name);
-  char discovery_topic[discovery_topic_len];
-  mqtteer_get_discovery_topic_name(discovery_topic, name, discovery_topic_len);
+    if (refresh || !report->published || mqtteer_report_changed(report)) {
+      report->published_value = report->value;
+      report->published = true;
+      changed = true;
+    }
+  }
 
-  cJSON *discovery_obj = cJSON_CreateObject();
+  return changed;
+}
 
-  cJSON_AddStringToObject(discovery_obj, "name", name);
-  cJSON_AddStringToObject(discovery_obj, "state_topic", state_topic);
-  cJSON_AddStringToObject(discovery_obj, "unique_id", unique_id);
+static struct mqtteer_buf mqtteer_discovery_buf;
 
-#define TEMPLATE_STR_FORMAT "{{ value_json['%s'] }}"
-  char template_str[strlen(name) + strlen(TEMPLATE_STR_FORMAT) - 1];
-  sprintf(template_str, TEMPLATE_STR_FORMAT, name);
-  cJSON_AddStringToObject(discovery_obj, "value_template", template_str);
+// keys of discovery messages, in full and as abbreviated by Home Assistant
+static const struct mqtteer_discovery_keys {
+  const char *state_topic;
+  const char *unique_id;
+  const char *value_template;
+  const char *value_template_end;
+  const char *device_class;
+  const char *unit_of_measurement;
+  const char *device;
+  const char *identifiers;
+} DISCOVERY_KEYS[2] = {
+    {",\"state_topic\":", ",\"unique_id\":\"",
+     "\",\"value_template\":\"{{ value_json['", "'] }}\"",
+     ",\"device_class\":", ",\"unit_of_measurement\":",
+     ",\"device\":{\"name\":\"", "\",\"identifiers\":[\""},
+    {",\"stat_t\":", ",\"uniq_id\":\"", "\",\"val_tpl\":\"{{value_json['",
+     "']}}\"", ",\"dev_cla\":", ",\"unit_of_meas\":", ",\"dev\":{\"name\":\"",
+     "\",\"ids\":[\""},
+};
 
-  if (device_class != NULL)
-    cJSON_AddStringToObject(discovery_obj, "device_class", device_class);
-  if (unit_of_measurement != NULL)
-    cJSON_AddStringToObject(discovery_obj, "unit_of_measurement",
-                            unit_of_measurement);
+static void mqtteer_buf_append_str(struct mqtteer_buf *buf, const char *str) {
+  mqtteer_buf_append(buf, str, strlen(str));
+}
 
-  cJSON *device_obj = cJSON_CreateObject();
-  cJSON_AddStringToObject(device_obj, "name", mqtteer_device_name);
+// the message is left in mqtteer_discovery_buf
+static void mqtteer_discovery_build(const char *state_topic, const char *name,
+                                    const char *device,
+                                    const char *device_class,
+                                    const char *unit_of_measurement) {
+  const struct mqtteer_discovery_keys *keys = &DISCOVERY_KEYS[mqtteer_mqtt5];
+  struct mqtteer_buf *buf = &mqtteer_discovery_buf;
+  buf->len = 0;
+
+  mqtteer_buf_append_lit(buf, "{\"name\":");
+  mqtteer_buf_append_json_str(buf, name);
+  mqtteer_buf_append_str(buf, keys->state_topic);
+  mqtteer_buf_append_json_str(buf, state_topic);
+
+  mqtteer_buf_append_str(buf, keys->unique_id);
+  mqtteer_buf_append_json_escaped(buf, mqtteer_device_name);
+  mqtteer_buf_append_lit(buf, "_");
+  mqtteer_buf_append_json_escaped(buf, name);
+
+  mqtteer_buf_append_str(buf, keys->value_template);
+  mqtteer_buf_append_json_escaped(buf, name);
+  mqtteer_buf_append_str(buf, keys->value_template_end);
+
+  if (device_class != NULL) {
+    mqtteer_buf_append_str(buf, keys->device_class);
+    mqtteer_buf_append_json_str(buf, device_class);
+  }
+  if (unit_of_measurement != NULL) {
+    mqtteer_buf_append_str(buf, keys->unit_of_measurement);
+    mqtteer_buf_append_json_str(buf, unit_of_measurement);
+  }
 
-  cJSON *identifiers_arr = cJSON_CreateArray();
-  cJSON_AddItemToArray(identifiers_arr,
-                       cJSON_CreateString(mqtteer_device_name));
+  mqtteer_buf_append_str(buf, keys->device);
+  mqtteer_buf_append_json_escaped(buf, mqtteer_device_name);
+  if (device != NULL) {
+    mqtteer_buf_append_lit(buf, " ");
+    mqtteer_buf_append_json_escaped(buf, device);
+  }
+  mqtteer_buf_append_str(buf, keys->identifiers);
+  mqtteer_buf_append_json_escaped(buf, mqtteer_device_name);
+  if (device != NULL) {
+    // other devices of this host are linked to it
+    mqtteer_buf_append_lit(buf, "_");
+    mqtteer_buf_append_json_escaped(buf, device);
+    mqtteer_buf_append_lit(buf, "\"],\"via_device\":");
+    mqtteer_buf_append_json_str(buf, mqtteer_device_name);
+    mqtteer_buf_append_lit(buf, "}}");
+  } else {
+    mqtteer_buf_append_lit(buf, "\"]}}");
+  }
+}
 
-  cJSON_AddItemToObject(device_obj, "identifiers", identifiers_arr);
-  cJSON_AddItemToObject(discovery_obj, "device", device_obj);
+// sends the message in mqtteer_discovery_buf
+static int mqtteer_discovery_send(const char *discovery_topic) {
+  struct mqtteer_buf *buf = &mqtteer_discovery_buf;
 
-  char *discovery_payload = cJSON_Print(discovery_obj);
   if (mqtteer_debug)
-    fprintf(stderr, "%s\n", discovery_payload);
-  mqtteer_send(discovery_topic, discovery_payload);
+    fprintf(stderr, "%.*s\n", (int)buf->len, buf->data);
+  return mqtteer_send(discovery_topic, buf->data, buf->len, true);
+}
+
+int mqtteer_send_discovery(const char *discovery_topic, const char *state_topic,
+                           const char *name, const char *device,
+                           const char *device_class,
+                           const char *unit_of_measurement) {
+  mqtteer_discovery_build(state_topic, name, device, device_class,
+                          unit_of_measurement);
+  return mqtteer_discovery_send(discovery_topic);
+}
+
+// an empty retained config message makes Home Assistant remove the entity
+int mqtteer_send_discovery_removal(const char *name) {
+  char *discovery_topic = mqtteer_discovery_topic_new(name);
 
-  free(discovery_payload);
-  cJSON_Delete(discovery_obj);
+  if (mqtteer_debug)
+    printf("removing %s\n", name);
+  int ret = mqtteer_send(discovery_topic, "", 0, true);
+  free(discovery_topic);
+  return ret;
 }
 
 struct mqtteer_sensor {
   char *name;
-  double value;
+  unsigned slot;
   const char *device_class;
   const char *unit;
+  const sensors_chip_name *chip;
+  int subfeature_nr;
+  // hwmon input file, -1 when libsensors has to compute the value
+  int fd;
+  double scale;
+  // last value read by a worker, or errno
+  double value;
+  int error;
 };
 
+// sensors inventory, discovered once and kept until the next rescan
+static struct mqtteer_sensor *mqtteer_sensors;
+static unsigned mqtteer_nsensors;
+static volatile sig_atomic_t mqtteer_sensors_rescan_pending = 0;
+
 // Device classes
 static const char *TEMPERATURE = "temperature";
 
 // UNITS
 static const char *CELSIUS = "°C";
 
-void mqtteer_sensor_free(struct mqtteer_sensor *sensor) {
-  free(sensor->name);
-  free(sensor);
-}
-
 void mqtteer_sensors_init(void) {
   int ret;
 
@@ -316,18 +909,133 @@ char *mqtteer_sensor_get_name(char *chip_name, char *label) {
   return name;
 }
 
-struct mqtteer_sensor *mqtteer_get_sensor(const struct sensors_chip_name *chip,
-                                          int *nr_feat) {
+#define SENSORS_READ_BUF_SIZE 32
+// hwmon temperatures jitter around their actual value
+#define SENSORS_DEADBAND 0.5
+static int mqtteer_sensor_read_raw(int fd, long *raw) {
+  char buf[SENSORS_READ_BUF_SIZE];
+
+  errno = 0;
+  ssize_t count = pread(fd, buf, SENSORS_READ_BUF_SIZE - 1, 0);
+  if (count <= 0)
+    return -1;
+
+  struct mqtteer_parser parser;
+  long long value;
+
+  mqtteer_parser_init(&parser, buf, (size_t)count);
+  if (mqtteer_parse_ll(&parser, &value) < 0)
+    return -1;
+
+  *raw = (long)value;
+  return 0;
+}
+
+static bool mqtteer_sensor_is_scaled(double value, long raw, double scale) {
+  double scaled = (double)raw / scale;
+  return fabs(value - scaled) <= 1e-9 * fmax(1, fabs(scaled));
+}
+
+// Open the sysfs file backing a subfeature so that it can be read without
+// going through libsensors. This is only done when the value libsensors
+// reports is the plain scaled sysfs value, so that compute statements from
+// sensors.conf keep being honoured. The value may change while it is read,
+// libsensors' is compared with the file read right before and after it, and
+// once more when it matches neither.
+static int mqtteer_sensor_open_input(const sensors_chip_name *chip,
+                                     const sensors_subfeature *sf,
+                                     double scale) {
+  bool scaled = false;
+  double value;
+  long before, after;
+
+  if (chip->path == NULL)
+    return -1;
+
+  char path[strlen(chip->path) + strlen(sf->name) + 2];
+  sprintf(path, "%s/%s", chip->path, sf->name);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (mqtteer_debug)
+      fprintf(stderr, "%s: could not open hwmon input\n", path);
+    return -1;
+  }
+
+  for (unsigned i = 0; i < 2 && !scaled; i++) {
+    if (mqtteer_sensor_read_raw(fd, &before) < 0 ||
+        sensors_get_value(chip, sf->number, &value) != 0 ||
+        mqtteer_sensor_read_raw(fd, &after) < 0)
+      break;
+    scaled = mqtteer_sensor_is_scaled(value, before, scale) ||
+             mqtteer_sensor_is_scaled(value, after, scale);
+  }
+
+  if (!scaled) {
+    if (mqtteer_debug)
+      fprintf(stderr, "%s: reading through libsensors\n", path);
+    cclose(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static struct mqtteer_sensor *
+mqtteer_sensor_new(mqtteer_reports *reports, char *name,
+                   const char *device_class, const char *unit, double scale) {
+  size_t new_size = (mqtteer_nsensors + 1) * sizeof(struct mqtteer_sensor);
+  mqtteer_sensors = rrealloc(mqtteer_sensors, new_size);
+
+  struct mqtteer_sensor *sensor = &mqtteer_sensors[mqtteer_nsensors++];
+  sensor->name = name;
+  sensor->slot = mqtteer_report_add(reports, name, MQTTEER_TYPE_DOUBLE,
+                                    device_class, unit);
+  mqtteer_report_set_deadband(reports, sensor->slot, SENSORS_DEADBAND, 0);
+  sensor->device_class = device_class;
+  sensor->unit = unit;
+  sensor->chip = NULL;
+  sensor->subfeature_nr = -1;
+  sensor->scale = scale;
+  sensor->fd = -1;
+  sensor->error = ENODATA;
+
+  if (mqtteer_debug)
+    fprintf(stderr, "found %s\n", sensor->name);
+  return sensor;
+}
+
+static void mqtteer_sensors_add(mqtteer_reports *reports,
+                                const sensors_chip_name *chip,
+                                const sensors_subfeature *sf, char *name,
+                                const char *device_class, const char *unit,
+                                double scale) {
+  // never read
+  if (!mqtteer_config_selected(name)) {
+    free(name);
+    return;
+  }
+
+  struct mqtteer_sensor *sensor =
+      mqtteer_sensor_new(reports, name, device_class, unit, scale);
+
+  sensor->chip = chip;
+  sensor->subfeature_nr = sf->number;
+  sensor->fd = mqtteer_sensor_open_input(chip, sf, scale);
+}
+
+static void mqtteer_sensors_scan_chip(mqtteer_reports *reports,
+                                      const sensors_chip_name *chip) {
   const sensors_feature *feature;
   const sensors_subfeature *sf;
-  struct mqtteer_sensor *sensor;
   char name_buf[SENSORS_BUF_SIZE];
   char *label;
   char *sensor_name;
+  int nr_feat = 0;
 
   sensors_snprintf_chip_name(name_buf, SENSORS_BUF_SIZE, chip);
 
-  while ((feature = sensors_get_features(chip, nr_feat)) != NULL) {
+  while ((feature = sensors_get_features(chip, &nr_feat)) != NULL) {
 
     label = sensors_get_label(chip, feature);
     sensor_name = mqtteer_sensor_get_name(name_buf, label);
@@ -337,16 +1045,9 @@ struct mqtteer_sensor *mqtteer_get_sensor(const struct sensors_chip_name *chip,
     case SENSORS_FEATURE_TEMP:
       sf = sensors_get_subfeature(chip, feature, SENSORS_SUBFEATURE_TEMP_INPUT);
       if (sf) {
-        sensor = mmalloc(sizeof(struct mqtteer_sensor));
-
-        sensor->name = sensor_name;
-        sensor->device_class = TEMPERATURE;
-        sensor->unit = CELSIUS;
-        sensors_get_value(chip, sf->number, &sensor->value);
-        if (mqtteer_debug)
-          fprintf(stderr, "found %s\n", sensor->name);
-
-        return sensor;
+        mqtteer_sensors_add(reports, chip, sf, sensor_name, TEMPERATURE,
+                            CELSIUS, 1000);
+        continue;
       } else {
         if (mqtteer_debug)
           fprintf(stderr, "%s: could not get subfeature\n", sensor_name);
@@ -360,383 +1061,1413 @@ struct mqtteer_sensor *mqtteer_get_sensor(const struct sensors_chip_name *chip,
 
     free(sensor_name);
   }
-
-  *nr_feat = 0;
-
-  return NULL;
-}
-
-char *mqtteer_getenv(const char *name) {
-  char *value = getenv(name);
-  if (value == NULL) {
-    fprintf(stderr, "%s environment variable is not set", name);
-    exit(EXIT_FAILURE);
-  }
-  return value;
 }
 
-struct mqtteer_battery {
-  char *name;
-  int capacity;
-};
+#define HWMON_DIR "/sys/class/hwmon"
+#define HWMON_NAME_SIZE 64
 
-void mqtteer_free_battery(struct mqtteer_battery *battery) {
-  free(battery->name);
-  free(battery);
-}
+// read a one line sysfs attribute of a hwmon chip, without the newline
+static int mqtteer_hwmon_read_attr(const char *chip_path, const char *attr,
+                                   char *buf, size_t size) {
+  char path[strlen(chip_path) + strlen(attr) + 2];
+  sprintf(path, "%s/%s", chip_path, attr);
 
-typedef struct {
-  struct mqtteer_battery *batteries;
-  unsigned n;
-} mqtteer_batteries;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t count = read(fd, buf, size - 1);
+  cclose(fd);
+  if (count <= 0)
+    return -1;
 
-void mqtteer_free_batteries(mqtteer_batteries *batteries) {
-  if (batteries->batteries != NULL)
-    free(batteries->batteries);
-  free(batteries);
+  buf[count] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
 }
 
-#define POWER_SUPPLY_DIR "/sys/class/power_supply"
-#define BATTERY_CAPACITY_NAME "capacity"
-mqtteer_batteries *mqtteer_get_batteries(void) {
-  struct dirent *power_supply;
-  DIR *power_supplies_dir = opendir(POWER_SUPPLY_DIR);
-  if (power_supplies_dir == NULL)
-    perror("could not open " POWER_SUPPLY_DIR);
-
-  mqtteer_batteries *batteries = mmalloc(sizeof(mqtteer_batteries));
-  batteries->n = 0;
-  batteries->batteries = NULL;
-
-  if (power_supplies_dir == NULL)
-    return batteries;
-
-  int power_supplies_dir_fd = dirfd(power_supplies_dir);
+// temperature inputs of a hwmon chip, named after the chip and their label
+static void mqtteer_sensors_scan_hwmon_chip(mqtteer_reports *reports,
+                                            const char *chip_path,
+                                            const char *hwmon) {
+  char chip_name[HWMON_NAME_SIZE + strlen(hwmon) + 1];
+  char label[HWMON_NAME_SIZE];
+  struct dirent *entry;
+  unsigned index;
+  int end;
+
+  if (mqtteer_hwmon_read_attr(chip_path, "name", label, sizeof(label)) < 0)
+    strcpy(label, "hwmon");
+  sprintf(chip_name, "%s-%s", label, hwmon);
+
+  DIR *dir = opendir(chip_path);
+  if (dir == NULL)
+    return;
 
-  while ((power_supply = readdir(power_supplies_dir)) != NULL) {
-    if (power_supply->d_name[0] == '.')
+  while ((entry = readdir(dir)) != NULL) {
+    end = 0;
+    if (sscanf(entry->d_name, "temp%u_input%n", &index, &end) != 1 ||
+        entry->d_name[end] != '\0')
       continue;
 
-    int power_supply_fd =
-        openat(power_supplies_dir_fd, power_supply->d_name, O_RDONLY);
+    char attr[strlen("temp4294967295_label") + 1];
+    sprintf(attr, "temp%u_label", index);
+    if (mqtteer_hwmon_read_attr(chip_path, attr, label, sizeof(label)) < 0)
+      sprintf(label, "temp%u", index);
 
-    if (power_supply_fd < 0) {
-      fprintf(stderr, "could not open power supply subdirectory %s",
-              power_supply->d_name);
+    char *name = mqtteer_sensor_get_name(chip_name, label);
+    if (!mqtteer_config_selected(name)) {
+      free(name);
       continue;
     }
 
-    int power_supply_capacity_fd =
-        openat(power_supply_fd, BATTERY_CAPACITY_NAME, O_RDONLY);
+    char path[strlen(chip_path) + strlen(entry->d_name) + 2];
+    sprintf(path, "%s/%s", chip_path, entry->d_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      free(name);
+      continue;
+    }
 
-    if (power_supply_capacity_fd < 0) {
-      if (errno == ENOENT) {
-        if (mqtteer_debug)
-          printf("skipping power supply %s: not a battery\n",
-                 power_supply->d_name);
-      } else {
-        perror("could not read battery capacity");
-      }
+    struct mqtteer_sensor *sensor =
+        mqtteer_sensor_new(reports, name, TEMPERATURE, CELSIUS, 1000);
+    sensor->fd = fd;
+  }
 
-      goto ps_close;
-    }
+  cclosedir(dir);
+}
 
-    char buf[4];
-    ssize_t readout = read(power_supply_capacity_fd, buf, 4);
-    buf[readout] = '\0';
-    if (readout < 0) {
-      perror("failed to read battery");
-      goto ps_close_capacity;
-    }
+// libsensors only knows about the live /sys, under another root the hwmon
+// chips are listed directly and sensors.conf does not apply
+static void mqtteer_sensors_scan_hwmon(mqtteer_reports *reports) {
+  char dir_path[strlen(mqtteer_root) + strlen(HWMON_DIR) + 1];
+  struct dirent *entry;
 
-    char *endptr;
-    int capacity = (int)strtol(buf, &endptr, 10);
-    if (buf == endptr) {
-      fprintf(stderr, "failed to parse battery capacity %s\n",
-              power_supply->d_name);
-      goto ps_close_capacity;
-    }
+  sprintf(dir_path, "%s" HWMON_DIR, mqtteer_root);
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    perror("could not open " HWMON_DIR);
+    return;
+  }
 
-    size_t new_size = (batteries->n + 1) * sizeof(struct mqtteer_battery);
-    batteries->batteries = rrealloc(batteries->batteries, new_size);
-    // probably should use model_name & serial_number
-    batteries->batteries[batteries->n].name = strdup(power_supply->d_name);
-    batteries->batteries[batteries->n].capacity = capacity;
-    batteries->n++;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
 
-  ps_close_capacity:
-    cclose(power_supply_capacity_fd);
-  ps_close:
-    cclose(power_supply_fd);
+    char chip_path[strlen(dir_path) + strlen(entry->d_name) + 2];
+    sprintf(chip_path, "%s/%s", dir_path, entry->d_name);
+    mqtteer_sensors_scan_hwmon_chip(reports, chip_path, entry->d_name);
   }
 
-  cclosedir(power_supplies_dir);
-  return batteries;
+  cclosedir(dir);
 }
 
-struct mqtteer_psi_metrics {
-  double avg10;
-  double avg60;
-  double avg300;
-  long total;
-};
+void mqtteer_sensors_scan(mqtteer_reports *reports) {
+  int nr_chip = 0;
+  const struct sensors_chip_name *chip = NULL;
 
-struct mqtteer_psi {
-  struct mqtteer_psi_metrics some;
-  struct mqtteer_psi_metrics full;
-};
+  if (mqtteer_root[0] != '\0') {
+    mqtteer_sensors_scan_hwmon(reports);
+    return;
+  }
 
-int parsedblto(char **buf, double *metrics) {
-  char *endptr = *buf;
-  *metrics = strtod((*buf), &endptr);
-  if (*buf == endptr) {
-    fprintf(stderr, "failed to parse pressure %s\n", *buf);
-    return -1;
+  mqtteer_sensors_init();
+
+  while ((chip = sensors_get_detected_chips(NULL, &nr_chip)) != NULL)
+    mqtteer_sensors_scan_chip(reports, chip);
+}
+
+void mqtteer_sensors_free(mqtteer_reports *reports) {
+  for (unsigned i = 0; i < mqtteer_nsensors; i++) {
+    mqtteer_report_remove(reports, mqtteer_sensors[i].slot);
+    if (mqtteer_sensors[i].fd >= 0)
+      cclose(mqtteer_sensors[i].fd);
+    free(mqtteer_sensors[i].name);
   }
 
-  *buf = endptr + 1;
-  return 0;
+  free(mqtteer_sensors);
+  mqtteer_sensors = NULL;
+  mqtteer_nsensors = 0;
+  if (mqtteer_root[0] == '\0')
+    sensors_cleanup();
 }
 
-int mqtteer_psi_set(char **buf, struct mqtteer_psi_metrics *psi_metrics) {
-  while (**buf != '=')
-    *buf += 1;
-  *buf += 1;
-  if (parsedblto(buf, &psi_metrics->avg10) < 0)
-    goto failed;
+// drop the inventory and discover chips again, libsensors needs to be
+// reinitialized to see new hwmon devices
+void mqtteer_sensors_rescan(mqtteer_reports *reports) {
+  if (mqtteer_debug)
+    fprintf(stderr, "rescanning sensors\n");
 
-  while (**buf != '=')
-    *buf += 1;
-  *buf += 1;
-  if (parsedblto(buf, &psi_metrics->avg60))
-    goto failed;
+  mqtteer_sensors_free(reports);
+  mqtteer_sensors_scan(reports);
+  mqtteer_sensors_rescan_pending = 0;
+}
 
-  while (**buf != '=')
-    *buf += 1;
-  *buf += 1;
-  if (parsedblto(buf, &psi_metrics->avg300) < 0)
-    goto failed;
 
-  while (**buf != '=')
-    *buf += 1;
-  *buf += 1;
-  char *endptr = *buf;
-  psi_metrics->total = strtol(*buf, &endptr, 10);
-  if (endptr == *buf)
-    goto failed;
+// errno is set when reading the hwmon file failed
+int mqtteer_sensor_get_value(struct mqtteer_sensor *sensor, double *value) {
+  long raw;
+
+  if (sensor->fd < 0) {
+    errno = 0;
+    return sensors_get_value(sensor->chip, sensor->subfeature_nr, value);
+  }
 
-  *buf = endptr + 1;
+  if (mqtteer_sensor_read_raw(sensor->fd, &raw) < 0)
+    return -1;
 
+  *value = (double)raw / sensor->scale;
   return 0;
+}
 
-failed:
-  fprintf(stderr, "failed to parse pressure stall file %d %s\n", **buf, *buf);
-  return -1;
+char *mqtteer_getenv(const char *name) {
+  char *value = getenv(name);
+  if (value == NULL) {
+    fprintf(stderr, "%s environment variable is not set", name);
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
+struct mqtteer_battery {
+  char *name;
+  unsigned slot;
+  bool present;
+  struct mqtteer_file capacity;
+  // last capacity read by a worker, or errno
+  unsigned long long value;
+  int error;
+};
+
+// batteries found by the last scan of POWER_SUPPLY_DIR, they keep their slot
+// and capacity file until they disappear
+static struct mqtteer_battery *mqtteer_batteries;
+static unsigned mqtteer_nbatteries;
+static volatile sig_atomic_t mqtteer_batteries_rescan_pending = 1;
+static time_t mqtteer_batteries_last_scan;
+
+#define POWER_SUPPLY_DIR "/sys/class/power_supply"
+#define BATTERY_CAPACITY_NAME "capacity"
+// power supplies can be hotplugged, look for new ones every 10 minutes
+#define POWER_SUPPLY_RESCAN_INTERVAL 600
+
+static bool mqtteer_battery_known(const char *name) {
+  for (unsigned i = 0; i < mqtteer_nbatteries; i++) {
+    if (strcmp(mqtteer_batteries[i].name, name) == 0) {
+      mqtteer_batteries[i].present = true;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void mqtteer_battery_add(mqtteer_reports *reports, const char *name) {
+  char path[strlen(POWER_SUPPLY_DIR) + strlen(name) +
+            strlen(BATTERY_CAPACITY_NAME) + 3];
+  sprintf(path, POWER_SUPPLY_DIR "/%s/" BATTERY_CAPACITY_NAME, name);
+
+  // never read, looked at again with every scan
+  if (!mqtteer_config_selected(name))
+    return;
+
+  struct mqtteer_file capacity;
+  if (mqtteer_file_open(&capacity, path) < 0) {
+    if (errno == ENOENT) {
+      if (mqtteer_debug)
+        printf("skipping power supply %s: not a battery\n", name);
+    } else {
+      perror("could not read battery capacity");
+    }
+
+    mqtteer_file_close(&capacity);
+    return;
+  }
+
+  size_t new_size = (mqtteer_nbatteries + 1) * sizeof(struct mqtteer_battery);
+  mqtteer_batteries = rrealloc(mqtteer_batteries, new_size);
+  struct mqtteer_battery *battery = &mqtteer_batteries[mqtteer_nbatteries++];
+  // probably should use model_name & serial_number
+  battery->name = strdup(name);
+  battery->slot =
+      mqtteer_report_add(reports, name, MQTTEER_TYPE_INT, "battery", "%");
+  battery->present = true;
+  battery->capacity = capacity;
+  battery->error = ENODATA;
+}
+
+// forget about batteries that were not seen during the last scan
+static void mqtteer_batteries_prune(mqtteer_reports *reports) {
+  unsigned n = 0;
+
+  for (unsigned i = 0; i < mqtteer_nbatteries; i++) {
+    struct mqtteer_battery *battery = &mqtteer_batteries[i];
+    if (!battery->present) {
+      mqtteer_report_remove(reports, battery->slot);
+      mqtteer_file_close(&battery->capacity);
+      free(battery->name);
+      continue;
+    }
+
+    battery->present = false;
+    mqtteer_batteries[n++] = *battery;
+  }
+
+  mqtteer_nbatteries = n;
+}
+
+void mqtteer_batteries_scan(mqtteer_reports *reports) {
+  struct dirent *power_supply;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  mqtteer_batteries_last_scan = now.tv_sec;
+  mqtteer_batteries_rescan_pending = 0;
+
+  char dir_path[strlen(mqtteer_root) + strlen(POWER_SUPPLY_DIR) + 1];
+  sprintf(dir_path, "%s" POWER_SUPPLY_DIR, mqtteer_root);
+
+  DIR *power_supplies_dir = opendir(dir_path);
+  if (power_supplies_dir == NULL) {
+    perror("could not open " POWER_SUPPLY_DIR);
+    mqtteer_batteries_prune(reports);
+    return;
+  }
+
+  while ((power_supply = readdir(power_supplies_dir)) != NULL) {
+    if (power_supply->d_name[0] == '.')
+      continue;
+
+    if (!mqtteer_battery_known(power_supply->d_name))
+      mqtteer_battery_add(reports, power_supply->d_name);
+  }
+
+  cclosedir(power_supplies_dir);
+  mqtteer_batteries_prune(reports);
+}
+
+// run by a worker, battery controllers answer through slow buses
+static void mqtteer_batteries_read(void) {
+  for (unsigned i = 0; i < mqtteer_nbatteries; i++) {
+    struct mqtteer_battery *battery = &mqtteer_batteries[i];
+    struct mqtteer_parser parser;
+    char buf[8];
+
+    ssize_t count = mqtteer_file_read(&battery->capacity, buf, sizeof(buf));
+    if (count <= 0) {
+      battery->error = errno != 0 ? errno : EIO;
+      continue;
+    }
+
+    mqtteer_parser_init(&parser, buf, (size_t)count);
+    if (mqtteer_parse_ull(&parser, &battery->value) < 0 ||
+        battery->value > INT_MAX)
+      battery->error = EINVAL;
+    else
+      battery->error = 0;
+  }
+}
+
+// the batteries are only scanned here, while no worker reads them
+void mqtteer_batteries_reports(mqtteer_reports *reports) {
+  struct timespec now;
+
+  for (unsigned i = 0; i < mqtteer_nbatteries; i++) {
+    struct mqtteer_battery *battery = &mqtteer_batteries[i];
+
+    if (battery->error == 0) {
+      mqtteer_report_set_int(reports, battery->slot, (int)battery->value);
+      continue;
+    }
+
+    if (battery->error == ENOENT || battery->error == ENODEV)
+      mqtteer_batteries_rescan_pending = 1;
+    else if (battery->error == EINVAL)
+      fprintf(stderr, "failed to parse battery capacity %s\n", battery->name);
+    else
+      fprintf(stderr, "failed to read battery %s: %s\n", battery->name,
+              strerror(battery->error));
+    mqtteer_report_unset(reports, battery->slot);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (mqtteer_batteries_rescan_pending ||
+      now.tv_sec - mqtteer_batteries_last_scan >= POWER_SUPPLY_RESCAN_INTERVAL)
+    mqtteer_batteries_scan(reports);
 }
 
 #define PSI_DIR "/proc/pressure/"
-#define PSI_BUF_SIZE 128
-int mqtteer_psi_get(const char kind[], struct mqtteer_psi *psi) {
-  char buf[PSI_BUF_SIZE];
-  char psi_path[strlen(PSI_DIR) + strlen(kind) + 1];
-  sprintf(psi_path, "%s%s", PSI_DIR, kind);
+#define PSI_BUF_SIZE 256
+static struct mqtteer_file mqtteer_psi_files[NPSI_KINDS];
+// the file of a kind is not read when none of its fields are reported
+static bool mqtteer_psi_kinds[NPSI_KINDS];
+
+void mqtteer_psi_open(void) {
+  for (unsigned i = 0; i < NPSI_KINDS; i++) {
+    if (!mqtteer_psi_kinds[i])
+      continue;
+
+    char psi_path[strlen(PSI_DIR) + strlen(PRESSURE_KINDS[i]) + 1];
+    sprintf(psi_path, "%s%s", PSI_DIR, PRESSURE_KINDS[i]);
 
-  int psi_fd = open(psi_path, O_RDONLY);
-  if (psi_fd < 0) {
-    perror("failed to open PSI");
-    return psi_fd;
+    if (mqtteer_file_open(&mqtteer_psi_files[i], psi_path) < 0)
+      perror("failed to open PSI");
   }
+}
 
-  ssize_t count = read(psi_fd, buf, PSI_BUF_SIZE - 1);
-  buf[count] = '\0';
+int mqtteer_psi_get(unsigned kind, struct mqtteer_psi *psi) {
+  char buf[PSI_BUF_SIZE];
+
+  ssize_t count =
+      mqtteer_file_read(&mqtteer_psi_files[kind], buf, PSI_BUF_SIZE);
   if (count <= 0) {
     perror("failed to read PSI");
-    goto err_return;
+    return -1;
+  }
+
+  if (mqtteer_psi_parse(buf, (size_t)count, psi) < 0) {
+    fprintf(stderr, "failed to parse PSI %s\n", PRESSURE_KINDS[kind]);
+    return -1;
   }
 
-  char *bufpos = buf;
+  return 0;
+}
 
-  while (bufpos[0] != '\0') {
-    switch (bufpos[0]) {
-    case 's':
-      // assume some
-      if (mqtteer_psi_set(&bufpos, &psi->some) < 0)
-        goto err_return;
-      break;
-    case 'f':
-      // assume full
-      if (mqtteer_psi_set(&bufpos, &psi->full) < 0)
-        goto err_return;
-      break;
-    default:
-      fprintf(stderr, "unknown pressure type %s\n", bufpos);
-      goto err_return;
+static int mqtteer_report_name_cmp(const void *a, const void *b) {
+  const mqtteer_report *const *report_a = a;
+  const mqtteer_report *const *report_b = b;
+  return strcmp((*report_a)->name, (*report_b)->name);
+}
+
+// Sent when the entity is new, its message changed (e.g. its unit or device)
+// or everything is announced. The entry of the entity is taken over from
+// old, when it was announced, and its message kept unless sending it failed.
+static void mqtteer_announce_report(mqtteer_reports *reports,
+                                    const mqtteer_report *report,
+                                    struct mqtteer_announced *old,
+                                    bool announce_all,
+                                    struct mqtteer_announced *entry) {
+  struct mqtteer_buf *buf = &mqtteer_discovery_buf;
+
+  mqtteer_discovery_build(reports->groups[report->group].state_topic,
+                          report->name, report->device, report->device_class,
+                          report->unit_of_measurement);
+
+  if (old != NULL) {
+    *entry = *old;
+  } else {
+    entry->name = strdup(report->name);
+    if (entry->name == NULL) {
+      perror("strdup failed");
+      exit(-1);
     }
+    entry->config = NULL;
   }
 
-  cclose(psi_fd);
-  return 0;
+  if (!announce_all && entry->config != NULL &&
+      strlen(entry->config) == buf->len &&
+      memcmp(entry->config, buf->data, buf->len) == 0)
+    return;
 
-err_return:
-  cclose(psi_fd);
-  return -1;
+  free(entry->config);
+  entry->config = NULL;
+  if (mqtteer_discovery_send(report->discovery_topic) != MOSQ_ERR_SUCCESS)
+    return;
+  entry->config = mmalloc(buf->len + 1);
+  memcpy(entry->config, buf->data, buf->len);
+  entry->config[buf->len] = '\0';
 }
 
+// Discovery messages are retained, so they only need to be sent again when
+// the set of reports changes or when Home Assistant comes back online. An
+// entity whose removal could not be sent is kept to be removed next time.
 void mqtteer_announce_topics(mqtteer_reports *reports) {
-  if (mqtteer_debug)
-    printf("announcing this device\n");
+  bool announce_all = mqtteer_announce_pending;
+  mqtteer_report *sorted[reports->nb + 1];
+  unsigned nactive = 0, nsorted = 0;
 
-  mqtteer_send_discovery(RUNNING_ENTITY_NAME, NULL, NULL);
+  // everything is announced again once connected
+  if (!mqtteer_connected)
+    return;
+  if (!announce_all && reports->generation == mqtteer_announced_generation)
+    return;
+  mqtteer_announced_generation = reports->generation;
 
-  for (unsigned int i = 0; i < reports->nb; i++) {
-    mqtteer_report report = reports->reports[i];
-    mqtteer_send_discovery(report.name, report.device_class,
-                           report.unit_of_measurement);
+  for (unsigned i = 0; i < reports->nb; i++) {
+    if (reports->reports[i].active && !reports->reports[i].excluded)
+      sorted[nactive++] = &reports->reports[i];
   }
-}
+  qsort(sorted, nactive, sizeof(mqtteer_report *), mqtteer_report_name_cmp);
 
-void mqtteer_send_metrics(mqtteer_reports *reports) {
-  cJSON *state_obj = cJSON_CreateObject();
-  size_t topic_len = mqtteer_state_topic_len();
-  char state_topic[topic_len];
-  mqtteer_get_state_topic_name(state_topic, topic_len);
+  // drop duplicated names, they share a single entity
+  for (unsigned i = 0; i < nactive; i++) {
+    if (nsorted > 0 && strcmp(sorted[nsorted - 1]->name, sorted[i]->name) == 0)
+      continue;
+    sorted[nsorted++] = sorted[i];
+  }
 
-  cJSON_AddBoolToObject(state_obj, RUNNING_ENTITY_NAME, true);
-  for (unsigned int i = 0; i < reports->nb; i++) {
-    mqtteer_report report = reports->reports[i];
-    switch (report.value_type) {
-    case MQTTEER_TYPE_DOUBLE:
-      cJSON_AddNumberToObject(state_obj, report.name, report.value->dblval);
-      break;
-    case MQTTEER_TYPE_LONG:
-      cJSON_AddNumberToObject(state_obj, report.name, report.value->lval);
-      break;
-    case MQTTEER_TYPE_UNSIGNED_LONG:
-      cJSON_AddNumberToObject(state_obj, report.name, report.value->ulval);
-      break;
-    case MQTTEER_TYPE_INT:
-      cJSON_AddNumberToObject(state_obj, report.name, report.value->ival);
-      break;
-    case MQTTEER_TYPE_STR:
-      cJSON_AddStringToObject(state_obj, report.name, report.value->strval);
-      break;
+  if (announce_all) {
+    if (mqtteer_debug)
+      printf("announcing this device\n");
+    mqtteer_send_discovery(mqtteer_running_discovery_topic, mqtteer_state_topic,
+                           RUNNING_ENTITY_NAME, NULL, NULL, NULL);
+  }
+
+  struct mqtteer_announced *announced =
+      mmalloc((nsorted + mqtteer_nannounced + 1) * sizeof(*announced));
+  unsigned nannounced = 0;
+  unsigned i = 0, j = 0;
+  while (i < nsorted || j < mqtteer_nannounced) {
+    int cmp;
+    if (i == nsorted)
+      cmp = 1;
+    else if (j == mqtteer_nannounced)
+      cmp = -1;
+    else
+      cmp = strcmp(sorted[i]->name, mqtteer_announced[j].name);
+
+    if (cmp < 0) {
+      mqtteer_announce_report(reports, sorted[i], NULL, announce_all,
+                              &announced[nannounced++]);
+      i++;
+    } else if (cmp > 0) {
+      struct mqtteer_announced *old = &mqtteer_announced[j++];
+      if (mqtteer_send_discovery_removal(old->name) == MOSQ_ERR_SUCCESS) {
+        free(old->name);
+        free(old->config);
+        continue;
+      }
+      free(old->config);
+      announced[nannounced++] = (struct mqtteer_announced){old->name, NULL};
+    } else {
+      mqtteer_announce_report(reports, sorted[i++], &mqtteer_announced[j++],
+                              announce_all, &announced[nannounced++]);
     }
   }
 
-  char *payload = cJSON_Print(state_obj);
+  mqtteer_announce_pending = false;
+  free(mqtteer_announced);
+  mqtteer_announced = announced;
+  mqtteer_nannounced = nannounced;
+}
+
+static struct mqtteer_buf mqtteer_state_buf;
+
+void mqtteer_send_running(void) {
+  static const char payload[] = "{\"" RUNNING_ENTITY_NAME "\":true}";
+  // like discovery messages it does not wait for the window, a slow broker
+  // would otherwise make the host look dead
+  mqtteer_send(mqtteer_state_topic, payload, strlen(payload), false);
+}
+
+// Publish the values of a group on its own state topic. When the window is
+// full, the group waits for mqtteer_send_pending and goes with the values
+// published last, the ones it had waiting are never sent.
+void mqtteer_send_metrics(mqtteer_reports *reports, unsigned group) {
+  struct mqtteer_group *g = &reports->groups[group];
+  struct mqtteer_buf *buf = &mqtteer_state_buf;
+
+  if (mqtteer_connected && mqtteer_window_full()) {
+    if (g->pending)
+      mqtteer_stats.coalesced++;
+    g->pending = true;
+    return;
+  }
+  g->pending = false;
+
+  buf->len = 0;
+
+  mqtteer_buf_append_lit(buf, "{");
+  for (unsigned int i = 0; i < g->nslots; i++) {
+    mqtteer_report *report = &reports->reports[g->slots[i]];
+    if (!report->has_value || !report->published)
+      continue;
+
+    // skip the comma in front of the first key
+    if (buf->len == 1)
+      mqtteer_buf_append(buf, report->key + 1, report->key_len - 1);
+    else
+      mqtteer_buf_append(buf, report->key, report->key_len);
+    mqtteer_buf_append_value(buf, report->value_type,
+                             &report->published_value);
+  }
+  // nothing to report
+  if (buf->len == 1)
+    return;
+  mqtteer_buf_append_lit(buf, "}");
 
   if (mqtteer_debug)
-    printf("%s\n", payload);
+    printf("%.*s\n", (int)buf->len, buf->data);
+
+  // kept for later when the broker is unreachable
+  if (mqtteer_is_connection_error(
+          mqtteer_send(g->state_topic, buf->data, buf->len, false)))
+    mqtteer_spool_push(g->state_topic, buf->data, buf->len);
+}
+
+// groups that waited for the window, as long as there is room
+static void mqtteer_send_pending(mqtteer_reports *reports) {
+  for (unsigned i = 0; i < reports->ngroups; i++) {
+    if (!mqtteer_connected || mqtteer_window_full())
+      return;
+    if (reports->groups[i].active && reports->groups[i].pending)
+      mqtteer_send_metrics(reports, i);
+  }
+}
+
+#define PROC_LOADAVG "/proc/loadavg"
+#define PROC_UPTIME "/proc/uptime"
+#define PROC_MEMINFO "/proc/meminfo"
+#define PROC_SMALL_BUF_SIZE 128
+#define PROC_MEMINFO_BUF_SIZE 8192
+
+static unsigned mqtteer_loadavg_slots[3];
+static struct mqtteer_file mqtteer_loadavg_file;
 
-  mqtteer_send(state_topic, payload);
-  free(payload);
-  cJSON_Delete(state_obj);
+void mqtteer_loadavg_init(mqtteer_reports *reports) {
+  if (mqtteer_file_open(&mqtteer_loadavg_file, PROC_LOADAVG) < 0)
+    perror("failed to open " PROC_LOADAVG);
+
+  mqtteer_loadavg_slots[0] = mqtteer_report_add(
+      reports, "load1", MQTTEER_TYPE_DOUBLE, "power_factor", NULL);
+  mqtteer_loadavg_slots[1] = mqtteer_report_add(
+      reports, "load5", MQTTEER_TYPE_DOUBLE, "power_factor", NULL);
+  mqtteer_loadavg_slots[2] = mqtteer_report_add(
+      reports, "load15", MQTTEER_TYPE_DOUBLE, "power_factor", NULL);
+
+  for (unsigned i = 0; i < 3; i++)
+    mqtteer_report_set_deadband(reports, mqtteer_loadavg_slots[i], 0.05, 0);
 }
 
 void mqtteer_loadavg_reports(mqtteer_reports *reports) {
-  double av1, av5, av15;
-  procps_loadavg(&av1, &av5, &av15);
+  char buf[PROC_SMALL_BUF_SIZE];
+  struct mqtteer_parser parser;
+  double loadavg[3];
+
+  ssize_t count = mqtteer_file_read(&mqtteer_loadavg_file, buf, sizeof(buf));
+  if (count <= 0)
+    goto failed;
 
-  mqtteer_new_report_dbl(reports, "load1", av1, "power_factor", NULL);
-  mqtteer_new_report_dbl(reports, "load5", av5, "power_factor", NULL);
-  mqtteer_new_report_dbl(reports, "load15", av15, "power_factor", NULL);
+  mqtteer_parser_init(&parser, buf, (size_t)count);
+  for (unsigned i = 0; i < 3; i++)
+    if (mqtteer_parse_dbl(&parser, &loadavg[i]) < 0)
+      goto failed;
+
+  for (unsigned i = 0; i < 3; i++)
+    mqtteer_report_set_dbl(reports, mqtteer_loadavg_slots[i], loadavg[i]);
+  return;
+
+failed:
+  fprintf(stderr, "failed to read " PROC_LOADAVG "\n");
+  for (unsigned i = 0; i < 3; i++)
+    mqtteer_report_unset(reports, mqtteer_loadavg_slots[i]);
+}
+
+static unsigned mqtteer_uptime_slot;
+static struct mqtteer_file mqtteer_uptime_file;
+
+void mqtteer_uptime_init(mqtteer_reports *reports) {
+  if (mqtteer_file_open(&mqtteer_uptime_file, PROC_UPTIME) < 0)
+    perror("failed to open " PROC_UPTIME);
+
+  mqtteer_uptime_slot = mqtteer_report_add(
+      reports, "uptime", MQTTEER_TYPE_DOUBLE, "duration", "s");
+  // uptime always changes, the max age refresh is enough
+  mqtteer_report_set_deadband(reports, mqtteer_uptime_slot, 3600, 0);
 }
 
 void mqtteer_uptime_report(mqtteer_reports *reports) {
+  char buf[PROC_SMALL_BUF_SIZE];
+  struct mqtteer_parser parser;
   double uptime;
-  procps_uptime(&uptime, NULL);
 
-  mqtteer_new_report_dbl(reports, "uptime", uptime, "duration", "s");
+  ssize_t count = mqtteer_file_read(&mqtteer_uptime_file, buf, sizeof(buf));
+  if (count <= 0) {
+    perror("failed to read " PROC_UPTIME);
+    mqtteer_report_unset(reports, mqtteer_uptime_slot);
+    return;
+  }
+
+  mqtteer_parser_init(&parser, buf, (size_t)count);
+  if (mqtteer_parse_dbl(&parser, &uptime) < 0) {
+    fprintf(stderr, "failed to parse " PROC_UPTIME "\n");
+    mqtteer_report_unset(reports, mqtteer_uptime_slot);
+    return;
+  }
+
+  mqtteer_report_set_dbl(reports, mqtteer_uptime_slot, uptime);
 }
 
-void mqtteer_meminfo_reports(mqtteer_reports *reports) {
-  struct meminfo_info *meminfo = NULL;
-  unsigned long used, total;
+static struct mqtteer_file mqtteer_meminfo_file;
+static char *mqtteer_meminfo_buf;
+static unsigned mqtteer_used_memory_slot, mqtteer_total_memory_slot;
 
-  if (procps_meminfo_new(&meminfo) < 0) {
-    fprintf(stderr, "failed to get memory info");
-    exit(EXIT_FAILURE);
+void mqtteer_meminfo_init(mqtteer_reports *reports) {
+  mqtteer_meminfo_buf = mmalloc(PROC_MEMINFO_BUF_SIZE);
+  if (mqtteer_file_open(&mqtteer_meminfo_file, PROC_MEMINFO) < 0)
+    perror("failed to open " PROC_MEMINFO);
+
+  mqtteer_used_memory_slot = mqtteer_report_add(
+      reports, "used_memory", MQTTEER_TYPE_UNSIGNED_LONG, "data_size", "kB");
+  mqtteer_total_memory_slot = mqtteer_report_add(
+      reports, "total_memory", MQTTEER_TYPE_UNSIGNED_LONG, "data_size", "kB");
+  mqtteer_report_set_deadband(reports, mqtteer_used_memory_slot, 0, 0.01);
+}
+
+// used memory is what libproc2 reports, total minus available
+void mqtteer_meminfo_reports(mqtteer_reports *reports) {
+  unsigned long long total, available;
+
+  ssize_t count = mqtteer_file_read(&mqtteer_meminfo_file, mqtteer_meminfo_buf,
+                                    PROC_MEMINFO_BUF_SIZE);
+  if (count <= 0 ||
+      mqtteer_parse_keyed_ull(mqtteer_meminfo_buf, (size_t)count, "MemTotal",
+                              &total) < 0 ||
+      mqtteer_parse_keyed_ull(mqtteer_meminfo_buf, (size_t)count,
+                              "MemAvailable", &available) < 0 ||
+      available > total) {
+    fprintf(stderr, "failed to read " PROC_MEMINFO "\n");
+    mqtteer_report_unset(reports, mqtteer_used_memory_slot);
+    mqtteer_report_unset(reports, mqtteer_total_memory_slot);
+    return;
   }
 
-  used = MEMINFO_GET(meminfo, MEMINFO_MEM_USED, ul_int);
-  total = MEMINFO_GET(meminfo, MEMINFO_MEM_TOTAL, ul_int);
-  procps_meminfo_unref(&meminfo);
+  mqtteer_report_set_ulong(reports, mqtteer_used_memory_slot,
+                           total - available);
+  mqtteer_report_set_ulong(reports, mqtteer_total_memory_slot, total);
+}
+
+enum mqtteer_psi_field {
+  PSI_SOME_AVG10,
+  PSI_SOME_AVG60,
+  PSI_SOME_AVG300,
+  PSI_SOME_TOTAL,
+  PSI_FULL_AVG10,
+  PSI_FULL_AVG60,
+  PSI_FULL_AVG300,
+  PSI_FULL_TOTAL,
+  NPSI_FIELDS,
+};
+
+static const char *PSI_FIELD_NAMES[NPSI_FIELDS] = {
+    "some_avg10", "some_avg60", "some_avg300", "some_total",
+    "full_avg10", "full_avg60", "full_avg300", "full_total",
+};
+
+static unsigned mqtteer_psi_slots[NPSI_KINDS][NPSI_FIELDS];
+
+static void mqtteer_psi_slots_init(mqtteer_reports *reports) {
+  char name[strlen("psi_memory_some_avg300") + 1]; // longest name
 
-  mqtteer_new_report_ulong(reports, "used_memory", used, "data_size", "kB");
-  mqtteer_new_report_ulong(reports, "total_memory", total, "data_size", "kB");
+  for (unsigned i = 0; i < NPSI_KINDS; i++) {
+    for (unsigned field = 0; field < NPSI_FIELDS; field++) {
+      sprintf(name, "psi_%s_%s", PRESSURE_KINDS[i], PSI_FIELD_NAMES[field]);
+      if (field == PSI_SOME_TOTAL || field == PSI_FULL_TOTAL) {
+        mqtteer_psi_slots[i][field] = mqtteer_report_add(
+            reports, name, MQTTEER_TYPE_LONG, "power_factor", "μs");
+        mqtteer_report_set_deadband(reports, mqtteer_psi_slots[i][field], 0,
+                                    0.01);
+      } else {
+        mqtteer_psi_slots[i][field] = mqtteer_report_add(
+            reports, name, MQTTEER_TYPE_DOUBLE, "power_factor", "%");
+        mqtteer_report_set_deadband(reports, mqtteer_psi_slots[i][field], 0.5,
+                                    0);
+      }
+      if (!reports->reports[mqtteer_psi_slots[i][field]].excluded)
+        mqtteer_psi_kinds[i] = true;
+    }
+  }
 }
 
-void mqtteer_psi_reports(mqtteer_reports *reports, const char *kind) {
-  struct mqtteer_psi psi;
+void mqtteer_psi_kind_reports(mqtteer_reports *reports, unsigned kind) {
+  // full is not reported for cpu by older kernels
+  struct mqtteer_psi psi = {0};
+  unsigned *slots = mqtteer_psi_slots[kind];
+
   int ret = mqtteer_psi_get(kind, &psi);
-  if (ret < 0)
+  if (ret < 0) {
+    for (unsigned field = 0; field < NPSI_FIELDS; field++)
+      mqtteer_report_unset(reports, slots[field]);
     return;
+  }
 
-  char name[strlen("psi_memory_some_avg300") + 1]; // longest name
+  mqtteer_report_set_dbl(reports, slots[PSI_SOME_AVG10], psi.some.avg10);
+  mqtteer_report_set_dbl(reports, slots[PSI_SOME_AVG60], psi.some.avg60);
+  mqtteer_report_set_dbl(reports, slots[PSI_SOME_AVG300], psi.some.avg300);
+  mqtteer_report_set_long(reports, slots[PSI_SOME_TOTAL], psi.some.total);
+
+  mqtteer_report_set_dbl(reports, slots[PSI_FULL_AVG10], psi.full.avg10);
+  mqtteer_report_set_dbl(reports, slots[PSI_FULL_AVG60], psi.full.avg60);
+  mqtteer_report_set_dbl(reports, slots[PSI_FULL_AVG300], psi.full.avg300);
+  mqtteer_report_set_long(reports, slots[PSI_FULL_TOTAL], psi.full.total);
+}
+
+// PSI triggers make the kernel wake us up as soon as a stall threshold is
+// crossed, see Documentation/accounting/psi.rst
+static const char *PSI_TRIGGER_VARS[NPSI_KINDS] = {
+    "MQTTEER_PSI_TRIGGERS_CPU",
+    "MQTTEER_PSI_TRIGGERS_MEMORY",
+    "MQTTEER_PSI_TRIGGERS_IO",
+};
+
+struct mqtteer_psi_trigger {
+  unsigned kind;
+  int fd;
+};
+
+static struct mqtteer_psi_trigger *mqtteer_psi_triggers;
+static unsigned mqtteer_npsi_triggers;
+static unsigned long mqtteer_psi_stalls[NPSI_KINDS];
+static unsigned mqtteer_psi_stalls_slots[NPSI_KINDS];
+
+static int mqtteer_psi_trigger_add(unsigned kind, const char *trigger) {
+  char psi_path[strlen(mqtteer_root) + strlen(PSI_DIR) +
+                strlen(PRESSURE_KINDS[kind]) + 1];
+  sprintf(psi_path, "%s" PSI_DIR "%s", mqtteer_root, PRESSURE_KINDS[kind]);
+
+  int fd = open(psi_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    perror("failed to open PSI trigger");
+    return -1;
+  }
+
+  // the kernel wants the terminating NUL byte
+  if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+    fprintf(stderr, "failed to set PSI trigger \"%s\" on %s: %s\n", trigger,
+            psi_path, strerror(errno));
+    cclose(fd);
+    return -1;
+  }
+
+  size_t new_size =
+      (mqtteer_npsi_triggers + 1) * sizeof(struct mqtteer_psi_trigger);
+  mqtteer_psi_triggers = rrealloc(mqtteer_psi_triggers, new_size);
+  mqtteer_psi_triggers[mqtteer_npsi_triggers].kind = kind;
+  mqtteer_psi_triggers[mqtteer_npsi_triggers].fd = fd;
+  mqtteer_npsi_triggers++;
+
+  if (mqtteer_debug)
+    printf("PSI trigger \"%s\" set on %s\n", trigger, psi_path);
+
+  return 0;
+}
 
-  sprintf(name, "psi_%s_some_avg10", kind);
-  mqtteer_new_report_dbl(reports, name, psi.some.avg10, "power_factor", "%");
-  sprintf(name, "psi_%s_some_avg60", kind);
-  mqtteer_new_report_dbl(reports, name, psi.some.avg60, "power_factor", "%");
-  sprintf(name, "psi_%s_some_avg300", kind);
-  mqtteer_new_report_dbl(reports, name, psi.some.avg300, "power_factor", "%");
-  sprintf(name, "psi_%s_some_total", kind);
-  mqtteer_new_report_long(reports, name, psi.some.total, "power_factor", "μs");
-
-  sprintf(name, "psi_%s_full_avg10", kind);
-  mqtteer_new_report_dbl(reports, name, psi.full.avg10, "power_factor", "%");
-  sprintf(name, "psi_%s_full_avg60", kind);
-  mqtteer_new_report_dbl(reports, name, psi.full.avg60, "power_factor", "%");
-  sprintf(name, "psi_%s_full_avg300", kind);
-  mqtteer_new_report_dbl(reports, name, psi.full.avg300, "power_factor", "%");
-  sprintf(name, "psi_%s_full_total", kind);
-  mqtteer_new_report_long(reports, name, psi.full.total, "power_factor", "μs");
+// Triggers are configured with a comma separated list of
+// "<some|full> <stall us> <window us>" per pressure kind.
+void mqtteer_psi_triggers_init(mqtteer_reports *reports) {
+  char name[strlen("psi_memory_stalls") + 1]; // longest name
+
+  for (unsigned i = 0; i < NPSI_KINDS; i++) {
+    char *triggers_var = getenv(PSI_TRIGGER_VARS[i]);
+    unsigned ntriggers = 0;
+    char *saveptr;
+
+    if (triggers_var == NULL)
+      continue;
+
+    char triggers[strlen(triggers_var) + 1];
+    strcpy(triggers, triggers_var);
+
+    for (char *trigger = strtok_r(triggers, ",", &saveptr); trigger != NULL;
+         trigger = strtok_r(NULL, ",", &saveptr)) {
+      if (mqtteer_psi_trigger_add(i, trigger) == 0)
+        ntriggers++;
+    }
+
+    if (ntriggers == 0)
+      continue;
+
+    sprintf(name, "psi_%s_stalls", PRESSURE_KINDS[i]);
+    mqtteer_psi_stalls_slots[i] = mqtteer_report_add(
+        reports, name, MQTTEER_TYPE_UNSIGNED_LONG, NULL, NULL);
+    mqtteer_report_set_ulong(reports, mqtteer_psi_stalls_slots[i], 0);
+  }
+}
+
+// a trigger fired, count the stall and refresh the pressure values
+void mqtteer_psi_triggered(mqtteer_reports *reports, unsigned kind) {
+  if (mqtteer_debug)
+    printf("%s pressure threshold crossed\n", PRESSURE_KINDS[kind]);
+
+  mqtteer_psi_stalls[kind]++;
+  mqtteer_report_set_ulong(reports, mqtteer_psi_stalls_slots[kind],
+                           mqtteer_psi_stalls[kind]);
+  if (mqtteer_psi_kinds[kind])
+    mqtteer_psi_kind_reports(reports, kind);
+}
+
+static void mqtteer_request_rescan(int sig) {
+  (void)sig;
+  mqtteer_sensors_rescan_pending = 1;
+  mqtteer_batteries_rescan_pending = 1;
+}
+
+// run by a worker, a flaky I2C bus can take seconds to answer
+static void mqtteer_sensors_read(void) {
+  for (unsigned i = 0; i < mqtteer_nsensors; i++) {
+    struct mqtteer_sensor *sensor = &mqtteer_sensors[i];
+    if (mqtteer_sensor_get_value(sensor, &sensor->value) == 0)
+      sensor->error = 0;
+    else
+      sensor->error = errno != 0 ? errno : EIO;
+  }
 }
 
+// The inventory only changes here, once the values read are reported, so
+// that it is never freed under a worker.
 void mqtteer_sensors_reports(mqtteer_reports *reports) {
-  int nr_chip = 0, nr_feat = 0;
-  const struct sensors_chip_name *chip = NULL;
-  struct mqtteer_sensor *sensor;
+  for (unsigned i = 0; i < mqtteer_nsensors; i++) {
+    struct mqtteer_sensor *sensor = &mqtteer_sensors[i];
+    if (sensor->error == 0) {
+      mqtteer_report_set_dbl(reports, sensor->slot, sensor->value);
+      continue;
+    }
 
-  mqtteer_sensors_init();
+    mqtteer_report_unset(reports, sensor->slot);
+    if (sensor->error == ENODEV || sensor->error == ENOENT ||
+        sensor->error == ESTALE) {
+      // the chip went away, take a new inventory
+      fprintf(stderr, "%s: hwmon device disappeared\n", sensor->name);
+      mqtteer_sensors_rescan_pending = 1;
+    }
+  }
+
+  if (mqtteer_sensors_rescan_pending)
+    mqtteer_sensors_rescan(reports);
+}
 
-  while ((chip = sensors_get_detected_chips(NULL, &nr_chip)) != NULL) {
-    while ((sensor = mqtteer_get_sensor(chip, &nr_feat)) != NULL) {
-      mqtteer_new_report_dbl(reports, sensor->name, sensor->value,
-                             sensor->device_class, sensor->unit);
-      mqtteer_sensor_free(sensor);
+void mqtteer_psi_init(mqtteer_reports *reports) {
+  mqtteer_psi_slots_init(reports);
+  mqtteer_psi_open();
+  mqtteer_psi_triggers_init(reports);
+}
+
+void mqtteer_psi_reports(mqtteer_reports *reports) {
+  for (unsigned i = 0; i < NPSI_KINDS; i++) {
+    if (mqtteer_psi_kinds[i])
+      mqtteer_psi_kind_reports(reports, i);
+  }
+}
+
+struct mqtteer_collector {
+  const char *name;
+  // environment variable overriding the interval
+  const char *interval_var;
+  // registers the slots of the collector
+  void (*init)(mqtteer_reports *reports);
+  void (*collect)(mqtteer_reports *reports);
+  unsigned interval;
+  // group of the slots registered by init and collect
+  unsigned group;
+  int timer_fd;
+  // collectors with sampled slots run every sample interval and publish
+  // every ticks runs
+  unsigned ticks;
+  unsigned tick;
+  // time the last collection took
+  double duration_ms;
+  // reads the values without touching the registry, in a worker, collect
+  // then only reports them
+  void (*read)(void);
+  const char *deadline_var;
+  unsigned deadline;
+  // a worker has the collection since dispatched
+  bool busy;
+  struct timespec dispatched;
+  // the deadline passed, the values reported are the last known ones
+  bool stale;
+  unsigned stale_slot;
+  // by MQTTEER_CONFIG, it is never set up nor run
+  bool disabled;
+};
+
+enum mqtteer_collector_id {
+  COLLECTOR_LOADAVG,
+  COLLECTOR_CPU,
+  COLLECTOR_UPTIME,
+  COLLECTOR_MEMINFO,
+  COLLECTOR_NET,
+  COLLECTOR_DISKS,
+  COLLECTOR_SENSORS,
+  COLLECTOR_BATTERIES,
+  COLLECTOR_PSI,
+  COLLECTOR_CGROUPS,
+  COLLECTOR_TOP,
+  COLLECTOR_PUSH,
+  COLLECTOR_SELF,
+  NCOLLECTORS,
+};
+
+static void mqtteer_self_init(mqtteer_reports *reports);
+static void mqtteer_self_reports(mqtteer_reports *reports);
+
+static struct mqtteer_collector mqtteer_collectors[NCOLLECTORS] = {
+    [COLLECTOR_LOADAVG] = {"load", "MQTTEER_LOAD_INTERVAL",
+                           mqtteer_loadavg_init, mqtteer_loadavg_reports,
+                           REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_CPU] = {"cpu", "MQTTEER_CPU_INTERVAL", mqtteer_cpu_init,
+                       mqtteer_cpu_reports, REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_UPTIME] = {"uptime", "MQTTEER_UPTIME_INTERVAL",
+                          mqtteer_uptime_init, mqtteer_uptime_report,
+                          REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_MEMINFO] = {"memory", "MQTTEER_MEMORY_INTERVAL",
+                           mqtteer_meminfo_init, mqtteer_meminfo_reports,
+                           REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_NET] = {"net", "MQTTEER_NET_INTERVAL", mqtteer_net_init,
+                       mqtteer_net_reports, REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_DISKS] = {"disks", "MQTTEER_DISKS_INTERVAL",
+                         mqtteer_disks_init, mqtteer_disks_reports,
+                         REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_SENSORS] = {"sensors", "MQTTEER_SENSORS_INTERVAL",
+                           mqtteer_sensors_scan, mqtteer_sensors_reports,
+                           REPORT_INTERVAL, 0, -1,
+                           .read = mqtteer_sensors_read,
+                           .deadline_var = "MQTTEER_SENSORS_DEADLINE",
+                           .deadline = DEADLINE},
+    [COLLECTOR_BATTERIES] = {"batteries", "MQTTEER_BATTERIES_INTERVAL",
+                             mqtteer_batteries_scan, mqtteer_batteries_reports,
+                             REPORT_INTERVAL, 0, -1,
+                             .read = mqtteer_batteries_read,
+                             .deadline_var = "MQTTEER_BATTERIES_DEADLINE",
+                             .deadline = DEADLINE},
+    [COLLECTOR_PSI] = {"psi", "MQTTEER_PSI_INTERVAL", mqtteer_psi_init,
+                       mqtteer_psi_reports, REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_CGROUPS] = {"cgroups", "MQTTEER_CGROUPS_INTERVAL",
+                           mqtteer_cgroup_init, mqtteer_cgroup_reports,
+                           REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_TOP] = {"top", "MQTTEER_TOP_INTERVAL", mqtteer_top_init,
+                       mqtteer_top_reports, REPORT_INTERVAL, 0, -1,
+                       .read = mqtteer_top_read,
+                       .deadline_var = "MQTTEER_TOP_DEADLINE",
+                       .deadline = DEADLINE},
+    [COLLECTOR_PUSH] = {"push", "MQTTEER_PUSH_INTERVAL", mqtteer_push_init,
+                        mqtteer_push_reports, REPORT_INTERVAL, 0, -1},
+    [COLLECTOR_SELF] = {"self", "MQTTEER_SELF_INTERVAL", mqtteer_self_init,
+                        mqtteer_self_reports, REPORT_INTERVAL, 0, -1},
+};
+
+// slots registered from now on belong to the group of this collector
+static void mqtteer_set_collector(mqtteer_reports *reports, unsigned id) {
+  reports->collector = id;
+  reports->group = mqtteer_collectors[id].group;
+}
+
+enum mqtteer_sample_op {
+  SAMPLE_CHECK,
+  SAMPLE_ADD,
+  SAMPLE_CLOSE,
+};
+
+static double mqtteer_report_dbl(const mqtteer_report *report) {
+  switch (report->value_type) {
+  case MQTTEER_TYPE_DOUBLE:
+    return report->value.dblval;
+  case MQTTEER_TYPE_LONG:
+    return (double)report->value.lval;
+  case MQTTEER_TYPE_UNSIGNED_LONG:
+    return (double)report->value.ulval;
+  case MQTTEER_TYPE_INT:
+    return report->value.ival;
+  default:
+    return NAN;
+  }
+}
+
+// Add the current values of the sampled slots of a collector to their
+// windows or report the aggregates of the windows.
+// Returns whether the collector has sampled slots.
+static bool mqtteer_sample(mqtteer_reports *reports, unsigned id,
+                           enum mqtteer_sample_op op) {
+  bool sampled = false;
+
+  for (unsigned i = 0; i < reports->ngroups; i++) {
+    const struct mqtteer_group *g = &reports->groups[i];
+    if (!g->active || g->collector != id)
+      continue;
+
+    for (unsigned j = 0; j < g->nslots; j++) {
+      mqtteer_report *report = &reports->reports[g->slots[j]];
+      if (report->window == NULL)
+        continue;
+
+      sampled = true;
+      if (op == SAMPLE_CLOSE)
+        mqtteer_window_close(reports, report->window);
+      else if (op == SAMPLE_ADD && report->has_value)
+        mqtteer_window_add(report->window, mqtteer_report_dbl(report));
     }
   }
-  sensors_cleanup();
+
+  return sampled;
 }
 
-void mqtteer_batteries_reports(mqtteer_reports *reports) {
-  mqtteer_batteries *batteries = mqtteer_get_batteries();
+static double mqtteer_elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) * 1e3 +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void mqtteer_collect_report(mqtteer_reports *reports, unsigned id) {
+  mqtteer_set_collector(reports, id);
+  mqtteer_collectors[id].collect(reports);
+  mqtteer_sample(reports, id, SAMPLE_ADD);
+}
+
+// the whole collection, on this thread
+static void mqtteer_collect(mqtteer_reports *reports, unsigned id) {
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (mqtteer_collectors[id].read != NULL)
+    mqtteer_collectors[id].read();
+  mqtteer_collect_report(reports, id);
+  mqtteer_collectors[id].duration_ms = mqtteer_elapsed_ms(&start);
+}
+
+// Publish the values of a group if one of them changed. They are all sent
+// again when they have not been for max_age seconds, or on refresh.
+static void mqtteer_publish_group(mqtteer_reports *reports, unsigned group,
+                                  bool refresh) {
+  struct mqtteer_group *g = &reports->groups[group];
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - g->last_publish >= mqtteer_max_age)
+    refresh = true;
+
+  if (!mqtteer_reports_update_published(reports, group, refresh) && !refresh) {
+    if (mqtteer_debug)
+      printf("%s: no change to publish\n", g->state_topic);
+    return;
+  }
+
+  g->last_publish = now.tv_sec;
+  mqtteer_send_metrics(reports, group);
+}
+
+static void mqtteer_publish(mqtteer_reports *reports, unsigned id,
+                            bool refresh) {
+  for (unsigned i = 0; i < reports->ngroups; i++) {
+    if (reports->groups[i].active && reports->groups[i].collector == id &&
+        reports->groups[i].nslots > 0)
+      mqtteer_publish_group(reports, i, refresh);
+  }
+}
+
+// The values of a collector go to every enabled sink once it ran. Home
+// Assistant over MQTT is always there, the other sinks are enabled by their
+// environment variable and only pay for serializing when they are.
+struct mqtteer_sink {
+  const char *name;
+  // returns whether the sink is enabled
+  bool (*init)(void);
+  void (*collected)(mqtteer_reports *reports, unsigned collector);
+  // descriptor to wait on and its handler, when the sink has one
+  int (*fd)(void);
+  void (*ready)(void);
+  bool enabled;
+};
+
+static bool mqtteer_mqtt_sink_init(void) { return true; }
+
+static void mqtteer_mqtt_sink_collected(mqtteer_reports *reports,
+                                        unsigned collector) {
+  // new slots have to be announced before their value is sent
+  mqtteer_announce_topics(reports);
+  mqtteer_publish(reports, collector, false);
+}
+
+enum mqtteer_sink_id {
+  SINK_MQTT,
+  SINK_PROMETHEUS,
+  SINK_STREAM,
+  NSINKS,
+};
+
+static struct mqtteer_sink mqtteer_sinks[NSINKS] = {
+    [SINK_MQTT] = {"mqtt", mqtteer_mqtt_sink_init, mqtteer_mqtt_sink_collected,
+                   NULL, NULL, false},
+    [SINK_PROMETHEUS] = {"prometheus", mqtteer_prometheus_init,
+                         mqtteer_prometheus_write, NULL, NULL, false},
+    [SINK_STREAM] = {"stream", mqtteer_stream_init, mqtteer_stream_write,
+                     mqtteer_stream_fd, mqtteer_stream_accept, false},
+};
+
+static void mqtteer_sinks_collected(mqtteer_reports *reports,
+                                    unsigned collector) {
+  for (unsigned i = 0; i < NSINKS; i++) {
+    if (mqtteer_sinks[i].enabled)
+      mqtteer_sinks[i].collected(reports, collector);
+  }
+}
+
+// A collection is over, its values are published at the end of the sampling
+// window.
+static void mqtteer_collected(mqtteer_reports *reports, unsigned id,
+                              const struct timespec *start) {
+  struct mqtteer_collector *collector = &mqtteer_collectors[id];
+
+  // only a sample, the window is not over yet
+  if (++collector->tick < collector->ticks)
+    return;
+  collector->tick = 0;
+  mqtteer_sample(reports, id, SAMPLE_CLOSE);
+  mqtteer_sinks_collected(reports, id);
+
+  double cycle_ms = mqtteer_elapsed_ms(start);
+  if (cycle_ms > mqtteer_stats.cycle_max_ms)
+    mqtteer_stats.cycle_max_ms = cycle_ms;
+}
+
+// hand the read part of a collection to a worker, unless the previous one is
+// still stuck in it
+static void mqtteer_dispatch(unsigned id) {
+  struct mqtteer_collector *collector = &mqtteer_collectors[id];
+
+  if (collector->busy) {
+    if (mqtteer_debug)
+      printf("%s: still collecting\n", collector->name);
+    return;
+  }
+
+  collector->busy = true;
+  clock_gettime(CLOCK_MONOTONIC, &collector->dispatched);
+  mqtteer_workers_submit(id, collector->read);
+}
+
+static void mqtteer_read_done(mqtteer_reports *reports, unsigned id) {
+  struct mqtteer_collector *collector = &mqtteer_collectors[id];
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  collector->busy = false;
+  if (collector->stale) {
+    collector->stale = false;
+    mqtteer_report_set_int(reports, collector->stale_slot, 0);
+  }
+  mqtteer_collect_report(reports, id);
+  collector->duration_ms = mqtteer_elapsed_ms(&collector->dispatched);
+  mqtteer_collected(reports, id, &start);
+}
+
+// The values of a collector past its deadline are published again, the last
+// known ones, along with its stale flag. Its worker is left to finish.
+static void mqtteer_check_deadlines(mqtteer_reports *reports) {
+  for (unsigned i = 0; i < NCOLLECTORS; i++) {
+    struct mqtteer_collector *collector = &mqtteer_collectors[i];
+    if (!collector->busy || collector->stale ||
+        mqtteer_elapsed_ms(&collector->dispatched) <
+            collector->deadline * 1e3)
+      continue;
 
-  for (unsigned i = 0; i < batteries->n; i++) {
-    mqtteer_new_report_int(reports, batteries->batteries[i].name,
-                           batteries->batteries[i].capacity, "battery", "%");
+    fprintf(stderr, "%s: collection missed its deadline\n", collector->name);
+    collector->stale = true;
+    mqtteer_report_set_int(reports, collector->stale_slot, 1);
+    mqtteer_sinks_collected(reports, i);
   }
+}
 
-  mqtteer_free_batteries(batteries);
+// Cost and health of mqtteer itself, as entities of a device of their own.
+// They are only reported when MQTTEER_SELF is set.
+#define PROC_SELF_STATM "/proc/self/statm"
+#define SELF_DEVICE "mqtteer"
+
+enum mqtteer_self_metric {
+  SELF_CYCLE_MAX,
+  SELF_MESSAGES,
+  SELF_PAYLOAD_BYTES,
+  SELF_PUBLISH_FAILURES,
+  SELF_LAST_PUBLISH_ERROR,
+  SELF_RECONNECTS,
+  SELF_QUEUED,
+  SELF_DELIVERED,
+  SELF_COALESCED,
+  SELF_DELIVERY,
+  SELF_LATENCY,
+  SELF_LATENCY_MAX,
+  SELF_RSS,
+  SELF_CPU,
+  NSELF_METRICS,
+};
+
+static bool mqtteer_self_enabled;
+static unsigned mqtteer_self_slots[NSELF_METRICS];
+static unsigned mqtteer_self_collector_slots[NCOLLECTORS];
+// this process, not the one of MQTTEER_ROOT
+static int mqtteer_self_statm_fd = -1;
+static struct timespec mqtteer_self_sampled_at;
+static double mqtteer_self_cpu_time;
+// counters at the previous collection, for the delivery ratio
+static unsigned long mqtteer_self_delivered, mqtteer_self_lost;
+
+static void mqtteer_self_init(mqtteer_reports *reports) {
+  static const struct {
+    const char *name;
+    enum mqtteer_valtype value_type;
+    const char *ha_kind;
+    const char *unit;
+  } METRICS[NSELF_METRICS] = {
+      [SELF_CYCLE_MAX] = {"self_cycle_max", MQTTEER_TYPE_DOUBLE, "duration",
+                          "ms"},
+      [SELF_MESSAGES] = {"self_messages", MQTTEER_TYPE_UNSIGNED_LONG, NULL,
+                         NULL},
+      [SELF_PAYLOAD_BYTES] = {"self_payload_bytes",
+                              MQTTEER_TYPE_UNSIGNED_LONG, "data_size", "B"},
+      [SELF_PUBLISH_FAILURES] = {"self_publish_failures",
+                                 MQTTEER_TYPE_UNSIGNED_LONG, NULL, NULL},
+      [SELF_LAST_PUBLISH_ERROR] = {"self_last_publish_error",
+                                   MQTTEER_TYPE_STR, NULL, NULL},
+      [SELF_RECONNECTS] = {"self_reconnects", MQTTEER_TYPE_UNSIGNED_LONG, NULL,
+                           NULL},
+      [SELF_QUEUED] = {"self_queued", MQTTEER_TYPE_UNSIGNED_LONG, NULL, NULL},
+      [SELF_DELIVERED] = {"self_delivered", MQTTEER_TYPE_UNSIGNED_LONG, NULL,
+                          NULL},
+      [SELF_COALESCED] = {"self_coalesced", MQTTEER_TYPE_UNSIGNED_LONG, NULL,
+                          NULL},
+      [SELF_DELIVERY] = {"self_delivery", MQTTEER_TYPE_DOUBLE, "power_factor",
+                         "%"},
+      [SELF_LATENCY] = {"self_latency", MQTTEER_TYPE_DOUBLE, "duration", "ms"},
+      [SELF_LATENCY_MAX] = {"self_latency_max", MQTTEER_TYPE_DOUBLE,
+                            "duration", "ms"},
+      [SELF_RSS] = {"self_rss", MQTTEER_TYPE_UNSIGNED_LONG, "data_size", "kB"},
+      [SELF_CPU] = {"self_cpu", MQTTEER_TYPE_DOUBLE, "power_factor", "%"},
+  };
+  char name[64];
+
+  mqtteer_self_enabled = getenv("MQTTEER_SELF") != NULL;
+  if (!mqtteer_self_enabled)
+    return;
+
+  mqtteer_self_statm_fd = open(PROC_SELF_STATM, O_RDONLY | O_CLOEXEC);
+  if (mqtteer_self_statm_fd < 0)
+    perror("failed to open " PROC_SELF_STATM);
+
+  for (unsigned i = 0; i < NSELF_METRICS; i++) {
+    mqtteer_self_slots[i] =
+        mqtteer_report_add(reports, METRICS[i].name, METRICS[i].value_type,
+                           METRICS[i].ha_kind, METRICS[i].unit);
+    mqtteer_report_set_device(reports, mqtteer_self_slots[i], SELF_DEVICE);
+  }
+  mqtteer_report_set_deadband(reports, mqtteer_self_slots[SELF_CYCLE_MAX], 1,
+                              0.1);
+  mqtteer_report_set_deadband(reports, mqtteer_self_slots[SELF_DELIVERY], 0.1,
+                              0);
+  mqtteer_report_set_deadband(reports, mqtteer_self_slots[SELF_LATENCY], 1,
+                              0.1);
+  mqtteer_report_set_deadband(reports, mqtteer_self_slots[SELF_LATENCY_MAX], 1,
+                              0.1);
+  mqtteer_report_set_deadband(reports, mqtteer_self_slots[SELF_RSS], 0, 0.01);
+  mqtteer_report_set_deadband(reports, mqtteer_self_slots[SELF_CPU], 0.1, 0);
+
+  for (unsigned i = 0; i < NCOLLECTORS; i++) {
+    if (i == COLLECTOR_SELF || mqtteer_collectors[i].disabled)
+      continue;
+    snprintf(name, sizeof(name), "self_collect_%s",
+             mqtteer_collectors[i].name);
+    unsigned slot = mqtteer_report_add(reports, name, MQTTEER_TYPE_DOUBLE,
+                                       "duration", "ms");
+    mqtteer_report_set_device(reports, slot, SELF_DEVICE);
+    mqtteer_report_set_deadband(reports, slot, 1, 0.1);
+    mqtteer_self_collector_slots[i] = slot;
+  }
 }
 
-mqtteer_reports *mqtteer_get_reports(void) {
-  mqtteer_reports *reports = malloc(sizeof(mqtteer_reports));
-  reports->nb = 0;
-  reports->reports = NULL;
+// resident set size in kB, from the second field of statm in pages
+static int mqtteer_self_rss(unsigned long *rss) {
+  struct mqtteer_parser parser;
+  unsigned long long size, resident;
+  char buf[PROC_SMALL_BUF_SIZE];
+
+  ssize_t count = pread(mqtteer_self_statm_fd, buf, sizeof(buf), 0);
+  if (count <= 0)
+    return -1;
+
+  mqtteer_parser_init(&parser, buf, (size_t)count);
+  if (mqtteer_parse_ull(&parser, &size) < 0 ||
+      mqtteer_parse_ull(&parser, &resident) < 0)
+    return -1;
 
-  mqtteer_loadavg_reports(reports);
-  mqtteer_uptime_report(reports);
-  mqtteer_meminfo_reports(reports);
+  *rss = (unsigned long)resident * (unsigned long)sysconf(_SC_PAGESIZE) / 1024;
+  return 0;
+}
 
-  mqtteer_sensors_reports(reports);
-  mqtteer_batteries_reports(reports);
+static void mqtteer_self_reports(mqtteer_reports *reports) {
+  const unsigned *slots = mqtteer_self_slots;
+  struct timespec now, cpu;
+  unsigned long rss;
 
-  for (unsigned i = 0; i < NPSI_KINDS; i++)
-    mqtteer_psi_reports(reports, PRESSURE_KINDS[i]);
+  if (!mqtteer_self_enabled)
+    return;
 
-  return reports;
+  for (unsigned i = 0; i < NCOLLECTORS; i++) {
+    if (i != COLLECTOR_SELF && !mqtteer_collectors[i].disabled)
+      mqtteer_report_set_dbl(reports, mqtteer_self_collector_slots[i],
+                             mqtteer_collectors[i].duration_ms);
+  }
+
+  mqtteer_report_set_dbl(reports, slots[SELF_CYCLE_MAX],
+                         mqtteer_stats.cycle_max_ms);
+  mqtteer_stats.cycle_max_ms = 0;
+  mqtteer_report_set_ulong(reports, slots[SELF_MESSAGES],
+                           mqtteer_stats.messages);
+  mqtteer_report_set_ulong(reports, slots[SELF_PAYLOAD_BYTES],
+                           mqtteer_stats.payload_bytes);
+  mqtteer_report_set_ulong(reports, slots[SELF_PUBLISH_FAILURES],
+                           mqtteer_stats.publish_failures);
+  mqtteer_report_set_str(reports, slots[SELF_LAST_PUBLISH_ERROR],
+                         mosquitto_strerror(mqtteer_stats.last_publish_error));
+  mqtteer_report_set_ulong(reports, slots[SELF_RECONNECTS],
+                           mqtteer_stats.connects > 0
+                               ? mqtteer_stats.connects - 1
+                               : 0);
+  mqtteer_report_set_ulong(reports, slots[SELF_QUEUED], mqtteer_stats.queued);
+  mqtteer_report_set_ulong(reports, slots[SELF_DELIVERED],
+                           mqtteer_stats.delivered);
+  mqtteer_report_set_ulong(reports, slots[SELF_COALESCED],
+                           mqtteer_stats.coalesced);
+
+  // messages that reached the broker out of those that were not replaced or
+  // failed since the last collection
+  unsigned long delivered = mqtteer_stats.delivered - mqtteer_self_delivered;
+  unsigned long lost = mqtteer_stats.publish_failures +
+                       mqtteer_stats.coalesced - mqtteer_self_lost;
+  if (delivered + lost > 0)
+    mqtteer_report_set_dbl(reports, slots[SELF_DELIVERY],
+                           (double)delivered * 100 /
+                               (double)(delivered + lost));
+  mqtteer_self_delivered = mqtteer_stats.delivered;
+  mqtteer_self_lost = mqtteer_stats.publish_failures + mqtteer_stats.coalesced;
+
+  // mean and longest time to an acknowledgment since the last collection
+  if (mqtteer_stats.latency_count > 0) {
+    mqtteer_report_set_dbl(reports, slots[SELF_LATENCY],
+                           mqtteer_stats.latency_sum_ms /
+                               (double)mqtteer_stats.latency_count);
+    mqtteer_report_set_dbl(reports, slots[SELF_LATENCY_MAX],
+                           mqtteer_stats.latency_max_ms);
+  }
+  mqtteer_stats.latency_sum_ms = 0;
+  mqtteer_stats.latency_count = 0;
+  mqtteer_stats.latency_max_ms = 0;
+
+  if (mqtteer_self_rss(&rss) == 0)
+    mqtteer_report_set_ulong(reports, slots[SELF_RSS], rss);
+  else
+    mqtteer_report_unset(reports, slots[SELF_RSS]);
+
+  // CPU time in percent of one CPU since the last collection
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  double cpu_time = (double)cpu.tv_sec + (double)cpu.tv_nsec / 1e9;
+  double elapsed =
+      (double)(now.tv_sec - mqtteer_self_sampled_at.tv_sec) +
+      (double)(now.tv_nsec - mqtteer_self_sampled_at.tv_nsec) / 1e9;
+  if (mqtteer_self_sampled_at.tv_sec != 0 && elapsed > 0)
+    mqtteer_report_set_dbl(reports, slots[SELF_CPU],
+                           (cpu_time - mqtteer_self_cpu_time) * 100 / elapsed);
+  mqtteer_self_sampled_at = now;
+  mqtteer_self_cpu_time = cpu_time;
 }
 
 void mqtteer_set_will(void) {
@@ -744,11 +2475,593 @@ void mqtteer_set_will(void) {
   size_t payload_len = strlen(payload);
   mqtteer_ensure_payload_len_conversion(payload_len);
 
-  size_t topic_len = mqtteer_state_topic_len();
-  char state_topic[topic_len];
-  mqtteer_get_state_topic_name(state_topic, topic_len);
+  mosquitto_will_set(mosq, mqtteer_state_topic, (int) payload_len, payload, 0,
+                     false);
+}
+
+// Spooled messages are replayed by a timer, at most mqtteer_spool_rate of
+// them per second, starting after a random delay.
+static int mqtteer_spool_fd = -1;
+static struct mqtteer_buf mqtteer_spool_buf;
+
+static void mqtteer_spool_arm(bool armed) {
+  long delay_ms = armed ? 1 + random() % SPOOL_JITTER_MS : 0;
+  struct itimerspec spec = {
+      .it_interval = {.tv_sec = armed ? 1 : 0},
+      .it_value = {.tv_sec = delay_ms / 1000,
+                   .tv_nsec = delay_ms % 1000 * 1000000},
+  };
+
+  if (mqtteer_spool_fd < 0)
+    return;
+  if (timerfd_settime(mqtteer_spool_fd, 0, &spec, NULL) < 0) {
+    perror("timerfd_settime failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// One-shot timer for the next attempt to reconnect, armed when the connection
+// is lost or an attempt failed.
+static int mqtteer_reconnect_fd = -1;
+static bool mqtteer_reconnect_armed;
+
+static void mqtteer_reconnect_arm(bool armed) {
+  long delay_ms = (long)mqtteer_reconnect_delay * 1000;
+  delay_ms = armed ? delay_ms / 2 + random() % (delay_ms / 2 + 1) : 0;
+  struct itimerspec spec = {
+      .it_value = {.tv_sec = delay_ms / 1000,
+                   .tv_nsec = delay_ms % 1000 * 1000000},
+  };
+
+  if (timerfd_settime(mqtteer_reconnect_fd, 0, &spec, NULL) < 0) {
+    perror("timerfd_settime failed");
+    exit(EXIT_FAILURE);
+  }
+  mqtteer_reconnect_armed = armed;
+  if (!armed)
+    return;
+
+  if (mqtteer_debug)
+    printf("reconnecting in %ld ms\n", delay_ms);
+  mqtteer_reconnect_delay = mqtteer_reconnect_delay * 2 < RECONNECT_MAX
+                                ? mqtteer_reconnect_delay * 2
+                                : RECONNECT_MAX;
+}
+
+// Connecting never blocks the loop: the broker address is looked up by a
+// worker, as a resolver may take long to answer, with a thread kept for it so
+// that hung collectors do not hold it up. The connection is then made
+// asynchronously. mosquitto sends CONNECT once the socket is writable, which
+// epoll waits for since mosquitto wants to write it.
+#define WORKER_RESOLVE NCOLLECTORS
+
+static char *mqtteer_broker_host;
+static int mqtteer_broker_port;
+static char mqtteer_broker_addr[NI_MAXHOST];
+static int mqtteer_broker_resolve_error;
+// a lookup is in progress
+static bool mqtteer_connecting;
+static unsigned long mqtteer_connect_attempts;
+
+// run by a worker
+static void mqtteer_broker_resolve(void) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *result;
+
+  mqtteer_broker_resolve_error =
+      getaddrinfo(mqtteer_broker_host, NULL, &hints, &result);
+  if (mqtteer_broker_resolve_error != 0)
+    return;
+
+  mqtteer_broker_resolve_error =
+      getnameinfo(result->ai_addr, result->ai_addrlen, mqtteer_broker_addr,
+                  sizeof(mqtteer_broker_addr), NULL, 0, NI_NUMERICHOST);
+  freeaddrinfo(result);
+}
 
-  mosquitto_will_set(mosq, state_topic, (int) payload_len, payload, 0, false);
+static void mqtteer_connect_start(void) {
+  mqtteer_connecting = true;
+  mqtteer_connect_attempts++;
+  mqtteer_workers_submit(WORKER_RESOLVE, mqtteer_broker_resolve);
+}
+
+// Failures leave no socket, mqtteer_run then arms the timer for the next
+// attempt. So does an asynchronous connection that fails or is refused, once
+// mosquitto closed its socket.
+static void mqtteer_connect_resolved(void) {
+  // only the first failure is worth telling about
+  bool verbose = mqtteer_connect_attempts == 1 || mqtteer_debug;
+
+  mqtteer_connecting = false;
+  if (mqtteer_broker_resolve_error != 0) {
+    if (verbose)
+      fprintf(stderr, "failed to resolve %s: %s\n", mqtteer_broker_host,
+              gai_strerror(mqtteer_broker_resolve_error));
+    return;
+  }
+
+  int ret = mosquitto_connect_async(mosq, mqtteer_broker_addr,
+                                    mqtteer_broker_port, MOSQ_KEEPALIVE);
+  if (ret != MOSQ_ERR_SUCCESS && verbose)
+    fprintf(stderr, "failed to connect to %s: %s\n", mqtteer_broker_host,
+            mosquitto_strerror(ret));
+}
+
+// Send the oldest messages again, with the time they were sampled at so that
+// they can be told apart from current values. They go to <group>/spool rather
+// than <group>/state: the sensors would otherwise show these old values, on
+// top of the current ones published on connection, until the next change.
+static void mqtteer_spool_replay(void) {
+  struct mqtteer_buf *buf = &mqtteer_spool_buf;
+  char topic[512];
+  const char *payload;
+  size_t payload_len;
+  long long timestamp;
+  char timestamp_key[48];
+
+  for (unsigned i = 0; i < mqtteer_spool_rate && mqtteer_connected; i++) {
+    if (mqtteer_spool_empty() || mqtteer_window_full())
+      break;
+    if (mqtteer_spool_peek(topic, sizeof(topic), &payload, &payload_len,
+                           &timestamp) < 0)
+      continue;
+    size_t topic_len = strlen(topic);
+    if (topic_len > 6 && strcmp(topic + topic_len - 6, "/state") == 0)
+      strcpy(topic + topic_len - 6, "/spool");
+
+    // payloads are JSON objects, the timestamp goes first
+    if (payload_len < 2 || payload[0] != '{' ||
+        payload[payload_len - 1] != '}') {
+      fprintf(stderr, "spooled message for %s is not an object, dropping it\n",
+              topic);
+      mqtteer_spool_pop();
+      continue;
+    }
+    buf->len = 0;
+    mqtteer_buf_append(buf, timestamp_key,
+                       (size_t)sprintf(timestamp_key, "{\"timestamp\":%lld",
+                                       timestamp));
+    if (payload_len > 2)
+      mqtteer_buf_append_lit(buf, ",");
+    mqtteer_buf_append(buf, payload + 1, payload_len - 1);
+
+    // the broker would never take it
+    int ret = mqtteer_send(topic, buf->data, buf->len, false);
+    if (mqtteer_is_connection_error(ret))
+      break;
+    mqtteer_spool_pop();
+  }
+
+  if (mqtteer_spool_empty() || !mqtteer_connected)
+    mqtteer_spool_arm(false);
+}
+
+static void mqtteer_on_connect(struct mosquitto *client, void *obj, int rc) {
+  (void)obj;
+
+  if (rc != 0) {
+    fprintf(stderr, "connection refused: %s\n", mosquitto_connack_string(rc));
+    return;
+  }
+
+  if (mqtteer_debug)
+    printf("connected\n");
+  mqtteer_connected = true;
+  mqtteer_stats.connects++;
+  mqtteer_reconnect_delay = RECONNECT_MIN;
+  mqtteer_reconnect_arm(false);
+  // QoS 0 messages queued on the previous connection were dropped, QoS 1 ones
+  // are sent again by mosquitto
+  if (mqtteer_qos == 0)
+    mqtteer_inflight_reset();
+  mosquitto_subscribe(client, NULL, HA_STATUS_TOPIC, 0);
+
+  // the broker should still have our retained discovery messages but it may
+  // have been restarted without persistence
+  mqtteer_announce_pending = true;
+  if (!mqtteer_spool_empty())
+    mqtteer_spool_arm(true);
+}
+
+// with MQTT v5, the broker tells how many topic aliases it takes
+static void mqtteer_on_connect_v5(struct mosquitto *client, void *obj, int rc,
+                                  int flags, const mosquitto_property *props) {
+  uint16_t alias_max = 0;
+  (void)flags;
+
+  mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+                                &alias_max, false);
+  mqtteer_aliases_reset(alias_max);
+  if (mqtteer_debug)
+    printf("%u topic aliases\n", mqtteer_alias_max);
+  mqtteer_on_connect(client, obj, rc);
+}
+
+static void mqtteer_on_disconnect(struct mosquitto *client, void *obj,
+                                  int rc) {
+  (void)client;
+  (void)obj;
+
+  if (rc != 0)
+    fprintf(stderr, "disconnected from the broker\n");
+  mqtteer_connected = false;
+  if (mqtteer_qos == 0)
+    mqtteer_inflight_reset();
+}
+
+// QoS 0 messages are published once they are written to the socket, QoS 1
+// ones when the broker acknowledged them
+static void mqtteer_on_publish(struct mosquitto *client, void *obj, int mid) {
+  (void)client;
+  (void)obj;
+
+  if (mqtteer_stats.queued > 0)
+    mqtteer_stats.queued--;
+  mqtteer_stats.delivered++;
+  mqtteer_inflight_ack(mid);
+}
+
+static void mqtteer_on_message(struct mosquitto *client, void *obj,
+                               const struct mosquitto_message *message) {
+  (void)client;
+  (void)obj;
+
+  // a retained status is an old birth message we already know about
+  if (message->retain || strcmp(message->topic, HA_STATUS_TOPIC) != 0)
+    return;
+
+  if ((size_t)message->payloadlen == strlen(HA_STATUS_ONLINE) &&
+      memcmp(message->payload, HA_STATUS_ONLINE, strlen(HA_STATUS_ONLINE)) ==
+          0) {
+    if (mqtteer_debug)
+      printf("Home Assistant is online\n");
+    mqtteer_announce_pending = true;
+  }
+}
+
+// losing the broker is not fatal, we connect again from mqtteer_run
+static void mqtteer_check_mosquitto(int ret) {
+  if (mqtteer_is_connection_error(ret)) {
+    mqtteer_connected = false;
+    return;
+  }
+  if (ret != MOSQ_ERR_SUCCESS) {
+    fprintf(stderr, "mosquitto loop failed: %s\n", mosquitto_strerror(ret));
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Everything happens in a single epoll loop: every collector has a timerfd
+// firing at its own interval, the mosquitto socket is driven with
+// mosquitto_loop_read/write, PSI triggers wake the loop up when they fire and
+// inotify tells about cgroups being created or removed, a last timer replays
+// the spool. Sinks may have a descriptor of their own, e.g. to accept
+// clients. Collectors reading hardware run in workers, an eventfd tells when
+// they are done so that nothing here waits on a hung device.
+// epoll events carry one of these tags, plus the index of the collector or
+// trigger.
+#define EVENT_MOSQUITTO 0
+#define EVENT_HEARTBEAT 1
+#define EVENT_CGROUP_INOTIFY 2
+#define EVENT_SPOOL 3
+#define EVENT_WORKERS 4
+#define EVENT_RECONNECT 5
+#define EVENT_PUSH 6
+#define EVENT_SINK 0x10
+#define EVENT_COLLECTOR 0x100
+#define EVENT_PSI_TRIGGER 0x10000
+#define EPOLL_MAX_EVENTS 16
+
+static int mqtteer_epoll_fd = -1;
+static int mqtteer_heartbeat_fd = -1;
+static int mqtteer_mosq_fd = -1;
+static uint32_t mqtteer_mosq_events;
+
+static void mqtteer_epoll_add(int fd, uint32_t events, uint32_t tag) {
+  struct epoll_event event = {.events = events, .data.u32 = tag};
+
+  if (epoll_ctl(mqtteer_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    perror("epoll_ctl failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// periodic timer with absolute expirations, so the cadence does not drift
+// with the time it takes to collect
+static int mqtteer_timer_new(unsigned interval) {
+  struct timespec now;
+
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    perror("timerfd_create failed");
+    exit(EXIT_FAILURE);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  struct itimerspec spec = {
+      .it_interval = {.tv_sec = interval},
+      .it_value = {.tv_sec = now.tv_sec + interval, .tv_nsec = now.tv_nsec},
+  };
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    perror("timerfd_settime failed");
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+
+static void mqtteer_timer_ack(int fd) {
+  uint64_t expirations;
+
+  // missed expirations are not caught up, the next collection is enough
+  if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    perror("failed to read timer");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static unsigned mqtteer_getenv_interval(const char *name, unsigned interval) {
+  char *interval_str = getenv(name);
+  char *endptr;
+
+  if (interval_str == NULL)
+    return interval;
+
+  long l_interval = strtol(interval_str, &endptr, 10);
+  if (interval_str == endptr || *endptr != '\0' || l_interval <= 0 ||
+      l_interval > INT_MAX) {
+    fprintf(stderr, "%s is invalid: %s\n", name, interval_str);
+    exit(EXIT_FAILURE);
+  }
+
+  return (unsigned)l_interval;
+}
+
+// register the slots of every collector, take a first sample and start
+// their timers
+void mqtteer_init_collectors(mqtteer_reports *reports) {
+  mqtteer_max_age = mqtteer_getenv_interval("MQTTEER_MAX_AGE", MAX_AGE);
+  unsigned sample_interval =
+      mqtteer_getenv_interval("MQTTEER_SAMPLE_INTERVAL", SAMPLE_INTERVAL);
+
+  mqtteer_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (mqtteer_epoll_fd < 0) {
+    perror("epoll_create1 failed");
+    exit(EXIT_FAILURE);
+  }
+
+  for (unsigned i = 0; i < NCOLLECTORS; i++)
+    mqtteer_collectors[i].disabled =
+        !mqtteer_config_enabled(mqtteer_collectors[i].name);
+  mqtteer_config_check();
+
+  for (unsigned i = 0; i < NCOLLECTORS; i++) {
+    struct mqtteer_collector *collector = &mqtteer_collectors[i];
+
+    if (collector->disabled)
+      continue;
+
+    // the environment has the last word
+    collector->interval =
+        mqtteer_config_interval(collector->name, collector->interval);
+    collector->interval =
+        mqtteer_getenv_interval(collector->interval_var, collector->interval);
+    reports->collector = i;
+    collector->group = mqtteer_group_add(reports, collector->name);
+
+    mqtteer_set_collector(reports, i);
+    if (collector->read != NULL) {
+      char name[64];
+      collector->deadline =
+          mqtteer_getenv_interval(collector->deadline_var, collector->deadline);
+      snprintf(name, sizeof(name), "%s_stale", collector->name);
+      collector->stale_slot =
+          mqtteer_report_add(reports, name, MQTTEER_TYPE_INT, NULL, NULL);
+      mqtteer_report_set_int(reports, collector->stale_slot, 0);
+    }
+    collector->init(reports);
+    // once, on this thread, there is nothing else to delay yet
+    mqtteer_collect(reports, i);
+
+    // slots found later are only sampled at the collector interval
+    unsigned timer_interval = collector->interval;
+    collector->ticks = 1;
+    if (mqtteer_sample(reports, i, SAMPLE_CHECK) &&
+        sample_interval < collector->interval) {
+      timer_interval = sample_interval;
+      collector->ticks = collector->interval / sample_interval;
+    }
+
+    collector->timer_fd = mqtteer_timer_new(timer_interval);
+    mqtteer_epoll_add(collector->timer_fd, EPOLLIN, EVENT_COLLECTOR + i);
+  }
+
+  mqtteer_heartbeat_fd = mqtteer_timer_new(REPORT_INTERVAL);
+  mqtteer_epoll_add(mqtteer_heartbeat_fd, EPOLLIN, EVENT_HEARTBEAT);
+
+  // disarmed while connected
+  mqtteer_reconnect_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+  if (mqtteer_reconnect_fd < 0) {
+    perror("timerfd_create failed");
+    exit(EXIT_FAILURE);
+  }
+  mqtteer_epoll_add(mqtteer_reconnect_fd, EPOLLIN, EVENT_RECONNECT);
+
+  // every collector read by a worker has a thread of its own, one that hangs
+  // never holds up the others, and so does the lookup of the broker: with at
+  // most one job in flight for each, there is always a thread left for it
+  unsigned nworkers = 1;
+  for (unsigned i = 0; i < NCOLLECTORS; i++) {
+    if (!mqtteer_collectors[i].disabled && mqtteer_collectors[i].read != NULL)
+      nworkers++;
+  }
+  unsigned workers = mqtteer_getenv_interval("MQTTEER_WORKERS", nworkers);
+  if (workers < nworkers) {
+    fprintf(stderr, "MQTTEER_WORKERS must be at least %u\n", nworkers);
+    exit(EXIT_FAILURE);
+  }
+  mqtteer_workers_init(workers);
+  mqtteer_epoll_add(mqtteer_workers_fd(), EPOLLIN, EVENT_WORKERS);
+
+  for (unsigned i = 0; i < mqtteer_npsi_triggers; i++)
+    mqtteer_epoll_add(mqtteer_psi_triggers[i].fd, EPOLLPRI,
+                      EVENT_PSI_TRIGGER + i);
+
+  if (mqtteer_cgroup_inotify_fd() >= 0)
+    mqtteer_epoll_add(mqtteer_cgroup_inotify_fd(), EPOLLIN,
+                      EVENT_CGROUP_INOTIFY);
+
+  if (mqtteer_push_fd() >= 0)
+    mqtteer_epoll_add(mqtteer_push_fd(), EPOLLIN, EVENT_PUSH);
+
+  if (mqtteer_spool_enabled()) {
+    mqtteer_spool_rate = mqtteer_getenv_interval("MQTTEER_SPOOL_RATE",
+                                                 SPOOL_RATE);
+    // disarmed until connected
+    mqtteer_spool_fd = timerfd_create(CLOCK_MONOTONIC,
+                                      TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mqtteer_spool_fd < 0) {
+      perror("timerfd_create failed");
+      exit(EXIT_FAILURE);
+    }
+    mqtteer_epoll_add(mqtteer_spool_fd, EPOLLIN, EVENT_SPOOL);
+    if (mqtteer_connected && !mqtteer_spool_empty())
+      mqtteer_spool_arm(true);
+  }
+
+  for (unsigned i = 0; i < NSINKS; i++) {
+    struct mqtteer_sink *sink = &mqtteer_sinks[i];
+    sink->enabled = sink->init();
+    if (sink->enabled && sink->fd != NULL)
+      mqtteer_epoll_add(sink->fd(), EPOLLIN, EVENT_SINK + i);
+  }
+}
+
+// the mosquitto socket changes on reconnection and we only want to be woken
+// up for writing when mosquitto has something to send
+static void mqtteer_epoll_update_mosquitto(void) {
+  int fd = mosquitto_socket(mosq);
+  uint32_t events = EPOLLIN;
+  if (mosquitto_want_write(mosq))
+    events |= EPOLLOUT;
+
+  if (fd == mqtteer_mosq_fd && (fd < 0 || events == mqtteer_mosq_events))
+    return;
+
+  struct epoll_event event = {.events = events, .data.u32 = EVENT_MOSQUITTO};
+  if (fd != mqtteer_mosq_fd) {
+    // closed descriptors are removed from the epoll set by the kernel
+    if (mqtteer_mosq_fd >= 0)
+      epoll_ctl(mqtteer_epoll_fd, EPOLL_CTL_DEL, mqtteer_mosq_fd, NULL);
+    if (fd >= 0 && epoll_ctl(mqtteer_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      perror("epoll_ctl failed");
+      exit(EXIT_FAILURE);
+    }
+  } else if (epoll_ctl(mqtteer_epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    perror("epoll_ctl failed");
+    exit(EXIT_FAILURE);
+  }
+
+  mqtteer_mosq_fd = fd;
+  mqtteer_mosq_events = events;
+}
+
+static void mqtteer_handle_event(mqtteer_reports *reports,
+                                 struct epoll_event *event) {
+  uint32_t tag = event->data.u32;
+
+  if (tag == EVENT_MOSQUITTO) {
+    if (event->events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+      mqtteer_check_mosquitto(mosquitto_loop_read(mosq, 1));
+    if (event->events & EPOLLOUT)
+      mqtteer_check_mosquitto(mosquitto_loop_write(mosq, 1));
+  } else if (tag == EVENT_HEARTBEAT) {
+    mqtteer_timer_ack(mqtteer_heartbeat_fd);
+    mqtteer_send_running();
+  } else if (tag == EVENT_RECONNECT) {
+    mqtteer_timer_ack(mqtteer_reconnect_fd);
+    mqtteer_reconnect_armed = false;
+    mqtteer_connect_start();
+  } else if (tag == EVENT_PUSH) {
+    // values are reported with the next push collection
+    mqtteer_push_receive();
+  } else if (tag == EVENT_SPOOL) {
+    mqtteer_timer_ack(mqtteer_spool_fd);
+    mqtteer_spool_replay();
+  } else if (tag == EVENT_WORKERS) {
+    unsigned id;
+    while (mqtteer_workers_done(&id) == 0) {
+      if (id == WORKER_RESOLVE)
+        mqtteer_connect_resolved();
+      else
+        mqtteer_read_done(reports, id);
+    }
+  } else if (tag >= EVENT_SINK && tag < EVENT_SINK + NSINKS) {
+    mqtteer_sinks[tag - EVENT_SINK].ready();
+  } else if (tag == EVENT_CGROUP_INOTIFY) {
+    // cgroups appeared or went away, their values come with the next cycle
+    mqtteer_set_collector(reports, COLLECTOR_CGROUPS);
+    mqtteer_cgroup_handle_inotify(reports);
+    mqtteer_announce_topics(reports);
+  } else if (tag >= EVENT_PSI_TRIGGER) {
+    mqtteer_set_collector(reports, COLLECTOR_PSI);
+    mqtteer_psi_triggered(reports,
+                          mqtteer_psi_triggers[tag - EVENT_PSI_TRIGGER].kind);
+    mqtteer_sinks_collected(reports, COLLECTOR_PSI);
+  } else if (tag >= EVENT_COLLECTOR) {
+    unsigned id = tag - EVENT_COLLECTOR;
+    struct mqtteer_collector *collector = &mqtteer_collectors[id];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mqtteer_timer_ack(collector->timer_fd);
+    // reported once a worker read the values
+    if (collector->read != NULL) {
+      mqtteer_dispatch(id);
+      return;
+    }
+    mqtteer_collect(reports, id);
+    mqtteer_collected(reports, id, &start);
+  }
+}
+
+void mqtteer_run(mqtteer_reports *reports) {
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+
+  while (true) {
+    // values collected while disconnected go to the spool
+    if (!mqtteer_connected && mosquitto_socket(mosq) < 0 &&
+        !mqtteer_connecting && !mqtteer_reconnect_armed)
+      mqtteer_reconnect_arm(true);
+
+    // right after the CONNACK on startup and reconnection, or when Home
+    // Assistant comes back online
+    if (mqtteer_announce_pending && mqtteer_connected) {
+      mqtteer_announce_topics(reports);
+      mqtteer_send_running();
+      for (unsigned i = 0; i < NCOLLECTORS; i++)
+        mqtteer_publish(reports, i, true);
+    }
+
+    mqtteer_epoll_update_mosquitto();
+
+    // mosquitto needs to be called every second to handle keepalives
+    int nevents = epoll_wait(mqtteer_epoll_fd, events, EPOLL_MAX_EVENTS, 1000);
+    if (nevents < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait failed");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < nevents; i++)
+      mqtteer_handle_event(reports, &events[i]);
+
+    mqtteer_check_mosquitto(mosquitto_loop_misc(mosq));
+    mqtteer_check_deadlines(reports);
+    mqtteer_push_drain();
+    mqtteer_send_pending(reports);
+  }
 }
 
 static void mqtteer_init_mosquitto(void) {
@@ -778,25 +3091,63 @@ static void mqtteer_init_mosquitto(void) {
   }
 
   mqtteer_device_name = mqtteer_getenv("MQTTEER_DEVICE_NAME");
+  mqtteer_init_topics();
+
+  char *qos_str = getenv("MQTTEER_QOS");
+  if (qos_str != NULL) {
+    if (strcmp(qos_str, "0") != 0 && strcmp(qos_str, "1") != 0) {
+      fprintf(stderr, "MQTTEER_QOS is invalid: %s\n", qos_str);
+      exit(EXIT_FAILURE);
+    }
+    mqtteer_qos = qos_str[0] - '0';
+  }
+  mqtteer_max_inflight =
+      mqtteer_getenv_interval("MQTTEER_MAX_INFLIGHT", MAX_INFLIGHT);
+  size_t inflight_size = mqtteer_max_inflight * sizeof(struct mqtteer_inflight);
+  mqtteer_inflight = mmalloc(inflight_size);
+  memset(mqtteer_inflight, 0, inflight_size);
 
   mosquitto_lib_init();
   atexit(cleanup);
   mosq = mosquitto_new(mqtteer_device_name, true, NULL);
   mosquitto_username_pw_set(mosq, mosq_username, mosq_password);
+  // mosquitto queues QoS 1 messages beyond its own limit, we never give it
+  // more than fits
+  mosquitto_int_option(mosq, MOSQ_OPT_SEND_MAXIMUM, (int)mqtteer_max_inflight);
   mqtteer_set_will();
-  mosquitto_connect(mosq, mosq_host, mosq_port, MOSQ_KEEPALIVE);
+  mqtteer_mqtt5 = getenv("MQTTEER_MQTT5") != NULL;
+  if (mqtteer_mqtt5) {
+    mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+    mosquitto_connect_v5_callback_set(mosq, mqtteer_on_connect_v5);
+  } else {
+    mosquitto_connect_callback_set(mosq, mqtteer_on_connect);
+  }
+  mosquitto_disconnect_callback_set(mosq, mqtteer_on_disconnect);
+  mosquitto_publish_callback_set(mosq, mqtteer_on_publish);
+  mosquitto_message_callback_set(mosq, mqtteer_on_message);
+
+  // connected to once the workers are there, see mqtteer_connect_start
+  mqtteer_broker_host = mosq_host;
+  mqtteer_broker_port = mosq_port;
 }
 
 int main(void) {
-  mqtteer_init_mosquitto();
+  static mqtteer_reports reports;
 
-  while (true) {
-    mqtteer_reports *reports = mqtteer_get_reports();
-    mqtteer_announce_topics(reports);
-    mqtteer_send_metrics(reports);
-    mqtteer_free_reports(reports);
-    sleep(60);
-  }
+  mqtteer_init_mosquitto();
+  // read /proc and /sys from a recorded tree rather than from this host
+  if (getenv("MQTTEER_ROOT") != NULL)
+    mqtteer_root = getenv("MQTTEER_ROOT");
+  srandom((unsigned)(time(NULL) ^ getpid()));
+  mqtteer_config_load();
+  mqtteer_spool_init();
+  mqtteer_sample_init();
+  mqtteer_init_collectors(&reports);
+  signal(SIGHUP, mqtteer_request_rescan);
+  // the broker may not be up yet, mqtteer_run keeps trying
+  mqtteer_connect_start();
+
+  mqtteer_run(&reports);
 
   exit(EXIT_SUCCESS);
 }
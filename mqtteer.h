@@ -0,0 +1,405 @@
+#ifndef MQTTEER_H
+#define MQTTEER_H
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NPSI_KINDS 3
+extern const char *PRESSURE_KINDS[NPSI_KINDS];
+
+extern int mqtteer_debug;
+// prefix of every /proc and /sys path, empty unless reading a recorded tree
+extern const char *mqtteer_root;
+
+// mqtteer should fail fast
+
+static inline void cclose(int fd) {
+  if (close(fd) != 0) {
+    perror("close failed");
+    exit(-1);
+  }
+}
+
+static inline void cclosedir(DIR *dir) {
+  if (closedir(dir) != 0) {
+    perror("closedir failed");
+    exit(-1);
+  }
+}
+
+static inline void *mmalloc(size_t len) {
+  void *ptr = malloc(len);
+  if (ptr == NULL) {
+    perror("malloc failed");
+    exit(-1);
+  }
+  return ptr;
+}
+
+static inline void *rrealloc(void *ptr, size_t len) {
+  void *out_ptr = realloc(ptr, len);
+  if (out_ptr == NULL) {
+    perror("realloc failed");
+    exit(-1);
+  }
+  return out_ptr;
+}
+
+// A metric source kept open between cycles and refreshed with pread, /proc
+// and sysfs files generate their content again when read from the start.
+// Paths are given without the root prefix.
+struct mqtteer_file {
+  char *path;
+  int fd;
+};
+
+int mqtteer_file_open(struct mqtteer_file *file, const char *path);
+void mqtteer_file_close(struct mqtteer_file *file);
+ssize_t mqtteer_file_read(struct mqtteer_file *file, char *buf, size_t len);
+
+union mqtteer_value {
+  double dblval;
+  long lval;
+  unsigned long ulval;
+  int ival;
+  // owned by the collector, it must outlive the report
+  const char *strval;
+};
+
+enum mqtteer_valtype {
+  MQTTEER_TYPE_DOUBLE = 1,
+  MQTTEER_TYPE_LONG = 2,
+  MQTTEER_TYPE_UNSIGNED_LONG = 3,
+  MQTTEER_TYPE_INT = 4,
+  MQTTEER_TYPE_STR = 5,
+};
+
+// Samples of a slot since its last publication, see sample.c
+enum mqtteer_window_aggregate {
+  WINDOW_MIN,
+  WINDOW_MAX,
+  WINDOW_MEAN,
+  WINDOW_P95,
+  NWINDOW_AGGREGATES,
+};
+
+struct mqtteer_p2 {
+  // marker heights, actual and desired positions and position increments
+  double q[5];
+  double n[5];
+  double np[5];
+  double dn[5];
+  unsigned count;
+};
+
+// small windows are kept whole, the quantile of larger ones is estimated
+#define WINDOW_EXACT_SAMPLES 64
+
+struct mqtteer_window {
+  // slots the aggregates are reported in
+  unsigned slots[NWINDOW_AGGREGATES];
+  unsigned count;
+  double min;
+  double max;
+  double sum;
+  double samples[WINDOW_EXACT_SAMPLES];
+  struct mqtteer_p2 quantile;
+};
+
+// A slot of the reports table. Collectors register their slots once and then
+// only overwrite values, slot numbers stay valid until they are removed.
+typedef struct {
+  char *name;
+  // `,"name":` ready to be copied in the state payload
+  char *key;
+  size_t key_len;
+  char *discovery_topic;
+  // group the value is published with
+  unsigned group;
+  // Home Assistant device of the entity, NULL for this host. Owned by the
+  // collector, it must outlive the report.
+  const char *device;
+  const char *device_class;
+  const char *unit_of_measurement;
+  union mqtteer_value value;
+  enum mqtteer_valtype value_type;
+  // last value sent, it is only replaced when the value moves out of the
+  // deadband: by more than deadband_abs and by more than deadband_rel times
+  // the published value
+  union mqtteer_value published_value;
+  double deadband_abs;
+  double deadband_rel;
+  // aggregates of the samples when the slot is sampled, NULL otherwise
+  struct mqtteer_window *window;
+  // the slot is registered
+  bool active;
+  // left out by MQTTEER_CONFIG, values set by the collector go nowhere
+  bool excluded;
+  // the collector has a value to report
+  bool has_value;
+  bool published;
+} mqtteer_report;
+
+// Slots are published by groups, each one with its own state topic. Every
+// collector has a group and may create more of them (e.g. one per cgroup).
+struct mqtteer_group {
+  char *name;
+  char *state_topic;
+  unsigned collector;
+  unsigned *slots;
+  unsigned nslots;
+  unsigned cap;
+  time_t last_publish;
+  // waiting for room in the publication window
+  bool pending;
+  bool active;
+};
+
+typedef struct {
+  mqtteer_report *reports;
+  unsigned int nb;
+  unsigned int cap;
+  // removed slots waiting to be reused
+  unsigned int nfree;
+  struct mqtteer_group *groups;
+  unsigned int ngroups;
+  // incremented every time a slot is added or removed
+  unsigned long generation;
+  // collector being initialized or run and the group its new slots go in
+  unsigned collector;
+  unsigned group;
+} mqtteer_reports;
+
+// Output buffer for payloads. Buffers are reused between messages so that
+// serializing does not allocate once they are large enough.
+struct mqtteer_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+static inline void mqtteer_buf_reserve(struct mqtteer_buf *buf, size_t len) {
+  if (buf->len + len <= buf->cap)
+    return;
+
+  while (buf->cap < buf->len + len)
+    buf->cap = buf->cap == 0 ? 1024 : buf->cap * 2;
+  buf->data = rrealloc(buf->data, buf->cap);
+}
+
+static inline void mqtteer_buf_append(struct mqtteer_buf *buf, const char *str,
+                                      size_t len) {
+  mqtteer_buf_reserve(buf, len);
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+}
+
+#define mqtteer_buf_append_lit(buf, lit)                                       \
+  mqtteer_buf_append(buf, lit, sizeof(lit) - 1)
+
+void mqtteer_buf_append_json_escaped(struct mqtteer_buf *buf,
+                                     const char *str);
+void mqtteer_buf_append_json_str(struct mqtteer_buf *buf, const char *str);
+void mqtteer_buf_append_ulong(struct mqtteer_buf *buf,
+                              unsigned long long value);
+void mqtteer_buf_append_long(struct mqtteer_buf *buf, long value);
+void mqtteer_buf_append_dbl(struct mqtteer_buf *buf, double value);
+void mqtteer_buf_append_value(struct mqtteer_buf *buf,
+                              enum mqtteer_valtype value_type,
+                              const union mqtteer_value *value);
+
+unsigned mqtteer_report_add(mqtteer_reports *reports, const char *name,
+                            enum mqtteer_valtype value_type,
+                            const char *ha_kind,
+                            const char *unit_of_measurement);
+void mqtteer_report_remove(mqtteer_reports *reports, unsigned slot);
+unsigned mqtteer_group_add(mqtteer_reports *reports, const char *name);
+void mqtteer_group_remove(mqtteer_reports *reports, unsigned group);
+void mqtteer_sanitize_name(char *name);
+bool mqtteer_glob_list_match(const char *globs, const char *name);
+
+// the collector could not get a value this time
+static inline void mqtteer_report_unset(mqtteer_reports *reports,
+                                        unsigned slot) {
+  reports->reports[slot].has_value = false;
+}
+
+static inline void mqtteer_report_set_dbl(mqtteer_reports *reports,
+                                          unsigned slot, double value) {
+  reports->reports[slot].value.dblval = value;
+  reports->reports[slot].has_value = true;
+}
+
+static inline void mqtteer_report_set_int(mqtteer_reports *reports,
+                                          unsigned slot, int value) {
+  reports->reports[slot].value.ival = value;
+  reports->reports[slot].has_value = true;
+}
+
+static inline void mqtteer_report_set_long(mqtteer_reports *reports,
+                                           unsigned slot, long value) {
+  reports->reports[slot].value.lval = value;
+  reports->reports[slot].has_value = true;
+}
+
+static inline void mqtteer_report_set_ulong(mqtteer_reports *reports,
+                                            unsigned slot,
+                                            unsigned long value) {
+  reports->reports[slot].value.ulval = value;
+  reports->reports[slot].has_value = true;
+}
+
+// strings are compared by content, the collector must not modify a string
+// that was given to the report in place
+static inline void mqtteer_report_set_str(mqtteer_reports *reports,
+                                          unsigned slot, const char *value) {
+  reports->reports[slot].value.strval = value;
+  reports->reports[slot].has_value = true;
+}
+
+// changes smaller than the deadband are not published, the default is to
+// publish every change
+static inline void mqtteer_report_set_deadband(mqtteer_reports *reports,
+                                               unsigned slot, double abs,
+                                               double rel) {
+  struct mqtteer_window *window = reports->reports[slot].window;
+
+  reports->reports[slot].deadband_abs = abs;
+  reports->reports[slot].deadband_rel = rel;
+  for (unsigned i = 0; window != NULL && i < NWINDOW_AGGREGATES; i++)
+    mqtteer_report_set_deadband(reports, window->slots[i], abs, rel);
+}
+
+static inline void mqtteer_report_set_device(mqtteer_reports *reports,
+                                             unsigned slot,
+                                             const char *device) {
+  struct mqtteer_window *window = reports->reports[slot].window;
+
+  reports->reports[slot].device = device;
+  // its discovery message changes
+  reports->generation++;
+  for (unsigned i = 0; window != NULL && i < NWINDOW_AGGREGATES; i++)
+    mqtteer_report_set_device(reports, window->slots[i], device);
+}
+
+struct mqtteer_psi_metrics {
+  double avg10;
+  double avg60;
+  double avg300;
+  long total;
+};
+
+struct mqtteer_psi {
+  struct mqtteer_psi_metrics some;
+  struct mqtteer_psi_metrics full;
+};
+
+// parse.c
+// A bounded cursor over a buffer read from /proc or sysfs, see parse.c
+struct mqtteer_parser {
+  const char *pos;
+  const char *end;
+};
+
+static inline void mqtteer_parser_init(struct mqtteer_parser *parser,
+                                       const char *buf, size_t len) {
+  parser->pos = buf;
+  parser->end = buf + len;
+}
+
+static inline bool mqtteer_parser_eof(const struct mqtteer_parser *parser) {
+  return parser->pos == parser->end;
+}
+
+void mqtteer_parse_skip_blanks(struct mqtteer_parser *parser);
+void mqtteer_parse_next_line(struct mqtteer_parser *parser);
+int mqtteer_parse_char(struct mqtteer_parser *parser, char c);
+int mqtteer_parse_literal(struct mqtteer_parser *parser, const char *literal);
+int mqtteer_parse_word(struct mqtteer_parser *parser, const char **word,
+                       size_t *len);
+int mqtteer_parse_ull(struct mqtteer_parser *parser, unsigned long long *value);
+int mqtteer_parse_ll(struct mqtteer_parser *parser, long long *value);
+int mqtteer_parse_dbl(struct mqtteer_parser *parser, double *value);
+int mqtteer_parse_keyed_ull(const char *buf, size_t len, const char *key,
+                            unsigned long long *value);
+int mqtteer_psi_parse(const char *buf, size_t len, struct mqtteer_psi *psi);
+
+// cpu.c
+void mqtteer_cpu_init(mqtteer_reports *reports);
+void mqtteer_cpu_reports(mqtteer_reports *reports);
+
+// net.c
+void mqtteer_net_init(mqtteer_reports *reports);
+void mqtteer_net_reports(mqtteer_reports *reports);
+
+// disk.c
+void mqtteer_disks_init(mqtteer_reports *reports);
+void mqtteer_disks_reports(mqtteer_reports *reports);
+
+// cgroup.c
+void mqtteer_cgroup_init(mqtteer_reports *reports);
+void mqtteer_cgroup_reports(mqtteer_reports *reports);
+int mqtteer_cgroup_inotify_fd(void);
+void mqtteer_cgroup_handle_inotify(mqtteer_reports *reports);
+
+// spool.c
+void mqtteer_spool_init(void);
+bool mqtteer_spool_enabled(void);
+bool mqtteer_spool_empty(void);
+void mqtteer_spool_push(const char *topic, const char *payload,
+                        size_t payload_len);
+int mqtteer_spool_peek(char *topic, size_t topic_size, const char **payload,
+                       size_t *payload_len, long long *timestamp);
+void mqtteer_spool_pop(void);
+
+// top.c
+void mqtteer_top_init(mqtteer_reports *reports);
+void mqtteer_top_read(void);
+void mqtteer_top_reports(mqtteer_reports *reports);
+
+// push.c
+void mqtteer_push_init(mqtteer_reports *reports);
+void mqtteer_push_reports(mqtteer_reports *reports);
+int mqtteer_push_fd(void);
+void mqtteer_push_receive(void);
+void mqtteer_push_drain(void);
+
+// config.c
+void mqtteer_config_load(void);
+bool mqtteer_config_selected(const char *name);
+bool mqtteer_config_enabled(const char *collector);
+unsigned mqtteer_config_interval(const char *collector, unsigned interval);
+void mqtteer_config_check(void);
+
+// prometheus.c
+bool mqtteer_prometheus_init(void);
+void mqtteer_prometheus_write(mqtteer_reports *reports, unsigned collector);
+
+// stream.c
+bool mqtteer_stream_init(void);
+int mqtteer_stream_fd(void);
+void mqtteer_stream_accept(void);
+void mqtteer_stream_write(mqtteer_reports *reports, unsigned collector);
+
+// worker.c
+void mqtteer_workers_init(unsigned nworkers);
+int mqtteer_workers_fd(void);
+void mqtteer_workers_submit(unsigned id, void (*fn)(void));
+int mqtteer_workers_done(unsigned *id);
+
+// sample.c
+void mqtteer_sample_init(void);
+bool mqtteer_sample_selected(const char *name);
+void mqtteer_window_attach(mqtteer_reports *reports, unsigned slot);
+void mqtteer_window_detach(mqtteer_reports *reports, unsigned slot);
+void mqtteer_window_add(struct mqtteer_window *window, double value);
+void mqtteer_window_close(mqtteer_reports *reports,
+                          struct mqtteer_window *window);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef MQTTEER_PUSH_H
+#define MQTTEER_PUSH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Layout of the shared memory rings given to mqtteer with MQTTEER_PUSH_RING,
+// for processes pushing metrics at a high rate. mqtteer creates the file, a
+// single process maps it shared and writes records with
+// mqtteer_push_ring_write, mqtteer reads them at least every second. Only the
+// latest value of every name is reported.
+
+#define MQTTEER_PUSH_RING_MAGIC 0x6d717470
+#define MQTTEER_PUSH_NAME_SIZE 56
+
+struct mqtteer_push_record {
+  // NUL terminated, letters, digits, '_' and '-'
+  char name[MQTTEER_PUSH_NAME_SIZE];
+  double value;
+};
+
+struct mqtteer_push_ring {
+  // set by mqtteer once the ring is ready
+  _Atomic uint32_t magic;
+  // number of records, a power of two
+  uint32_t size;
+  // records the producer could not write because the ring was full
+  _Atomic uint64_t dropped;
+  // only written by the producer
+  _Alignas(64) _Atomic uint64_t head;
+  // only written by mqtteer
+  _Alignas(64) _Atomic uint64_t tail;
+  _Alignas(64) struct mqtteer_push_record records[];
+};
+
+// Returns false when the ring is not ready or full, the record is dropped.
+static inline bool mqtteer_push_ring_write(struct mqtteer_push_ring *ring,
+                                           const char *name, double value) {
+  if (atomic_load_explicit(&ring->magic, memory_order_acquire) !=
+      MQTTEER_PUSH_RING_MAGIC)
+    return false;
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=
+      ring->size) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return false;
+  }
+
+  struct mqtteer_push_record *record = &ring->records[head & (ring->size - 1)];
+  strncpy(record->name, name, MQTTEER_PUSH_NAME_SIZE - 1);
+  record->name[MQTTEER_PUSH_NAME_SIZE - 1] = '\0';
+  record->value = value;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+#endif
@@ -0,0 +1,406 @@
+#include <errno.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "mqtteer.h"
+
+// Network interfaces statistics. All of them come from a single RTM_GETLINK
+// netlink dump per cycle, which scales to hosts with hundreds of veth
+// interfaces. Interfaces are selected with MQTTEER_NET_INTERFACES and
+// MQTTEER_NET_EXCLUDE, comma separated lists of globs. Netlink only knows
+// about this host, /proc/net/dev is read instead under another root.
+
+#define NET_DEFAULT_EXCLUDE "lo"
+#define NET_RECV_BUF_SIZE 32768
+#define PROC_NET_DEV "/proc/net/dev"
+
+enum mqtteer_net_counter {
+  NET_RX_BYTES,
+  NET_TX_BYTES,
+  NET_RX_PACKETS,
+  NET_TX_PACKETS,
+  NET_RX_ERRORS,
+  NET_TX_ERRORS,
+  NET_RX_DROPPED,
+  NET_TX_DROPPED,
+  NNET_COUNTERS,
+};
+
+static const struct {
+  const char *name;
+  const char *device_class;
+  const char *unit;
+} NET_COUNTERS[NNET_COUNTERS] = {
+    {"rx", "data_rate", "B/s"},          {"tx", "data_rate", "B/s"},
+    {"rx_packets", NULL, "packets/s"},   {"tx_packets", NULL, "packets/s"},
+    {"rx_errors", NULL, "errors/s"},     {"tx_errors", NULL, "errors/s"},
+    {"rx_dropped", NULL, "packets/s"},   {"tx_dropped", NULL, "packets/s"},
+};
+
+struct mqtteer_net_iface {
+  int index;
+  char name[IF_NAMESIZE];
+  unsigned group;
+  unsigned slots[NNET_COUNTERS];
+  unsigned long long counters[NNET_COUNTERS];
+  // found in the current dump
+  bool seen;
+  bool sampled;
+};
+
+static struct mqtteer_net_iface *mqtteer_net_ifaces;
+static unsigned mqtteer_net_nifaces;
+static char *mqtteer_net_include;
+static char *mqtteer_net_exclude;
+static int mqtteer_net_fd = -1;
+static unsigned mqtteer_net_seq;
+// grows to the largest datagram of a dump, so that none is ever cut
+static char *mqtteer_net_buf;
+static size_t mqtteer_net_buf_size;
+static struct mqtteer_file mqtteer_net_dev;
+static char *mqtteer_net_dev_buf;
+static size_t mqtteer_net_dev_buf_size = 4096;
+static struct timespec mqtteer_net_sampled_at;
+
+static bool mqtteer_net_selected(const char *name) {
+  return (mqtteer_net_include == NULL ||
+          mqtteer_glob_list_match(mqtteer_net_include, name)) &&
+         !mqtteer_glob_list_match(mqtteer_net_exclude, name);
+}
+
+void mqtteer_net_init(mqtteer_reports *reports) {
+  (void)reports;
+
+  mqtteer_net_include = getenv("MQTTEER_NET_INTERFACES");
+  mqtteer_net_exclude = getenv("MQTTEER_NET_EXCLUDE");
+  if (mqtteer_net_exclude == NULL)
+    mqtteer_net_exclude = NET_DEFAULT_EXCLUDE;
+
+  if (mqtteer_root[0] != '\0') {
+    mqtteer_net_dev_buf = mmalloc(mqtteer_net_dev_buf_size);
+    if (mqtteer_file_open(&mqtteer_net_dev, PROC_NET_DEV) < 0)
+      perror("failed to open " PROC_NET_DEV);
+    return;
+  }
+
+  mqtteer_net_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (mqtteer_net_fd < 0)
+    perror("failed to open netlink socket");
+}
+
+static void mqtteer_net_iface_add(mqtteer_reports *reports, int index,
+                                  const char *name) {
+  char group_name[strlen("net_") + IF_NAMESIZE];
+  char slot_name[sizeof(group_name) + strlen("_rx_dropped")];
+
+  mqtteer_net_ifaces =
+      rrealloc(mqtteer_net_ifaces,
+               (mqtteer_net_nifaces + 1) * sizeof(struct mqtteer_net_iface));
+  struct mqtteer_net_iface *iface = &mqtteer_net_ifaces[mqtteer_net_nifaces++];
+
+  memset(iface, 0, sizeof(struct mqtteer_net_iface));
+  iface->index = index;
+  snprintf(iface->name, sizeof(iface->name), "%s", name);
+
+  sprintf(group_name, "net_%s", iface->name);
+  mqtteer_sanitize_name(group_name);
+  unsigned collector_group = reports->group;
+  iface->group = mqtteer_group_add(reports, group_name);
+  reports->group = iface->group;
+
+  for (unsigned i = 0; i < NNET_COUNTERS; i++) {
+    sprintf(slot_name, "%s_%s", group_name, NET_COUNTERS[i].name);
+    iface->slots[i] =
+        mqtteer_report_add(reports, slot_name, MQTTEER_TYPE_DOUBLE,
+                           NET_COUNTERS[i].device_class, NET_COUNTERS[i].unit);
+    mqtteer_report_set_deadband(reports, iface->slots[i], 1, 0.05);
+  }
+  reports->group = collector_group;
+
+  if (mqtteer_debug)
+    printf("reporting network interface %s\n", iface->name);
+}
+
+static void mqtteer_net_iface_remove(mqtteer_reports *reports,
+                                     unsigned index) {
+  if (mqtteer_debug)
+    printf("network interface %s is gone\n", mqtteer_net_ifaces[index].name);
+
+  mqtteer_group_remove(reports, mqtteer_net_ifaces[index].group);
+  mqtteer_net_ifaces[index] = mqtteer_net_ifaces[--mqtteer_net_nifaces];
+}
+
+static struct mqtteer_net_iface *mqtteer_net_iface_find(int index) {
+  for (unsigned i = 0; i < mqtteer_net_nifaces; i++) {
+    if (mqtteer_net_ifaces[i].index == index)
+      return &mqtteer_net_ifaces[i];
+  }
+  return NULL;
+}
+
+static struct mqtteer_net_iface *mqtteer_net_iface_find_name(const char *name) {
+  for (unsigned i = 0; i < mqtteer_net_nifaces; i++) {
+    if (strcmp(mqtteer_net_ifaces[i].name, name) == 0)
+      return &mqtteer_net_ifaces[i];
+  }
+  return NULL;
+}
+
+// Counters are 64 bits wide in the dump, but some drivers only keep 32 bits
+// and wrap around at 2^32. A counter only wraps when it was close to that,
+// anything else going backwards is a reset (e.g. the driver was reloaded),
+// which would otherwise look like a spike of about 4 GiB.
+static bool mqtteer_net_delta(unsigned long long cur, unsigned long long prev,
+                              unsigned long long *delta) {
+  if (cur >= prev) {
+    *delta = cur - prev;
+    return true;
+  }
+  if (prev <= UINT32_MAX && prev > UINT32_MAX / 2 && cur <= UINT32_MAX) {
+    *delta = cur + ((unsigned long long)UINT32_MAX + 1) - prev;
+    return true;
+  }
+  return false;
+}
+
+static void mqtteer_net_iface_update(mqtteer_reports *reports,
+                                     struct mqtteer_net_iface *iface,
+                                     const struct rtnl_link_stats64 *stats,
+                                     double elapsed) {
+  unsigned long long counters[NNET_COUNTERS] = {
+      stats->rx_bytes,  stats->tx_bytes,  stats->rx_packets,
+      stats->tx_packets, stats->rx_errors, stats->tx_errors,
+      stats->rx_dropped, stats->tx_dropped,
+  };
+  unsigned long long delta;
+
+  for (unsigned i = 0; i < NNET_COUNTERS; i++) {
+    if (iface->sampled && elapsed > 0 &&
+        mqtteer_net_delta(counters[i], iface->counters[i], &delta))
+      mqtteer_report_set_dbl(reports, iface->slots[i],
+                             (double)delta / elapsed);
+    else
+      mqtteer_report_unset(reports, iface->slots[i]);
+    iface->counters[i] = counters[i];
+  }
+
+  iface->sampled = true;
+}
+
+static void mqtteer_net_seen(mqtteer_reports *reports, int index,
+                             const char *name,
+                             const struct rtnl_link_stats64 *stats,
+                             double elapsed) {
+  if (!mqtteer_net_selected(name))
+    return;
+
+  struct mqtteer_net_iface *iface = mqtteer_net_iface_find(index);
+  // the index of a renamed interface stays the same
+  if (iface != NULL && strcmp(iface->name, name) != 0) {
+    mqtteer_net_iface_remove(reports,
+                             (unsigned)(iface - mqtteer_net_ifaces));
+    iface = NULL;
+  }
+  if (iface == NULL) {
+    mqtteer_net_iface_add(reports, index, name);
+    iface = &mqtteer_net_ifaces[mqtteer_net_nifaces - 1];
+  }
+
+  iface->seen = true;
+  mqtteer_net_iface_update(reports, iface, stats, elapsed);
+}
+
+static void mqtteer_net_link(mqtteer_reports *reports,
+                             const struct nlmsghdr *nlh, double elapsed) {
+  const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+  struct rtnl_link_stats64 stats;
+  bool has_stats = false;
+  const char *name = NULL;
+  int len = (int)IFLA_PAYLOAD(nlh);
+
+  for (const struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len);
+       rta = RTA_NEXT(rta, len)) {
+    if (rta->rta_type == IFLA_IFNAME)
+      name = RTA_DATA(rta);
+    else if (rta->rta_type == IFLA_STATS64 &&
+             RTA_PAYLOAD(rta) >= sizeof(struct rtnl_link_stats64)) {
+      // attributes are only aligned on 4 bytes
+      memcpy(&stats, RTA_DATA(rta), sizeof(stats));
+      has_stats = true;
+    }
+  }
+
+  if (name == NULL || !has_stats)
+    return;
+
+  mqtteer_net_seen(reports, ifi->ifi_index, name, &stats, elapsed);
+}
+
+static int mqtteer_net_dump(mqtteer_reports *reports, double elapsed) {
+  struct {
+    struct nlmsghdr nlh;
+    struct ifinfomsg ifi;
+  } request = {
+      .nlh =
+          {
+              .nlmsg_len = sizeof(request),
+              .nlmsg_type = RTM_GETLINK,
+              .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+              .nlmsg_seq = ++mqtteer_net_seq,
+          },
+      .ifi = {.ifi_family = AF_UNSPEC},
+  };
+
+  if (mqtteer_net_buf == NULL) {
+    mqtteer_net_buf_size = NET_RECV_BUF_SIZE;
+    mqtteer_net_buf = mmalloc(mqtteer_net_buf_size);
+  }
+
+  if (send(mqtteer_net_fd, &request, sizeof(request), 0) < 0) {
+    perror("failed to request network interfaces");
+    return -1;
+  }
+
+  while (true) {
+    // a datagram that does not fit is cut, its size is known beforehand
+    ssize_t count = recv(mqtteer_net_fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    if (count > (ssize_t)mqtteer_net_buf_size) {
+      mqtteer_net_buf_size = (size_t)count;
+      mqtteer_net_buf = rrealloc(mqtteer_net_buf, mqtteer_net_buf_size);
+    }
+    if (count >= 0)
+      count = recv(mqtteer_net_fd, mqtteer_net_buf, mqtteer_net_buf_size,
+                   MSG_TRUNC);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("failed to dump network interfaces");
+      return -1;
+    }
+    if (count > (ssize_t)mqtteer_net_buf_size) {
+      fprintf(stderr, "network interfaces dump was truncated\n");
+      return -1;
+    }
+
+    int len = (int)count;
+    for (struct nlmsghdr *nlh = (struct nlmsghdr *)mqtteer_net_buf;
+         NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+      // leftovers of a dump that was interrupted
+      if (nlh->nlmsg_seq != mqtteer_net_seq)
+        continue;
+
+      switch (nlh->nlmsg_type) {
+      case NLMSG_DONE:
+        return 0;
+      case NLMSG_ERROR: {
+        const struct nlmsgerr *err = NLMSG_DATA(nlh);
+        fprintf(stderr, "failed to dump network interfaces: %s\n",
+                strerror(-err->error));
+        return -1;
+      }
+      case RTM_NEWLINK:
+        mqtteer_net_link(reports, nlh, elapsed);
+        break;
+      }
+    }
+  }
+}
+
+// "<name>: <8 receive counters> <8 transmit counters>", interfaces have no
+// index there and are told apart by name
+static void mqtteer_net_dev_line(mqtteer_reports *reports,
+                                 struct mqtteer_parser *parser,
+                                 double elapsed) {
+  static int next_index = -1;
+  unsigned long long fields[16];
+  char name[IF_NAMESIZE];
+  const char *word;
+  size_t len;
+
+  // header lines have no colon after their first word
+  if (mqtteer_parse_word(parser, &word, &len) < 0 || len >= IF_NAMESIZE ||
+      mqtteer_parse_char(parser, ':') < 0)
+    return;
+  memcpy(name, word, len);
+  name[len] = '\0';
+
+  for (unsigned i = 0; i < 16; i++)
+    if (mqtteer_parse_ull(parser, &fields[i]) < 0)
+      return;
+
+  struct rtnl_link_stats64 stats = {
+      .rx_bytes = fields[0],
+      .rx_packets = fields[1],
+      .rx_errors = fields[2],
+      .rx_dropped = fields[3],
+      .tx_bytes = fields[8],
+      .tx_packets = fields[9],
+      .tx_errors = fields[10],
+      .tx_dropped = fields[11],
+  };
+  struct mqtteer_net_iface *iface = mqtteer_net_iface_find_name(name);
+  mqtteer_net_seen(reports, iface != NULL ? iface->index : next_index--,
+                   name, &stats, elapsed);
+}
+
+static int mqtteer_net_read_proc(mqtteer_reports *reports, double elapsed) {
+  ssize_t count;
+
+  while ((count = mqtteer_file_read(&mqtteer_net_dev, mqtteer_net_dev_buf,
+                                    mqtteer_net_dev_buf_size)) >=
+         (ssize_t)mqtteer_net_dev_buf_size - 1) {
+    mqtteer_net_dev_buf_size *= 2;
+    mqtteer_net_dev_buf =
+        rrealloc(mqtteer_net_dev_buf, mqtteer_net_dev_buf_size);
+  }
+  if (count <= 0) {
+    perror("failed to read " PROC_NET_DEV);
+    return -1;
+  }
+
+  struct mqtteer_parser parser;
+  mqtteer_parser_init(&parser, mqtteer_net_dev_buf, (size_t)count);
+  for (; !mqtteer_parser_eof(&parser); mqtteer_parse_next_line(&parser))
+    mqtteer_net_dev_line(reports, &parser, elapsed);
+
+  return 0;
+}
+
+void mqtteer_net_reports(mqtteer_reports *reports) {
+  struct timespec now;
+
+  if (mqtteer_net_fd < 0 && mqtteer_net_dev_buf == NULL)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed =
+      (double)(now.tv_sec - mqtteer_net_sampled_at.tv_sec) +
+      (double)(now.tv_nsec - mqtteer_net_sampled_at.tv_nsec) / 1e9;
+  mqtteer_net_sampled_at = now;
+
+  for (unsigned i = 0; i < mqtteer_net_nifaces; i++)
+    mqtteer_net_ifaces[i].seen = false;
+
+  int ret = mqtteer_net_fd >= 0 ? mqtteer_net_dump(reports, elapsed)
+                                 : mqtteer_net_read_proc(reports, elapsed);
+  if (ret < 0) {
+    // rates start over from the next successful dump
+    for (unsigned i = 0; i < mqtteer_net_nifaces; i++) {
+      mqtteer_net_ifaces[i].sampled = false;
+      for (unsigned j = 0; j < NNET_COUNTERS; j++)
+        mqtteer_report_unset(reports, mqtteer_net_ifaces[i].slots[j]);
+    }
+    return;
+  }
+
+  // removing an interface moves the last one in its place
+  for (unsigned i = mqtteer_net_nifaces; i > 0; i--) {
+    if (!mqtteer_net_ifaces[i - 1].seen)
+      mqtteer_net_iface_remove(reports, i - 1);
+  }
+}
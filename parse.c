@@ -0,0 +1,247 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtteer.h"
+
+// Parsing of /proc and sysfs files, in place on the buffer they were read in.
+// Nothing is read past the end of the buffer, which does not need to be NUL
+// terminated, and numbers are parsed without going through the locale.
+// Functions returning an int return -1 when the input does not match, the
+// cursor is then left where it was.
+
+static inline bool mqtteer_is_blank(char c) { return c == ' ' || c == '\t'; }
+
+static inline bool mqtteer_is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static const char *mqtteer_skip_blanks(const struct mqtteer_parser *parser) {
+  const char *pos = parser->pos;
+
+  while (pos < parser->end && mqtteer_is_blank(*pos))
+    pos++;
+  return pos;
+}
+
+void mqtteer_parse_skip_blanks(struct mqtteer_parser *parser) {
+  parser->pos = mqtteer_skip_blanks(parser);
+}
+
+// move to the start of the next line, or to the end
+void mqtteer_parse_next_line(struct mqtteer_parser *parser) {
+  const char *eol =
+      memchr(parser->pos, '\n', (size_t)(parser->end - parser->pos));
+
+  parser->pos = eol == NULL ? parser->end : eol + 1;
+}
+
+int mqtteer_parse_char(struct mqtteer_parser *parser, char c) {
+  if (parser->pos == parser->end || *parser->pos != c)
+    return -1;
+
+  parser->pos++;
+  return 0;
+}
+
+// match a literal after optional blanks
+int mqtteer_parse_literal(struct mqtteer_parser *parser, const char *literal) {
+  const char *pos = mqtteer_skip_blanks(parser);
+  size_t len = strlen(literal);
+
+  if ((size_t)(parser->end - pos) < len || memcmp(pos, literal, len) != 0)
+    return -1;
+
+  parser->pos = pos + len;
+  return 0;
+}
+
+// A word after optional blanks, it ends at a blank, a newline, '=' or ':'.
+// It points in the buffer and is not NUL terminated.
+int mqtteer_parse_word(struct mqtteer_parser *parser, const char **word,
+                       size_t *len) {
+  const char *start = mqtteer_skip_blanks(parser);
+  const char *pos = start;
+
+  while (pos < parser->end && !mqtteer_is_blank(*pos) && *pos != '\n' &&
+         *pos != '=' && *pos != ':')
+    pos++;
+  if (pos == start)
+    return -1;
+
+  *word = start;
+  *len = (size_t)(pos - start);
+  parser->pos = pos;
+  return 0;
+}
+
+int mqtteer_parse_ull(struct mqtteer_parser *parser,
+                      unsigned long long *value) {
+  const char *pos = mqtteer_skip_blanks(parser);
+  unsigned long long parsed = 0;
+
+  if (pos == parser->end || !mqtteer_is_digit(*pos))
+    return -1;
+
+  for (; pos < parser->end && mqtteer_is_digit(*pos); pos++) {
+    unsigned digit = (unsigned)(*pos - '0');
+    if (parsed > (ULLONG_MAX - digit) / 10)
+      return -1;
+    parsed = parsed * 10 + digit;
+  }
+
+  *value = parsed;
+  parser->pos = pos;
+  return 0;
+}
+
+int mqtteer_parse_ll(struct mqtteer_parser *parser, long long *value) {
+  struct mqtteer_parser saved = *parser;
+  unsigned long long magnitude;
+  bool negative = false;
+
+  parser->pos = mqtteer_skip_blanks(parser);
+  if (mqtteer_parse_char(parser, '-') == 0)
+    negative = true;
+  // no blanks between the sign and the digits
+  if (parser->pos == parser->end || !mqtteer_is_digit(*parser->pos) ||
+      mqtteer_parse_ull(parser, &magnitude) < 0 ||
+      magnitude > (unsigned long long)LLONG_MAX + negative) {
+    *parser = saved;
+    return -1;
+  }
+
+  *value = negative ? (long long)(0 - magnitude) : (long long)magnitude;
+  return 0;
+}
+
+// exact powers of ten as doubles
+static const double POW10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+#define NPOW10 (sizeof(POW10) / sizeof(POW10[0]))
+
+// [-]digits[.digits][e[-]digits], enough for every value the kernel prints.
+// Digits past what fits the mantissa are dropped, the result is within an
+// ulp or two of strtod's.
+int mqtteer_parse_dbl(struct mqtteer_parser *parser, double *value) {
+  const char *pos = mqtteer_skip_blanks(parser);
+  unsigned long long mantissa = 0;
+  bool negative = false, digits = false;
+  long exponent = 0;
+
+  if (pos < parser->end && (*pos == '-' || *pos == '+'))
+    negative = *pos++ == '-';
+
+  for (; pos < parser->end && mqtteer_is_digit(*pos); pos++) {
+    digits = true;
+    if (mantissa <= (ULLONG_MAX - 9) / 10)
+      mantissa = mantissa * 10 + (unsigned)(*pos - '0');
+    else
+      exponent++;
+  }
+  if (pos < parser->end && *pos == '.') {
+    for (pos++; pos < parser->end && mqtteer_is_digit(*pos); pos++) {
+      digits = true;
+      if (mantissa <= (ULLONG_MAX - 9) / 10) {
+        mantissa = mantissa * 10 + (unsigned)(*pos - '0');
+        exponent--;
+      }
+    }
+  }
+  if (!digits)
+    return -1;
+
+  if (pos < parser->end && (*pos == 'e' || *pos == 'E')) {
+    struct mqtteer_parser exp_parser = {pos + 1, parser->end};
+    long long exp_value;
+    // a lone 'e' is not part of the number
+    if (exp_parser.pos < parser->end && !mqtteer_is_blank(*exp_parser.pos) &&
+        mqtteer_parse_ll(&exp_parser, &exp_value) == 0) {
+      if (exp_value > 400)
+        exp_value = 400;
+      if (exp_value < -400)
+        exp_value = -400;
+      exponent += (long)exp_value;
+      pos = exp_parser.pos;
+    }
+  }
+
+  double result = (double)mantissa;
+  while (exponent != 0 && result != 0) {
+    long step = labs(exponent);
+    if (step >= (long)NPOW10)
+      step = NPOW10 - 1;
+    if (exponent > 0)
+      result *= POW10[step];
+    else
+      result /= POW10[step];
+    exponent += exponent > 0 ? -step : step;
+  }
+
+  *value = negative ? -result : result;
+  parser->pos = pos;
+  return 0;
+}
+
+// Value of a key of a flat keyed file: "<key> <value>" lines as in cgroup
+// cpu.stat and memory.stat, or "<key>: <value> kB" as in /proc/meminfo.
+int mqtteer_parse_keyed_ull(const char *buf, size_t len, const char *key,
+                            unsigned long long *value) {
+  struct mqtteer_parser parser;
+  size_t key_len = strlen(key);
+  const char *word;
+  size_t word_len;
+
+  mqtteer_parser_init(&parser, buf, len);
+  for (; !mqtteer_parser_eof(&parser); mqtteer_parse_next_line(&parser)) {
+    if (mqtteer_parse_word(&parser, &word, &word_len) < 0 ||
+        word_len != key_len || memcmp(word, key, key_len) != 0)
+      continue;
+
+    mqtteer_parse_char(&parser, ':');
+    return mqtteer_parse_ull(&parser, value);
+  }
+
+  return -1;
+}
+
+// "avg10=<pct> avg60=<pct> avg300=<pct> total=<us>" after the line kind
+static int mqtteer_psi_parse_line(struct mqtteer_parser *parser,
+                                  struct mqtteer_psi_metrics *metrics) {
+  long long total;
+
+  if (mqtteer_parse_literal(parser, "avg10=") < 0 ||
+      mqtteer_parse_dbl(parser, &metrics->avg10) < 0 ||
+      mqtteer_parse_literal(parser, "avg60=") < 0 ||
+      mqtteer_parse_dbl(parser, &metrics->avg60) < 0 ||
+      mqtteer_parse_literal(parser, "avg300=") < 0 ||
+      mqtteer_parse_dbl(parser, &metrics->avg300) < 0 ||
+      mqtteer_parse_literal(parser, "total=") < 0 ||
+      mqtteer_parse_ll(parser, &total) < 0)
+    return -1;
+
+  metrics->total = (long)total;
+  return 0;
+}
+
+// content of a pressure file, /proc/pressure/* and cgroup ones
+int mqtteer_psi_parse(const char *buf, size_t len, struct mqtteer_psi *psi) {
+  struct mqtteer_parser parser;
+
+  mqtteer_parser_init(&parser, buf, len);
+  for (; !mqtteer_parser_eof(&parser); mqtteer_parse_next_line(&parser)) {
+    struct mqtteer_psi_metrics *metrics;
+
+    if (mqtteer_parse_literal(&parser, "some") == 0)
+      metrics = &psi->some;
+    else if (mqtteer_parse_literal(&parser, "full") == 0)
+      metrics = &psi->full;
+    else
+      return -1;
+
+    if (mqtteer_psi_parse_line(&parser, metrics) < 0)
+      return -1;
+  }
+
+  return 0;
+}
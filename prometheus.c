@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+
+#include "mqtteer.h"
+
+// Prometheus sink. Every value is written in the text exposition format to
+// the file given by MQTTEER_PROMETHEUS, for the textfile collector of
+// node_exporter. The file is written next to its final path and renamed over
+// it so that it is never read half written.
+
+#define PROMETHEUS_PREFIX "mqtteer_"
+
+static char *mqtteer_prometheus_path;
+static char *mqtteer_prometheus_tmp_path;
+static struct mqtteer_buf mqtteer_prometheus_buf;
+
+bool mqtteer_prometheus_init(void) {
+  char *path = getenv("MQTTEER_PROMETHEUS");
+
+  if (path == NULL)
+    return false;
+
+  // node_exporter only reads *.prom files
+  size_t len = strlen(path) + strlen(".tmp") + 1;
+  mqtteer_prometheus_path = path;
+  mqtteer_prometheus_tmp_path = mmalloc(len);
+  snprintf(mqtteer_prometheus_tmp_path, len, "%s.tmp", path);
+  return true;
+}
+
+// metric names only allow [a-zA-Z0-9_:]
+static void mqtteer_prometheus_append_name(struct mqtteer_buf *buf,
+                                           const char *name) {
+  mqtteer_buf_append_lit(buf, PROMETHEUS_PREFIX);
+  for (; *name != '\0'; name++) {
+    char c = *name;
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '_' || c == ':'))
+      c = '_';
+    mqtteer_buf_append(buf, &c, 1);
+  }
+}
+
+static void mqtteer_prometheus_append_label(struct mqtteer_buf *buf,
+                                            const char *value) {
+  const char *start = value;
+
+  mqtteer_buf_append_lit(buf, "{device=\"");
+  for (; *value != '\0'; value++) {
+    if (*value != '\\' && *value != '"' && *value != '\n')
+      continue;
+
+    mqtteer_buf_append(buf, start, (size_t)(value - start));
+    start = value + 1;
+    if (*value == '\n')
+      mqtteer_buf_append_lit(buf, "\\n");
+    else if (*value == '\\')
+      mqtteer_buf_append_lit(buf, "\\\\");
+    else
+      mqtteer_buf_append_lit(buf, "\\\"");
+  }
+  mqtteer_buf_append(buf, start, (size_t)(value - start));
+  mqtteer_buf_append_lit(buf, "\"}");
+}
+
+static void mqtteer_prometheus_append_report(struct mqtteer_buf *buf,
+                                             const mqtteer_report *report) {
+  mqtteer_prometheus_append_name(buf, report->name);
+  if (report->device != NULL)
+    mqtteer_prometheus_append_label(buf, report->device);
+  mqtteer_buf_append_lit(buf, " ");
+
+  if (report->value_type != MQTTEER_TYPE_DOUBLE ||
+      isfinite(report->value.dblval))
+    mqtteer_buf_append_value(buf, report->value_type, &report->value);
+  else if (isnan(report->value.dblval))
+    mqtteer_buf_append_lit(buf, "NaN");
+  else if (report->value.dblval > 0)
+    mqtteer_buf_append_lit(buf, "+Inf");
+  else
+    mqtteer_buf_append_lit(buf, "-Inf");
+  mqtteer_buf_append_lit(buf, "\n");
+}
+
+static int mqtteer_prometheus_write_file(const struct mqtteer_buf *buf) {
+  int fd = open(mqtteer_prometheus_tmp_path,
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  for (size_t written = 0; written < buf->len;) {
+    ssize_t count = write(fd, buf->data + written, buf->len - written);
+    if (count < 0) {
+      int saved_errno = errno;
+      cclose(fd);
+      errno = saved_errno;
+      return -1;
+    }
+    written += (size_t)count;
+  }
+
+  cclose(fd);
+  return rename(mqtteer_prometheus_tmp_path, mqtteer_prometheus_path);
+}
+
+// the whole file is written again with the current values of every slot,
+// strings have no place in it
+void mqtteer_prometheus_write(mqtteer_reports *reports, unsigned collector) {
+  struct mqtteer_buf *buf = &mqtteer_prometheus_buf;
+  (void)collector;
+
+  buf->len = 0;
+  for (unsigned i = 0; i < reports->nb; i++) {
+    const mqtteer_report *report = &reports->reports[i];
+    if (report->active && !report->excluded && report->has_value &&
+        report->value_type != MQTTEER_TYPE_STR)
+      mqtteer_prometheus_append_report(buf, report);
+  }
+
+  if (mqtteer_prometheus_write_file(buf) < 0)
+    fprintf(stderr, "failed to write %s: %s\n", mqtteer_prometheus_path,
+            strerror(errno));
+}
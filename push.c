@@ -0,0 +1,281 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mqtteer.h"
+#include "mqtteer_push.h"
+
+// Metrics pushed by local processes, reported as push_<name> with the other
+// metrics of this host. They come from the Unix datagram socket given by
+// MQTTEER_PUSH, one "<name> <value> [<unit>]" line per metric and as many
+// lines as fit in a datagram, or from the shared memory rings given by
+// MQTTEER_PUSH_RING, see mqtteer_push.h. Both only update the latest value of
+// every name, which is reported at the push collection interval.
+
+#define PUSH_MAX_METRICS 256
+#define PUSH_MAX_RINGS 16
+#define PUSH_RING_RECORDS 4096
+#define PUSH_DATAGRAM_SIZE 4096
+#define PUSH_UNIT_SIZE 16
+
+struct mqtteer_push_metric {
+  char name[MQTTEER_PUSH_NAME_SIZE];
+  char unit[PUSH_UNIT_SIZE];
+  double value;
+  unsigned slot;
+  bool registered;
+};
+
+struct mqtteer_push_map {
+  struct mqtteer_push_ring *ring;
+  // the producer's count as of the last drain
+  uint64_t dropped;
+};
+
+static bool mqtteer_push_enabled;
+static int mqtteer_push_sock = -1;
+static struct mqtteer_push_map mqtteer_push_rings[PUSH_MAX_RINGS];
+static unsigned mqtteer_push_nrings;
+static struct mqtteer_push_metric mqtteer_push_metrics[PUSH_MAX_METRICS];
+static unsigned mqtteer_push_nmetrics;
+// malformed lines and records, new names past the limit and records the
+// producers could not write to their ring
+static unsigned long mqtteer_push_dropped;
+static unsigned mqtteer_push_dropped_slot;
+
+static void mqtteer_push_listen(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct stat st;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "MQTTEER_PUSH is too long: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path);
+
+  // left behind by a previous run
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  mqtteer_push_sock =
+      socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (mqtteer_push_sock < 0 ||
+      bind(mqtteer_push_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "failed to bind %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+// A ring left by a previous run is kept along with the records its producer
+// wrote in the meantime, anything else is made a new empty ring.
+static void mqtteer_push_ring_open(const char *path) {
+  size_t len = sizeof(struct mqtteer_push_ring) +
+               PUSH_RING_RECORDS * sizeof(struct mqtteer_push_record);
+  struct stat st;
+
+  if (mqtteer_push_nrings == PUSH_MAX_RINGS) {
+    fprintf(stderr, "too many push rings, %s is ignored\n", path);
+    return;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  bool reuse = (size_t)st.st_size == len;
+  if (!reuse && ftruncate(fd, (off_t)len) < 0) {
+    fprintf(stderr, "failed to resize %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  struct mqtteer_push_ring *ring =
+      mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "failed to map %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  cclose(fd);
+
+  if (!reuse ||
+      atomic_load_explicit(&ring->magic, memory_order_acquire) !=
+          MQTTEER_PUSH_RING_MAGIC ||
+      ring->size != PUSH_RING_RECORDS) {
+    atomic_store_explicit(&ring->magic, 0, memory_order_relaxed);
+    ring->size = PUSH_RING_RECORDS;
+    atomic_store_explicit(&ring->dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+    // producers wait for it before writing
+    atomic_store_explicit(&ring->magic, MQTTEER_PUSH_RING_MAGIC,
+                          memory_order_release);
+  }
+
+  mqtteer_push_rings[mqtteer_push_nrings++] = (struct mqtteer_push_map){
+      ring, atomic_load_explicit(&ring->dropped, memory_order_relaxed)};
+}
+
+void mqtteer_push_init(mqtteer_reports *reports) {
+  char *path = getenv("MQTTEER_PUSH");
+  char *rings_var = getenv("MQTTEER_PUSH_RING");
+  char *saveptr;
+
+  if (path == NULL && rings_var == NULL)
+    return;
+
+  if (path != NULL)
+    mqtteer_push_listen(path);
+
+  if (rings_var != NULL) {
+    char rings[strlen(rings_var) + 1];
+    strcpy(rings, rings_var);
+    for (char *ring = strtok_r(rings, ",", &saveptr); ring != NULL;
+         ring = strtok_r(NULL, ",", &saveptr))
+      mqtteer_push_ring_open(ring);
+  }
+
+  mqtteer_push_enabled = true;
+  mqtteer_push_dropped_slot = mqtteer_report_add(
+      reports, "push_dropped", MQTTEER_TYPE_UNSIGNED_LONG, NULL, NULL);
+}
+
+int mqtteer_push_fd(void) { return mqtteer_push_sock; }
+
+// the value of a name, only what fits the reports table is kept
+static void mqtteer_push_set(const char *name, size_t name_len, double value,
+                             const char *unit, size_t unit_len) {
+  struct mqtteer_push_metric *metric = NULL;
+  char sanitized[MQTTEER_PUSH_NAME_SIZE];
+
+  if (name_len == 0 || name_len >= MQTTEER_PUSH_NAME_SIZE || !isfinite(value)) {
+    mqtteer_push_dropped++;
+    return;
+  }
+  memcpy(sanitized, name, name_len);
+  sanitized[name_len] = '\0';
+  mqtteer_sanitize_name(sanitized);
+
+  for (unsigned i = 0; i < mqtteer_push_nmetrics && metric == NULL; i++) {
+    if (strcmp(mqtteer_push_metrics[i].name, sanitized) == 0)
+      metric = &mqtteer_push_metrics[i];
+  }
+
+  if (metric == NULL) {
+    if (mqtteer_push_nmetrics == PUSH_MAX_METRICS) {
+      mqtteer_push_dropped++;
+      return;
+    }
+    metric = &mqtteer_push_metrics[mqtteer_push_nmetrics++];
+    strcpy(metric->name, sanitized);
+    // the unit given with the first value holds
+    if (unit_len >= PUSH_UNIT_SIZE)
+      unit_len = PUSH_UNIT_SIZE - 1;
+    memcpy(metric->unit, unit, unit_len);
+    metric->unit[unit_len] = '\0';
+    metric->registered = false;
+  }
+
+  metric->value = value;
+}
+
+static void mqtteer_push_parse(const char *buf, size_t len) {
+  struct mqtteer_parser parser;
+  const char *name, *unit;
+  size_t name_len, unit_len;
+  double value;
+
+  mqtteer_parser_init(&parser, buf, len);
+  for (; !mqtteer_parser_eof(&parser); mqtteer_parse_next_line(&parser)) {
+    mqtteer_parse_skip_blanks(&parser);
+    // blank lines
+    if (mqtteer_parser_eof(&parser) || *parser.pos == '\n')
+      continue;
+
+    if (mqtteer_parse_word(&parser, &name, &name_len) < 0 ||
+        mqtteer_parse_dbl(&parser, &value) < 0) {
+      mqtteer_push_dropped++;
+      continue;
+    }
+    if (mqtteer_parse_word(&parser, &unit, &unit_len) < 0)
+      unit_len = 0;
+    mqtteer_push_set(name, name_len, value, unit, unit_len);
+  }
+}
+
+void mqtteer_push_receive(void) {
+  char buf[PUSH_DATAGRAM_SIZE];
+  ssize_t len;
+
+  while ((len = recv(mqtteer_push_sock, buf, sizeof(buf), MSG_TRUNC)) >= 0) {
+    // a longer one is cut at the last full line
+    if ((size_t)len > sizeof(buf)) {
+      mqtteer_push_dropped++;
+      len = (ssize_t)sizeof(buf);
+      while (len > 0 && buf[len - 1] != '\n')
+        len--;
+    }
+    mqtteer_push_parse(buf, (size_t)len);
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    perror("recv failed");
+}
+
+// Called on every turn of the main loop, which is at least every second.
+void mqtteer_push_drain(void) {
+  for (unsigned i = 0; i < mqtteer_push_nrings; i++) {
+    struct mqtteer_push_map *map = &mqtteer_push_rings[i];
+    struct mqtteer_push_ring *ring = map->ring;
+
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    // a producer that went wrong, start over from what it wrote last
+    if (head - tail > PUSH_RING_RECORDS) {
+      mqtteer_push_dropped += head - tail - PUSH_RING_RECORDS;
+      tail = head - PUSH_RING_RECORDS;
+    }
+
+    // the producer may write the header, only the size we mapped is trusted
+    for (; tail != head; tail++) {
+      const struct mqtteer_push_record *record =
+          &ring->records[tail & (PUSH_RING_RECORDS - 1)];
+      mqtteer_push_set(record->name,
+                       strnlen(record->name, MQTTEER_PUSH_NAME_SIZE),
+                       record->value, "", 0);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    uint64_t dropped = atomic_load_explicit(&ring->dropped,
+                                            memory_order_relaxed);
+    mqtteer_push_dropped += dropped - map->dropped;
+    map->dropped = dropped;
+  }
+}
+
+void mqtteer_push_reports(mqtteer_reports *reports) {
+  char name[MQTTEER_PUSH_NAME_SIZE + 8];
+
+  if (!mqtteer_push_enabled)
+    return;
+
+  mqtteer_push_drain();
+  for (unsigned i = 0; i < mqtteer_push_nmetrics; i++) {
+    struct mqtteer_push_metric *metric = &mqtteer_push_metrics[i];
+    if (!metric->registered) {
+      snprintf(name, sizeof(name), "push_%s", metric->name);
+      metric->slot =
+          mqtteer_report_add(reports, name, MQTTEER_TYPE_DOUBLE, NULL,
+                             metric->unit[0] != '\0' ? metric->unit : NULL);
+      metric->registered = true;
+    }
+    mqtteer_report_set_dbl(reports, metric->slot, metric->value);
+  }
+
+  mqtteer_report_set_ulong(reports, mqtteer_push_dropped_slot,
+                           mqtteer_push_dropped);
+}
@@ -0,0 +1,194 @@
+#include <math.h>
+#include <string.h>
+
+#include "mqtteer.h"
+
+// Windowed aggregates. Metrics selected with MQTTEER_SAMPLE, a comma separated
+// list of globs, are sampled more often than they are published and the
+// minimum, maximum, mean and 95th percentile of the samples taken since the
+// last publication are reported next to them as <name>_min, <name>_max,
+// <name>_mean and <name>_p95.
+
+#define SAMPLE_QUANTILE 0.95
+
+static const char *WINDOW_SUFFIXES[NWINDOW_AGGREGATES] = {
+    "_min", "_max", "_mean", "_p95"};
+
+static char *mqtteer_sample_globs;
+// aggregates are registered as slots themselves, they are not sampled
+static bool mqtteer_window_attaching;
+
+void mqtteer_sample_init(void) {
+  mqtteer_sample_globs = getenv("MQTTEER_SAMPLE");
+}
+
+bool mqtteer_sample_selected(const char *name) {
+  return mqtteer_sample_globs != NULL && !mqtteer_window_attaching &&
+         mqtteer_glob_list_match(mqtteer_sample_globs, name);
+}
+
+// The quantile of windows larger than WINDOW_EXACT_SAMPLES is estimated with
+// the P² algorithm (Jain and Chlamtac, 1985): five markers whose heights are
+// adjusted with a piecewise parabolic interpolation as samples come, so memory
+// does not grow with the window.
+static void mqtteer_p2_reset(struct mqtteer_p2 *p2, double p) {
+  p2->count = 0;
+  for (unsigned i = 0; i < 5; i++)
+    p2->n[i] = i;
+  p2->np[0] = 0;
+  p2->np[1] = 2 * p;
+  p2->np[2] = 4 * p;
+  p2->np[3] = 2 + 2 * p;
+  p2->np[4] = 4;
+  p2->dn[0] = 0;
+  p2->dn[1] = p / 2;
+  p2->dn[2] = p;
+  p2->dn[3] = (1 + p) / 2;
+  p2->dn[4] = 1;
+}
+
+static int mqtteer_dbl_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double mqtteer_p2_parabolic(const struct mqtteer_p2 *p2, unsigned i,
+                                   double d) {
+  const double *q = p2->q, *n = p2->n;
+
+  return q[i] + d / (n[i + 1] - n[i - 1]) *
+                    ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) /
+                         (n[i + 1] - n[i]) +
+                     (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) /
+                         (n[i] - n[i - 1]));
+}
+
+static void mqtteer_p2_add(struct mqtteer_p2 *p2, double x) {
+  double *q = p2->q, *n = p2->n;
+  unsigned k;
+
+  // the first samples are the initial marker heights
+  if (p2->count < 5) {
+    q[p2->count++] = x;
+    if (p2->count == 5)
+      qsort(q, 5, sizeof(double), mqtteer_dbl_cmp);
+    return;
+  }
+  p2->count++;
+
+  if (x < q[0]) {
+    q[0] = x;
+    k = 0;
+  } else if (x >= q[4]) {
+    q[4] = x;
+    k = 3;
+  } else {
+    for (k = 0; k < 3 && x >= q[k + 1]; k++)
+      ;
+  }
+
+  for (unsigned i = k + 1; i < 5; i++)
+    n[i]++;
+  for (unsigned i = 0; i < 5; i++)
+    p2->np[i] += p2->dn[i];
+
+  for (unsigned i = 1; i < 4; i++) {
+    double d = p2->np[i] - n[i];
+    if ((d < 1 || n[i + 1] - n[i] <= 1) && (d > -1 || n[i - 1] - n[i] >= -1))
+      continue;
+
+    d = d > 0 ? 1 : -1;
+    double height = mqtteer_p2_parabolic(p2, i, d);
+    if (q[i - 1] < height && height < q[i + 1]) {
+      q[i] = height;
+    } else {
+      unsigned j = d > 0 ? i + 1 : i - 1;
+      q[i] += d * (q[j] - q[i]) / (n[j] - n[i]);
+    }
+    n[i] += d;
+  }
+}
+
+// nearest rank quantile, samples are sorted in place
+static double mqtteer_quantile_exact(double *samples, unsigned count,
+                                     double p) {
+  qsort(samples, count, sizeof(double), mqtteer_dbl_cmp);
+  unsigned rank = (unsigned)ceil(p * count);
+  return samples[rank > 0 ? rank - 1 : 0];
+}
+
+static void mqtteer_window_reset(struct mqtteer_window *window) {
+  window->count = 0;
+  window->min = INFINITY;
+  window->max = -INFINITY;
+  window->sum = 0;
+  mqtteer_p2_reset(&window->quantile, SAMPLE_QUANTILE);
+}
+
+// register the aggregate slots of a sampled slot, in the current group
+void mqtteer_window_attach(mqtteer_reports *reports, unsigned slot) {
+  struct mqtteer_window *window = mmalloc(sizeof(struct mqtteer_window));
+  const mqtteer_report *report = &reports->reports[slot];
+  char name[strlen(report->name) + strlen("_mean") + 1];
+  const char *device_class = report->device_class;
+  const char *unit = report->unit_of_measurement;
+
+  mqtteer_window_attaching = true;
+  for (unsigned i = 0; i < NWINDOW_AGGREGATES; i++) {
+    sprintf(name, "%s%s", reports->reports[slot].name, WINDOW_SUFFIXES[i]);
+    window->slots[i] = mqtteer_report_add(reports, name, MQTTEER_TYPE_DOUBLE,
+                                          device_class, unit);
+  }
+  mqtteer_window_attaching = false;
+
+  mqtteer_window_reset(window);
+  reports->reports[slot].window = window;
+}
+
+void mqtteer_window_detach(mqtteer_reports *reports, unsigned slot) {
+  struct mqtteer_window *window = reports->reports[slot].window;
+
+  reports->reports[slot].window = NULL;
+  for (unsigned i = 0; i < NWINDOW_AGGREGATES; i++)
+    mqtteer_report_remove(reports, window->slots[i]);
+  free(window);
+}
+
+void mqtteer_window_add(struct mqtteer_window *window, double value) {
+  if (!isfinite(value))
+    return;
+
+  window->count++;
+  window->sum += value;
+  if (value < window->min)
+    window->min = value;
+  if (value > window->max)
+    window->max = value;
+  if (window->count <= WINDOW_EXACT_SAMPLES)
+    window->samples[window->count - 1] = value;
+  mqtteer_p2_add(&window->quantile, value);
+}
+
+// set the aggregates from the samples of the window and start a new one
+void mqtteer_window_close(mqtteer_reports *reports,
+                          struct mqtteer_window *window) {
+  const unsigned *slots = window->slots;
+
+  if (window->count == 0) {
+    for (unsigned i = 0; i < NWINDOW_AGGREGATES; i++)
+      mqtteer_report_unset(reports, slots[i]);
+    return;
+  }
+
+  mqtteer_report_set_dbl(reports, slots[WINDOW_MIN], window->min);
+  mqtteer_report_set_dbl(reports, slots[WINDOW_MAX], window->max);
+  mqtteer_report_set_dbl(reports, slots[WINDOW_MEAN],
+                         window->sum / window->count);
+  mqtteer_report_set_dbl(
+      reports, slots[WINDOW_P95],
+      window->count <= WINDOW_EXACT_SAMPLES
+          ? mqtteer_quantile_exact(window->samples, window->count,
+                                   SAMPLE_QUANTILE)
+          : window->quantile.q[2]);
+  mqtteer_window_reset(window);
+}
@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mqtteer.h"
+
+// Offline spool. State messages that could not be published because the
+// broker was unreachable are kept in a ring buffer mapped from a file, so that
+// they survive a restart of mqtteer, and replayed once connected again. When
+// the ring is full the oldest messages are overwritten.
+
+#define SPOOL_MAGIC 0x6c6f6f7073747471ULL // "qttspool"
+#define SPOOL_VERSION 1
+#define SPOOL_DEFAULT_SIZE (1024 * 1024)
+#define SPOOL_ALIGN 8
+
+struct mqtteer_spool_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t size;
+  // offset of the oldest record and of the next one in the data area
+  uint32_t head;
+  uint32_t tail;
+  uint32_t count;
+  uint32_t padding;
+};
+
+// Records never wrap, a record of length 0 (or the end of the data area when
+// there is no room for one) sends the reader back to the start.
+struct mqtteer_spool_record {
+  uint32_t len;
+  uint32_t topic_len;
+  uint32_t payload_len;
+  uint32_t padding;
+  int64_t timestamp;
+  // topic then payload, neither of them is NUL terminated
+  char data[];
+};
+
+static struct mqtteer_spool_header *mqtteer_spool;
+static char *mqtteer_spool_data;
+
+static inline uint32_t mqtteer_spool_align(size_t len) {
+  return (uint32_t)((len + SPOOL_ALIGN - 1) & ~(size_t)(SPOOL_ALIGN - 1));
+}
+
+static void mqtteer_spool_reset(uint32_t size) {
+  mqtteer_spool->magic = SPOOL_MAGIC;
+  mqtteer_spool->version = SPOOL_VERSION;
+  mqtteer_spool->size = size;
+  mqtteer_spool->head = 0;
+  mqtteer_spool->tail = 0;
+  mqtteer_spool->count = 0;
+}
+
+static struct mqtteer_spool_record *mqtteer_spool_at(uint32_t offset) {
+  return (struct mqtteer_spool_record *)(mqtteer_spool_data + offset);
+}
+
+// The file outlives us and a write may have been torn: a record is only
+// trusted once it fits in the data area along with its topic and payload,
+// which is at least "{}". The caller made sure its header does.
+static bool mqtteer_spool_valid(uint32_t offset) {
+  struct mqtteer_spool_record *record = mqtteer_spool_at(offset);
+
+  return offset % SPOOL_ALIGN == 0 &&
+         record->len >= sizeof(struct mqtteer_spool_record) &&
+         record->len % SPOOL_ALIGN == 0 &&
+         record->len <= mqtteer_spool->size - offset &&
+         record->payload_len >= 2 &&
+         (uint64_t)record->topic_len + record->payload_len <=
+             record->len - sizeof(struct mqtteer_spool_record);
+}
+
+// whether the records from head add up to count and end at tail
+static bool mqtteer_spool_check(void) {
+  uint32_t offset = mqtteer_spool->head;
+
+  if (mqtteer_spool->count >
+      mqtteer_spool->size / sizeof(struct mqtteer_spool_record))
+    return false;
+
+  for (uint32_t i = 0; i < mqtteer_spool->count; i++) {
+    if (mqtteer_spool->size - offset < sizeof(struct mqtteer_spool_record) ||
+        mqtteer_spool_at(offset)->len == 0)
+      offset = 0;
+    if (!mqtteer_spool_valid(offset))
+      return false;
+    offset += mqtteer_spool_at(offset)->len;
+  }
+
+  return offset == mqtteer_spool->tail;
+}
+
+// The spool is enabled by setting MQTTEER_SPOOL to the path of its file,
+// MQTTEER_SPOOL_SIZE sets its size in bytes.
+void mqtteer_spool_init(void) {
+  char *path = getenv("MQTTEER_SPOOL");
+  char *size_str = getenv("MQTTEER_SPOOL_SIZE");
+  unsigned long long size = SPOOL_DEFAULT_SIZE;
+
+  if (path == NULL)
+    return;
+
+  if (size_str != NULL) {
+    char *endptr;
+    size = strtoull(size_str, &endptr, 10);
+    if (endptr == size_str || *endptr != '\0' || size < 4096 ||
+        size > UINT32_MAX) {
+      fprintf(stderr, "MQTTEER_SPOOL_SIZE is invalid: %s\n", size_str);
+      exit(EXIT_FAILURE);
+    }
+  }
+  size = size & ~(unsigned long long)(SPOOL_ALIGN - 1);
+  size_t file_size = sizeof(struct mqtteer_spool_header) + size;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "failed to open spool %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (ftruncate(fd, (off_t)file_size) < 0) {
+    fprintf(stderr, "failed to resize spool %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  mqtteer_spool =
+      mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mqtteer_spool == MAP_FAILED) {
+    perror("failed to map spool");
+    exit(EXIT_FAILURE);
+  }
+  cclose(fd);
+  mqtteer_spool_data = (char *)(mqtteer_spool + 1);
+
+  // start over with a new or resized spool, or one we do not understand
+  if (mqtteer_spool->magic != SPOOL_MAGIC ||
+      mqtteer_spool->version != SPOOL_VERSION ||
+      mqtteer_spool->size != size) {
+    mqtteer_spool_reset((uint32_t)size);
+  } else if (mqtteer_spool->head >= size || mqtteer_spool->tail > size ||
+             !mqtteer_spool_check()) {
+    fprintf(stderr, "spool %s is corrupted, starting over\n", path);
+    mqtteer_spool_reset((uint32_t)size);
+  } else if (mqtteer_debug) {
+    printf("%u messages in the spool\n", mqtteer_spool->count);
+  }
+}
+
+bool mqtteer_spool_enabled(void) { return mqtteer_spool != NULL; }
+
+bool mqtteer_spool_empty(void) {
+  return mqtteer_spool == NULL || mqtteer_spool->count == 0;
+}
+
+// move the head to the start when it is on a wrap marker
+static void mqtteer_spool_skip_wrap(void) {
+  uint32_t head = mqtteer_spool->head;
+
+  if (mqtteer_spool->size - head < sizeof(struct mqtteer_spool_record) ||
+      mqtteer_spool_at(head)->len == 0)
+    mqtteer_spool->head = 0;
+}
+
+static void mqtteer_spool_corrupted(void) {
+  fprintf(stderr, "spool is corrupted, dropping its %u messages\n",
+          mqtteer_spool->count);
+  mqtteer_spool_reset(mqtteer_spool->size);
+}
+
+static void mqtteer_spool_drop_oldest(void) {
+  mqtteer_spool_skip_wrap();
+  if (!mqtteer_spool_valid(mqtteer_spool->head)) {
+    mqtteer_spool_corrupted();
+    return;
+  }
+  mqtteer_spool->head += mqtteer_spool_at(mqtteer_spool->head)->len;
+  mqtteer_spool->count--;
+  if (mqtteer_spool->count == 0)
+    mqtteer_spool->head = mqtteer_spool->tail = 0;
+}
+
+void mqtteer_spool_push(const char *topic, const char *payload,
+                        size_t payload_len) {
+  struct timespec now;
+  size_t topic_len = strlen(topic);
+  uint32_t len = mqtteer_spool_align(sizeof(struct mqtteer_spool_record) +
+                                     topic_len + payload_len);
+
+  if (mqtteer_spool == NULL)
+    return;
+  if (len > mqtteer_spool->size) {
+    fprintf(stderr, "message too large for the spool\n");
+    return;
+  }
+
+  // make room at the tail, dropping the oldest records in the way
+  while (true) {
+    uint32_t head = mqtteer_spool->head, tail = mqtteer_spool->tail;
+
+    if (mqtteer_spool->count == 0 || tail > head) {
+      if (mqtteer_spool->size - tail >= len)
+        break;
+      if (mqtteer_spool->size - tail >= sizeof(struct mqtteer_spool_record))
+        mqtteer_spool_at(tail)->len = 0;
+      mqtteer_spool->tail = 0;
+      if (mqtteer_spool->count == 0)
+        mqtteer_spool->head = 0;
+    } else if (head - tail >= len) {
+      break;
+    } else {
+      mqtteer_spool_drop_oldest();
+    }
+  }
+
+  struct mqtteer_spool_record *record = mqtteer_spool_at(mqtteer_spool->tail);
+  clock_gettime(CLOCK_REALTIME, &now);
+  record->len = len;
+  record->topic_len = (uint32_t)topic_len;
+  record->payload_len = (uint32_t)payload_len;
+  record->timestamp = now.tv_sec;
+  memcpy(record->data, topic, topic_len);
+  memcpy(record->data + topic_len, payload, payload_len);
+
+  // the record is complete before it is made visible
+  mqtteer_spool->tail += len;
+  mqtteer_spool->count++;
+}
+
+// Get the oldest message. The topic is copied in a buffer of topic_size
+// bytes to be NUL terminated, the payload points in the spool and is valid
+// until the next push or pop.
+int mqtteer_spool_peek(char *topic, size_t topic_size, const char **payload,
+                       size_t *payload_len, long long *timestamp) {
+  if (mqtteer_spool_empty())
+    return -1;
+
+  mqtteer_spool_skip_wrap();
+  if (!mqtteer_spool_valid(mqtteer_spool->head)) {
+    mqtteer_spool_corrupted();
+    return -1;
+  }
+  struct mqtteer_spool_record *record = mqtteer_spool_at(mqtteer_spool->head);
+  if (record->topic_len >= topic_size) {
+    fprintf(stderr, "spooled topic too long, dropping it\n");
+    mqtteer_spool_drop_oldest();
+    return -1;
+  }
+
+  memcpy(topic, record->data, record->topic_len);
+  topic[record->topic_len] = '\0';
+  *payload = record->data + record->topic_len;
+  *payload_len = record->payload_len;
+  *timestamp = record->timestamp;
+  return 0;
+}
+
+void mqtteer_spool_pop(void) {
+  if (!mqtteer_spool_empty())
+    mqtteer_spool_drop_oldest();
+}
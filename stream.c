@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mqtteer.h"
+
+// Stream sink. Clients of the Unix socket given by MQTTEER_STREAM get a JSON
+// line per group every time its collector runs:
+// {"group":"load","timestamp":1700000000,"values":{"load1":0.5,...}}
+// Values are the collected ones, deadbands only apply to MQTT. Nothing is
+// buffered for clients that do not keep up, they are disconnected.
+
+#define STREAM_MAX_CLIENTS 16
+
+static int mqtteer_stream_listen_fd = -1;
+static int mqtteer_stream_clients[STREAM_MAX_CLIENTS];
+static unsigned mqtteer_stream_nclients;
+static struct mqtteer_buf mqtteer_stream_buf;
+
+bool mqtteer_stream_init(void) {
+  char *path = getenv("MQTTEER_STREAM");
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct stat st;
+
+  if (path == NULL)
+    return false;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "MQTTEER_STREAM is too long: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path);
+
+  // left behind by a previous run
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  mqtteer_stream_listen_fd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (mqtteer_stream_listen_fd < 0 ||
+      bind(mqtteer_stream_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) <
+          0 ||
+      listen(mqtteer_stream_listen_fd, STREAM_MAX_CLIENTS) < 0) {
+    fprintf(stderr, "failed to listen on %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  return true;
+}
+
+int mqtteer_stream_fd(void) { return mqtteer_stream_listen_fd; }
+
+void mqtteer_stream_accept(void) {
+  int fd;
+
+  while ((fd = accept(mqtteer_stream_listen_fd, NULL, NULL)) >= 0) {
+    if (mqtteer_stream_nclients == STREAM_MAX_CLIENTS ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+      cclose(fd);
+      continue;
+    }
+    mqtteer_stream_clients[mqtteer_stream_nclients++] = fd;
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+    perror("accept failed");
+}
+
+static void mqtteer_stream_append_group(struct mqtteer_buf *buf,
+                                        mqtteer_reports *reports,
+                                        const struct mqtteer_group *g,
+                                        time_t timestamp) {
+  size_t start = buf->len;
+
+  mqtteer_buf_append_lit(buf, "{\"group\":");
+  mqtteer_buf_append_json_str(buf, g->name);
+  mqtteer_buf_append_lit(buf, ",\"timestamp\":");
+  mqtteer_buf_append_long(buf, (long)timestamp);
+  mqtteer_buf_append_lit(buf, ",\"values\":{");
+
+  size_t values = buf->len;
+  for (unsigned i = 0; i < g->nslots; i++) {
+    const mqtteer_report *report = &reports->reports[g->slots[i]];
+    if (!report->has_value)
+      continue;
+
+    // skip the comma in front of the first key
+    if (buf->len == values)
+      mqtteer_buf_append(buf, report->key + 1, report->key_len - 1);
+    else
+      mqtteer_buf_append(buf, report->key, report->key_len);
+    mqtteer_buf_append_value(buf, report->value_type, &report->value);
+  }
+
+  // nothing to report
+  if (buf->len == values) {
+    buf->len = start;
+    return;
+  }
+  mqtteer_buf_append_lit(buf, "}}\n");
+}
+
+void mqtteer_stream_write(mqtteer_reports *reports, unsigned collector) {
+  struct mqtteer_buf *buf = &mqtteer_stream_buf;
+
+  if (mqtteer_stream_nclients == 0)
+    return;
+
+  buf->len = 0;
+  time_t now = time(NULL);
+  for (unsigned i = 0; i < reports->ngroups; i++) {
+    const struct mqtteer_group *g = &reports->groups[i];
+    if (g->active && g->collector == collector)
+      mqtteer_stream_append_group(buf, reports, g, now);
+  }
+  if (buf->len == 0)
+    return;
+
+  // removing a client moves the last one in its place
+  for (unsigned i = mqtteer_stream_nclients; i > 0; i--) {
+    int fd = mqtteer_stream_clients[i - 1];
+    ssize_t count = send(fd, buf->data, buf->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (count == (ssize_t)buf->len)
+      continue;
+
+    if (mqtteer_debug)
+      printf("stream client %d dropped\n", fd);
+    cclose(fd);
+    mqtteer_stream_clients[i - 1] =
+        mqtteer_stream_clients[--mqtteer_stream_nclients];
+  }
+}
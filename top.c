@@ -0,0 +1,257 @@
+#include <libproc2/pids.h>
+#include <string.h>
+
+#include "mqtteer.h"
+
+// Processes using the most CPU and memory, reported by rank when MQTTEER_TOP
+// is set to how many of them to report: top_cpu_<rank> and top_rss_<rank>
+// along with the name and pid of the process holding that rank. The pids
+// context is kept across cycles so that libproc2 computes the CPU ticks
+// since the previous one, and only the items used are read.
+
+#define TOP_NAME_SIZE 40
+
+enum mqtteer_top_item {
+  TOP_ITEM_PID,
+  TOP_ITEM_CMD,
+  TOP_ITEM_TICS,
+  TOP_ITEM_RES,
+  NTOP_ITEMS,
+};
+
+enum mqtteer_top_kind {
+  TOP_CPU,
+  TOP_RSS,
+  NTOP_KINDS,
+};
+
+static const char *TOP_KIND_NAMES[NTOP_KINDS] = {"cpu", "rss"};
+
+struct mqtteer_top_entry {
+  int pid;
+  char cmd[16];
+  double value;
+};
+
+struct mqtteer_top_rank {
+  unsigned slot;
+  unsigned name_slot;
+  // names are published by reference, a new one goes in the buffer that is
+  // not published
+  char names[2][TOP_NAME_SIZE];
+};
+
+static unsigned mqtteer_top_n;
+static struct pids_info *mqtteer_top_info;
+static struct timespec mqtteer_top_reaped_at;
+static long mqtteer_top_hertz;
+// filled by mqtteer_top_read, the first counts entries of every kind
+static struct mqtteer_top_entry *mqtteer_top_entries[NTOP_KINDS];
+static unsigned mqtteer_top_counts[NTOP_KINDS];
+static struct mqtteer_top_rank *mqtteer_top_ranks[NTOP_KINDS];
+// reused between cycles, as large as the most processes seen
+static unsigned *mqtteer_top_order;
+static double *mqtteer_top_keys;
+static unsigned mqtteer_top_cap;
+
+void mqtteer_top_init(mqtteer_reports *reports) {
+  enum pids_item items[NTOP_ITEMS] = {
+      [TOP_ITEM_PID] = PIDS_ID_PID,
+      [TOP_ITEM_CMD] = PIDS_CMD,
+      [TOP_ITEM_TICS] = PIDS_TICS_ALL_DELTA,
+      [TOP_ITEM_RES] = PIDS_MEM_RES,
+  };
+  char *top = getenv("MQTTEER_TOP");
+  char name[64];
+  char *endptr;
+
+  if (top == NULL)
+    return;
+
+  long n = strtol(top, &endptr, 10);
+  if (top == endptr || *endptr != '\0' || n <= 0 || n > 100) {
+    fprintf(stderr, "MQTTEER_TOP is invalid: %s\n", top);
+    exit(EXIT_FAILURE);
+  }
+
+  // libproc2 only reads the live /proc
+  if (mqtteer_root[0] != '\0') {
+    fprintf(stderr, "processes are not reported under MQTTEER_ROOT\n");
+    return;
+  }
+
+  if (procps_pids_new(&mqtteer_top_info, items, NTOP_ITEMS) < 0) {
+    fprintf(stderr, "failed to create the pids context\n");
+    exit(EXIT_FAILURE);
+  }
+  mqtteer_top_hertz = sysconf(_SC_CLK_TCK);
+  mqtteer_top_n = (unsigned)n;
+
+  for (unsigned kind = 0; kind < NTOP_KINDS; kind++) {
+    mqtteer_top_entries[kind] =
+        mmalloc(mqtteer_top_n * sizeof(struct mqtteer_top_entry));
+    mqtteer_top_ranks[kind] =
+        mmalloc(mqtteer_top_n * sizeof(struct mqtteer_top_rank));
+
+    for (unsigned i = 0; i < mqtteer_top_n; i++) {
+      struct mqtteer_top_rank *rank = &mqtteer_top_ranks[kind][i];
+      snprintf(name, sizeof(name), "top_%s_%u", TOP_KIND_NAMES[kind], i + 1);
+      if (kind == TOP_CPU) {
+        rank->slot = mqtteer_report_add(reports, name, MQTTEER_TYPE_DOUBLE,
+                                        "power_factor", "%");
+        mqtteer_report_set_deadband(reports, rank->slot, 1, 0);
+      } else {
+        rank->slot = mqtteer_report_add(reports, name,
+                                        MQTTEER_TYPE_UNSIGNED_LONG,
+                                        "data_size", "kB");
+        mqtteer_report_set_deadband(reports, rank->slot, 0, 0.01);
+      }
+      snprintf(name, sizeof(name), "top_%s_%u_name", TOP_KIND_NAMES[kind],
+               i + 1);
+      rank->name_slot =
+          mqtteer_report_add(reports, name, MQTTEER_TYPE_STR, NULL, NULL);
+    }
+  }
+}
+
+static void mqtteer_top_swap(unsigned *order, unsigned i, unsigned j) {
+  unsigned tmp = order[i];
+  order[i] = order[j];
+  order[j] = tmp;
+}
+
+// Move the indices of the n largest keys to the front of order, in
+// decreasing order. Only the partition holding the nth one is partitioned
+// again, in three so that the many idle processes sharing a key of 0 are
+// done with at once, then the n first are sorted.
+static void mqtteer_top_select(unsigned *order, const double *keys,
+                               unsigned count, unsigned n) {
+  unsigned lo = 0, hi = count, k = n - 1;
+
+  while (hi - lo > 1) {
+    double pivot = keys[order[lo + (hi - lo) / 2]];
+    // [lo, gt) above the pivot, [gt, i) equal to it, [lt, hi) below
+    unsigned gt = lo, i = lo, lt = hi;
+    while (i < lt) {
+      if (keys[order[i]] > pivot)
+        mqtteer_top_swap(order, i++, gt++);
+      else if (keys[order[i]] < pivot)
+        mqtteer_top_swap(order, i, --lt);
+      else
+        i++;
+    }
+
+    if (k < gt)
+      hi = gt;
+    else if (k >= lt)
+      lo = lt;
+    else
+      break;
+  }
+
+  for (unsigned i = 1; i < n; i++) {
+    unsigned index = order[i];
+    unsigned j = i;
+    for (; j > 0 && keys[order[j - 1]] < keys[index]; j--)
+      order[j] = order[j - 1];
+    order[j] = index;
+  }
+}
+
+// run by a worker, a host may have tens of thousands of processes
+void mqtteer_top_read(void) {
+  struct timespec now;
+
+  if (mqtteer_top_info == NULL)
+    return;
+
+  struct pids_fetch *fetch =
+      procps_pids_reap(mqtteer_top_info, PIDS_FETCH_TASKS_ONLY);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  memset(mqtteer_top_counts, 0, sizeof(mqtteer_top_counts));
+  if (fetch == NULL)
+    return;
+
+  double elapsed = (double)(now.tv_sec - mqtteer_top_reaped_at.tv_sec) +
+                   (double)(now.tv_nsec - mqtteer_top_reaped_at.tv_nsec) / 1e9;
+  // the first reap has no previous ticks to compare with
+  bool first = mqtteer_top_reaped_at.tv_sec == 0;
+  mqtteer_top_reaped_at = now;
+
+  unsigned count = (unsigned)fetch->counts->total;
+  if (count > mqtteer_top_cap) {
+    mqtteer_top_cap = count * 2;
+    mqtteer_top_order =
+        rrealloc(mqtteer_top_order, mqtteer_top_cap * sizeof(unsigned));
+    mqtteer_top_keys =
+        rrealloc(mqtteer_top_keys, mqtteer_top_cap * sizeof(double));
+  }
+  unsigned n = count < mqtteer_top_n ? count : mqtteer_top_n;
+  if (n == 0)
+    return;
+
+  for (unsigned kind = 0; kind < NTOP_KINDS; kind++) {
+    if (kind == TOP_CPU && (first || elapsed <= 0))
+      continue;
+
+    for (unsigned i = 0; i < count; i++) {
+      struct pids_stack *stack = fetch->stacks[i];
+      mqtteer_top_order[i] = i;
+      if (kind == TOP_CPU)
+        mqtteer_top_keys[i] = PIDS_VAL(TOP_ITEM_TICS, u_int, stack) * 100.0 /
+                              ((double)mqtteer_top_hertz * elapsed);
+      else
+        mqtteer_top_keys[i] = (double)PIDS_VAL(TOP_ITEM_RES, ul_int, stack);
+    }
+
+    mqtteer_top_select(mqtteer_top_order, mqtteer_top_keys, count, n);
+    mqtteer_top_counts[kind] = n;
+
+    for (unsigned i = 0; i < n; i++) {
+      struct pids_stack *stack = fetch->stacks[mqtteer_top_order[i]];
+      struct mqtteer_top_entry *entry = &mqtteer_top_entries[kind][i];
+      entry->pid = PIDS_VAL(TOP_ITEM_PID, s_int, stack);
+      snprintf(entry->cmd, sizeof(entry->cmd), "%s",
+               PIDS_VAL(TOP_ITEM_CMD, str, stack));
+      entry->value = mqtteer_top_keys[mqtteer_top_order[i]];
+    }
+  }
+}
+
+static void mqtteer_top_set_name(mqtteer_reports *reports,
+                                 struct mqtteer_top_rank *rank,
+                                 const struct mqtteer_top_entry *entry) {
+  const mqtteer_report *report = &reports->reports[rank->name_slot];
+  char name[TOP_NAME_SIZE];
+
+  snprintf(name, sizeof(name), "%s (%d)", entry->cmd, entry->pid);
+  if (report->has_value && strcmp(report->value.strval, name) == 0)
+    return;
+
+  char *buf = rank->names[0];
+  if (report->published && report->published_value.strval == buf)
+    buf = rank->names[1];
+  strcpy(buf, name);
+  mqtteer_report_set_str(reports, rank->name_slot, buf);
+}
+
+void mqtteer_top_reports(mqtteer_reports *reports) {
+  for (unsigned kind = 0; kind < NTOP_KINDS; kind++) {
+    for (unsigned i = 0; i < mqtteer_top_n; i++) {
+      struct mqtteer_top_rank *rank = &mqtteer_top_ranks[kind][i];
+      if (i >= mqtteer_top_counts[kind]) {
+        mqtteer_report_unset(reports, rank->slot);
+        mqtteer_report_unset(reports, rank->name_slot);
+        continue;
+      }
+
+      struct mqtteer_top_entry *entry = &mqtteer_top_entries[kind][i];
+      if (kind == TOP_CPU)
+        mqtteer_report_set_dbl(reports, rank->slot, entry->value);
+      else
+        mqtteer_report_set_ulong(reports, rank->slot,
+                                 (unsigned long)entry->value);
+      mqtteer_top_set_name(reports, rank, entry);
+    }
+  }
+}
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "mqtteer.h"
+
+// Worker pool. Jobs are the blocking part of a collection (reading hardware
+// that may hang), identified by the collector they belong to, and the lookup
+// of the broker's address. The main loop waits on an eventfd and picks up the
+// jobs that are done, the results are only touched by the worker until then.
+
+#define WORKERS_QUEUE_SIZE 32
+
+struct mqtteer_job {
+  unsigned id;
+  void (*fn)(void);
+};
+
+static pthread_mutex_t mqtteer_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mqtteer_workers_cond = PTHREAD_COND_INITIALIZER;
+// submitted jobs and the ids of finished ones, as rings
+static struct mqtteer_job mqtteer_jobs[WORKERS_QUEUE_SIZE];
+static unsigned mqtteer_jobs_head, mqtteer_njobs;
+static unsigned mqtteer_done[WORKERS_QUEUE_SIZE];
+static unsigned mqtteer_done_head, mqtteer_ndone;
+static int mqtteer_workers_event_fd = -1;
+
+static void *mqtteer_worker(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&mqtteer_workers_lock);
+  while (true) {
+    while (mqtteer_njobs == 0)
+      pthread_cond_wait(&mqtteer_workers_cond, &mqtteer_workers_lock);
+
+    struct mqtteer_job job = mqtteer_jobs[mqtteer_jobs_head];
+    mqtteer_jobs_head = (mqtteer_jobs_head + 1) % WORKERS_QUEUE_SIZE;
+    mqtteer_njobs--;
+    pthread_mutex_unlock(&mqtteer_workers_lock);
+
+    job.fn();
+
+    pthread_mutex_lock(&mqtteer_workers_lock);
+    // there are never more jobs than room for them
+    mqtteer_done[(mqtteer_done_head + mqtteer_ndone) % WORKERS_QUEUE_SIZE] =
+        job.id;
+    mqtteer_ndone++;
+    uint64_t one = 1;
+    if (write(mqtteer_workers_event_fd, &one, sizeof(one)) < 0)
+      perror("failed to signal a finished job");
+  }
+
+  return NULL;
+}
+
+void mqtteer_workers_init(unsigned nworkers) {
+  pthread_t thread;
+  sigset_t all, saved;
+
+  mqtteer_workers_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (mqtteer_workers_event_fd < 0) {
+    perror("eventfd failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // signals are for the main thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  for (unsigned i = 0; i < nworkers; i++) {
+    int ret = pthread_create(&thread, NULL, mqtteer_worker, NULL);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create failed: %s\n", strerror(ret));
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+int mqtteer_workers_fd(void) { return mqtteer_workers_event_fd; }
+
+void mqtteer_workers_submit(unsigned id, void (*fn)(void)) {
+  pthread_mutex_lock(&mqtteer_workers_lock);
+  if (mqtteer_njobs + mqtteer_ndone == WORKERS_QUEUE_SIZE) {
+    fprintf(stderr, "worker queue is full\n");
+    exit(EXIT_FAILURE);
+  }
+  mqtteer_jobs[(mqtteer_jobs_head + mqtteer_njobs) % WORKERS_QUEUE_SIZE] =
+      (struct mqtteer_job){id, fn};
+  mqtteer_njobs++;
+  pthread_cond_signal(&mqtteer_workers_cond);
+  pthread_mutex_unlock(&mqtteer_workers_lock);
+}
+
+// id of the next finished job, -1 when there is none left
+int mqtteer_workers_done(unsigned *id) {
+  uint64_t count;
+  int ret = -1;
+
+  pthread_mutex_lock(&mqtteer_workers_lock);
+  if (mqtteer_ndone > 0) {
+    *id = mqtteer_done[mqtteer_done_head];
+    mqtteer_done_head = (mqtteer_done_head + 1) % WORKERS_QUEUE_SIZE;
+    mqtteer_ndone--;
+    ret = 0;
+  } else if (read(mqtteer_workers_event_fd, &count, sizeof(count)) < 0 &&
+             errno != EAGAIN) {
+    perror("failed to read finished jobs");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_unlock(&mqtteer_workers_lock);
+
+  return ret;
+}